@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif /* HAVE_LINUX_FS_H */
+
+#include <openssl/evp.h>
+
+#include "applefile.h"
+#include "base64.h"
+#include "cache.h"
+#include "cksum.h"
+
+extern int		verbose;
+
+static char		*cache_dir = NULL;
+
+/*
+ * Entries are named by checksum, with base64's '/' made safe.  They
+ * are hard links to files lapply installed or was about to remove, and
+ * are checked against their name before use, since an installed file
+ * may have been changed in place.
+ */
+    static int
+cache_key( const char *cksum_b64, char *key, size_t len )
+{
+    char		*p;
+
+    if (( cache_dir == NULL ) || ( strcmp( cksum_b64, "-" ) == 0 )) {
+	return( -1 );
+    }
+    if ( snprintf( key, len, "%s/%s", cache_dir, cksum_b64 ) >= len ) {
+	return( -1 );
+    }
+    for ( p = key + strlen( cache_dir ) + 1; *p != '\0'; p++ ) {
+	if ( *p == '/' ) {
+	    *p = '_';
+	}
+    }
+    return( 0 );
+}
+
+    int
+cache_init( const char *dir )
+{
+    struct stat		st;
+
+    if ( mkdir( dir, 0700 ) != 0 ) {
+	if ( errno != EEXIST ) {
+	    perror( dir );
+	    return( -1 );
+	}
+    }
+    if ( stat( dir, &st ) != 0 ) {
+	perror( dir );
+	return( -1 );
+    }
+    if ( !S_ISDIR( st.st_mode )) {
+	fprintf( stderr, "%s: not a directory\n", dir );
+	return( -1 );
+    }
+
+    if (( cache_dir = strdup( dir )) == NULL ) {
+	perror( "strdup" );
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/* cheap test for lines read ahead, cache_retr() still checks the entry */
+    int
+cache_has( off_t size, const char *cksum_b64 )
+{
+    struct stat		st;
+    char		key[ MAXPATHLEN ];
+
+    if ( cache_key( cksum_b64, key, sizeof( key )) != 0 ) {
+	return( 0 );
+    }
+    if (( stat( key, &st ) != 0 ) || !S_ISREG( st.st_mode ) ||
+	    ( st.st_size != size )) {
+	return( 0 );
+    }
+    return( 1 );
+}
+
+/*
+ * Copy the entry for cksum_b64 to a temp file beside path, as retr()
+ * would have, cloning rather than copying where the filesystem can.
+ * The copy is check summed; an entry that doesn't match is removed.
+ *
+ * Return Value:
+ *	-1 - not cached
+ *	 0 - OKAY, the file is at temppath
+ */
+    int
+cache_retr( const filepath_t *path, filepath_t *temppath, mode_t tempmode,
+	off_t size, const char *cksum_b64 )
+{
+    struct stat		st;
+    char		key[ MAXPATHLEN ];
+    char		buf[ 65536 ];
+    char		cksum_copy[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    int			sfd, tfd, cloned = 0;
+    ssize_t		rr;
+
+    if ( cache_key( cksum_b64, key, sizeof( key )) != 0 ) {
+	return( -1 );
+    }
+    if (( sfd = open( key, O_RDONLY, 0 )) < 0 ) {
+	return( -1 );
+    }
+    if (( fstat( sfd, &st ) != 0 ) || !S_ISREG( st.st_mode ) ||
+	    (( size >= 0 ) && ( st.st_size != size ))) {
+	close( sfd );
+	return( -1 );
+    }
+
+    if ( snprintf( (char *) temppath, MAXPATHLEN, "%s.radmind.%i",
+	    (const char *) path, (int)getpid()) >= MAXPATHLEN ) {
+	close( sfd );
+	return( -1 );
+    }
+    if (( tfd = open( (char *) temppath, O_RDWR | O_CREAT | O_TRUNC,
+	    tempmode )) < 0 ) {
+	close( sfd );
+	return( -1 );
+    }
+
+#ifdef FICLONE
+    if ( ioctl( tfd, FICLONE, sfd ) == 0 ) {
+	cloned = 1;
+    }
+#endif /* FICLONE */
+    if ( !cloned ) {
+	while (( rr = read( sfd, buf, sizeof( buf ))) > 0 ) {
+	    if ( write( tfd, buf, (size_t)rr ) != rr ) {
+		goto error;
+	    }
+	}
+	if ( rr < 0 ) {
+	    goto error;
+	}
+    }
+    close( sfd );
+    sfd = -1;
+
+    if (( lseek( tfd, 0, SEEK_SET ) != 0 ) ||
+	    ( do_fcksum( tfd, cksum_copy ) != st.st_size )) {
+	goto error;
+    }
+    if ( strcmp( cksum_copy, cksum_b64 ) != 0 ) {
+	if ( verbose ) printf( "%s: cache entry changed\n", key );
+	unlink( key );
+	goto error;
+    }
+    if ( close( tfd ) != 0 ) {
+	tfd = -1;
+	goto error;
+    }
+
+    return( 0 );
+
+error:
+    if ( sfd >= 0 ) {
+	close( sfd );
+    }
+    if ( tfd >= 0 ) {
+	close( tfd );
+    }
+    unlink( (char *) temppath );
+    return( -1 );
+}
+
+/*
+ * Link path into the cache under cksum_b64, replacing any entry.  Only
+ * a link is made: a cache on another filesystem stays empty.
+ */
+    void
+cache_add( const filepath_t *path, const char *cksum_b64 )
+{
+    char		key[ MAXPATHLEN ];
+    char		temp[ MAXPATHLEN ];
+
+    if ( cache_key( cksum_b64, key, sizeof( key )) != 0 ) {
+	return;
+    }
+    if ( snprintf( temp, sizeof( temp ), "%s.radmind.%i", key,
+	    (int)getpid()) >= sizeof( temp )) {
+	return;
+    }
+    if ( link( (const char *) path, temp ) != 0 ) {
+	return;
+    }
+    if ( rename( temp, key ) != 0 ) {
+	unlink( temp );
+    }
+}
+
+/*
+ * Remove entries no longer linked to an installed file, so that
+ * between runs the cache takes no space of its own.
+ */
+    void
+cache_prune( void )
+{
+    DIR			*dir;
+    struct dirent	*de;
+    struct stat		st;
+    char		key[ MAXPATHLEN ];
+
+    if ( cache_dir == NULL ) {
+	return;
+    }
+    if (( dir = opendir( cache_dir )) == NULL ) {
+	perror( cache_dir );
+	return;
+    }
+    while (( de = readdir( dir )) != NULL ) {
+	if ( *de->d_name == '.' ) {
+	    continue;
+	}
+	if ( snprintf( key, sizeof( key ), "%s/%s", cache_dir,
+		de->d_name ) >= sizeof( key )) {
+	    continue;
+	}
+	if (( lstat( key, &st ) == 0 ) && S_ISREG( st.st_mode ) &&
+		( st.st_nlink == 1 )) {
+	    unlink( key );
+	}
+    }
+    closedir( dir );
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_CACHE_H)
+#  define _RADMIND_CACHE_H "$Id$"
+
+#  include "filepath.h"
+
+/*
+ * A client side store of file contents, named by transcript checksum.
+ * Nothing is cached until cache_init() is called.
+ */
+
+extern int  cache_init( const char *dir );
+extern int  cache_has( off_t size, const char *cksum_b64 );
+extern int  cache_retr( const filepath_t *path, filepath_t *temppath,
+	    mode_t tempmode, off_t size, const char *cksum_b64 );
+extern void cache_add( const filepath_t *path, const char *cksum_b64 );
+extern void cache_prune( void );
+
+#endif /* defined(_RADMIND_CACHE_H) */
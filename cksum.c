@@ -8,10 +8,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #ifdef __APPLE__
 #include <sys/paths.h>
 #endif /* __APPLE__ */
 #include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -23,10 +27,115 @@
 #include "applefile.h"
 #include "cksum.h"
 #include "base64.h"
+#include "digest.h"
 
 size_t rad_fcksum_bufsize	= DEFAULT_RAD_CKSUM_BUFSIZE;
 size_t rad_cksum_bufsize	= DEFAULT_RAD_CKSUM_BUFSIZE;
 size_t rad_acksum_bufsize	= DEFAULT_RAD_CKSUM_BUFSIZE;
+off_t rad_cksum_mmap_min	= DEFAULT_RAD_CKSUM_MMAP_MIN;
+
+struct cksum_stats		cksum_stats;
+
+/*
+ * The checksum engine keeps one buffer and one digest context from
+ * file to file, rather than allocating them for every checksum.
+ */
+static EVP_MD_CTX		*engine_ctx = NULL;
+static unsigned char		*engine_buf = NULL;
+static size_t			engine_bufsize = 0;
+static sigjmp_buf		engine_jmp;
+
+    static EVP_MD_CTX *
+cksum_ctx( void )
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    static EVP_MD_CTX		ctx;
+
+    if ( engine_ctx == NULL ) {
+	EVP_MD_CTX_init( &ctx );
+	engine_ctx = &ctx;
+    }
+#else /* OPENSSL_VERSION_NUMBER */
+    if ( engine_ctx == NULL ) {
+	engine_ctx = EVP_MD_CTX_new();
+    }
+#endif /* OPENSSL_VERSION_NUMBER */
+    return( engine_ctx );
+}
+
+/* page aligned, so reads can go straight to the buffer */
+    static unsigned char *
+cksum_buf( size_t bufsize )
+{
+    void			*p;
+
+    if ( bufsize <= engine_bufsize ) {
+	return( engine_buf );
+    }
+    if ( posix_memalign( &p, (size_t)getpagesize(), bufsize ) != 0 ) {
+	errno = ENOMEM;
+	return( NULL );
+    }
+    free( engine_buf );
+    engine_buf = (unsigned char *)p;
+    engine_bufsize = bufsize;
+    return( engine_buf );
+}
+
+    static void
+cksum_sigbus( int sig )
+{
+    siglongjmp( engine_jmp, 1 );
+}
+
+/*
+ * Checksum len bytes of fd through a mapping.  A file truncated while
+ * it's mapped raises SIGBUS, which is caught here.  The jump back can't
+ * cross threads, so digests that hash on other threads aren't mapped.
+ *
+ * return values:
+ *	0	checksummed
+ *	1	not checksummed, read the file instead
+ */
+    static int
+cksum_mmap( EVP_MD_CTX *ctx, int fd, off_t len )
+{
+    void			*map;
+    struct sigaction		sa, osa;
+    int				rc = 0;
+
+    if (( map = mmap( NULL, (size_t)len, PROT_READ, MAP_SHARED,
+	    fd, 0 )) == MAP_FAILED ) {
+	return( 1 );
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise( map, (size_t)len, MADV_SEQUENTIAL );
+#endif /* MADV_SEQUENTIAL */
+
+    memset( &sa, 0, sizeof( sa ));
+    sa.sa_handler = cksum_sigbus;
+    sigemptyset( &sa.sa_mask );
+    sigaction( SIGBUS, &sa, &osa );
+    if ( sigsetjmp( engine_jmp, 1 ) == 0 ) {
+	EVP_DigestUpdate( ctx, map, (size_t)len );
+    } else {
+	rc = 1;
+    }
+    sigaction( SIGBUS, &osa, NULL );
+
+    munmap( map, (size_t)len );
+    return( rc );
+}
+
+    static void
+cksum_time( struct timeval *begin )
+{
+    struct timeval		end;
+
+    gettimeofday( &end, NULL );
+    cksum_stats.cs_usec += ( end.tv_sec - begin->tv_sec ) * 1000000LL +
+	    ( end.tv_usec - begin->tv_usec );
+}
 
 /*
  * do_cksum calculates the checksum for PATH and returns it base64 encoded
@@ -44,31 +153,60 @@ do_fcksum_size( int fd, char *cksum_b64, size_t bufsize )
 {
     unsigned int	md_len;
     ssize_t		rr;
-    off_t		size = 0;
+    off_t		size = 0, offset;
     unsigned char	*p_buf;
     extern EVP_MD	*md;
-    EVP_MD_CTX		mdctx;
+    EVP_MD_CTX		*mdctx;
     unsigned char 	md_value[ EVP_MAX_MD_SIZE ];
+    struct stat		st;
+    struct timeval	begin;
 
-    EVP_DigestInit( &mdctx, md );
+    if ((( mdctx = cksum_ctx()) == NULL ) ||
+	    (( p_buf = cksum_buf( bufsize )) == NULL )) {
+	return( -1 );
+    }
 
-    if ((p_buf = (unsigned char *) malloc (bufsize)) == (unsigned char *) NULL) {
-        return (-1);
+    gettimeofday( &begin, NULL );
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif /* HAVE_POSIX_FADVISE */
+
+    EVP_DigestInit_ex( mdctx, md, NULL );
+
+    /* large files from the start are mapped, small ones read */
+    if (( rad_cksum_mmap_min > 0 ) && !digest_threaded( md ) &&
+	    (( offset = lseek( fd, 0, SEEK_CUR )) == 0 ) &&
+	    ( fstat( fd, &st ) == 0 ) && S_ISREG( st.st_mode ) &&
+	    ( st.st_size >= rad_cksum_mmap_min )) {
+	if ( cksum_mmap( mdctx, fd, st.st_size ) == 0 ) {
+	    size = st.st_size;
+	    cksum_stats.cs_mapped += size;
+	    goto done;
+	}
+	/* start over */
+	EVP_DigestInit_ex( mdctx, md, NULL );
+	if ( lseek( fd, offset, SEEK_SET ) < 0 ) {
+	    return( -1 );
+	}
     }
 
     while (( rr = read( fd, p_buf, bufsize)) > 0 ) {
 	size += rr;
-	EVP_DigestUpdate( &mdctx, p_buf, (unsigned int)rr );
+	EVP_DigestUpdate( mdctx, p_buf, (unsigned int)rr );
     }
-    free (p_buf);
 
     if ( rr < 0 ) {
 	return( -1 );
     }
 
-    EVP_DigestFinal( &mdctx, md_value, &md_len );
+done:
+    EVP_DigestFinal_ex( mdctx, md_value, &md_len );
     base64_e( md_value, md_len, cksum_b64 );
 
+    cksum_stats.cs_files++;
+    cksum_stats.cs_bytes += size;
+    cksum_time( &begin );
+
     return( size );
 }
 
@@ -99,6 +237,20 @@ do_cksum( const filepath_t *path, char *cksum_b64 )
     return( size );
 }
 
+    void
+cksum_stats_print( FILE *f )
+{
+    double		secs = cksum_stats.cs_usec / 1000000.0;
+
+    fprintf( f, "%llu files checksummed, %llu bytes ( %llu mapped ) "
+	    "in %.3f seconds", cksum_stats.cs_files, cksum_stats.cs_bytes,
+	    cksum_stats.cs_mapped, secs );
+    if ( secs > 0 ) {
+	fprintf( f, ", %.1f MB/s", cksum_stats.cs_bytes / secs / 1000000.0 );
+    }
+    fprintf( f, "\n" );
+}
+
 #ifdef __APPLE__
 
 /*
@@ -117,24 +269,27 @@ do_cksum( const filepath_t *path, char *cksum_b64 )
 do_acksum( const filepath_t *path, char *cksum_b64, struct applefileinfo *afinfo )
 {
     int		    	    	dfd, rfd, rc;
-    char			*p_buf;
+    unsigned char		*p_buf;
     filepath_t                  rsrc_path[ MAXPATHLEN ];
     off_t			size = 0;
     extern struct as_header	as_header;
     struct as_entry		as_entries_endian[ 3 ];
     unsigned int		md_len;
     extern EVP_MD		*md;
-    EVP_MD_CTX          	mdctx;
+    EVP_MD_CTX          	*mdctx;
     unsigned char       	md_value[ EVP_MAX_MD_SIZE ];
+    struct timeval		begin;
 
-    EVP_DigestInit( &mdctx, md ); 
-
-    if ((p_buf = (unsigned char *) malloc (rad_acksum_bufsize)) == (unsigned char *) NULL) {
-        return (-1);
+    if ((( mdctx = cksum_ctx()) == NULL ) ||
+	    (( p_buf = cksum_buf( rad_acksum_bufsize )) == NULL )) {
+	return( -1 );
     }
 
+    gettimeofday( &begin, NULL );
+    EVP_DigestInit_ex( mdctx, md, NULL );
+
     /* checksum applesingle header */
-    EVP_DigestUpdate( &mdctx, (char *)&as_header, AS_HEADERLEN );
+    EVP_DigestUpdate( mdctx, (char *)&as_header, AS_HEADERLEN );
     size += (size_t)AS_HEADERLEN;
 
     /* endian handling, sum big-endian header entries */
@@ -145,52 +300,52 @@ do_acksum( const filepath_t *path, char *cksum_b64, struct applefileinfo *afinfo
     as_entry_netswap( &as_entries_endian[ AS_DFE ] );
 
     /* checksum header entries */
-    EVP_DigestUpdate( &mdctx, (char *)&as_entries_endian,
+    EVP_DigestUpdate( mdctx, (char *)&as_entries_endian,
 		(unsigned int)( 3 * sizeof( struct as_entry )));
     size += sizeof( 3 * sizeof( struct as_entry ));
 
     /* checksum finder info data */
-    EVP_DigestUpdate( &mdctx, afinfo->ai.ai_data, FINFOLEN );
+    EVP_DigestUpdate( mdctx, afinfo->ai.ai_data, FINFOLEN );
     size += FINFOLEN;
 
     /* checksum rsrc fork data */
     if ( afinfo->as_ents[ AS_RFE ].ae_length > 0 ) {
       if ( snprintf( (char *) rsrc_path, MAXPATHLEN, "%s%s",
 		     (const char *) path, _PATH_RSRCFORKSPEC ) >= MAXPATHLEN ) {
-	    free (p_buf);
             errno = ENAMETOOLONG;
             return( -1 );
         }
 
         if (( rfd = open( (const char *) rsrc_path, O_RDONLY )) < 0 ) {
-	    free (p_buf);
 	    return( -1 );
 	}
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise( rfd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif /* HAVE_POSIX_FADVISE */
 	while (( rc = read( rfd, p_buf, rad_acksum_bufsize)) > 0 ) {
-	    EVP_DigestUpdate( &mdctx, p_buf, (unsigned int)rc );
+	    EVP_DigestUpdate( mdctx, p_buf, (unsigned int)rc );
 	    size += (size_t)rc;
 	}
 
 	if ( close( rfd ) < 0 ) {
-	    free (p_buf);
 	    return( -1 );
 	}
 	if ( rc < 0 ) {
-	    free (p_buf);
 	    return( -1 );
 	}
     }
 
     if (( dfd = open( (const char *) path, O_RDONLY, 0 )) < 0 ) {
-	free (p_buf);
 	return( -1 );
     }
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise( dfd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif /* HAVE_POSIX_FADVISE */
     /* checksum data fork */
     while (( rc = read( dfd, p_buf, rad_acksum_bufsize)) > 0 ) {
-	EVP_DigestUpdate( &mdctx, p_buf, (unsigned int)rc );
+	EVP_DigestUpdate( mdctx, p_buf, (unsigned int)rc );
 	size += (size_t)rc;
     }
-    free (p_buf);
 
     if ( rc < 0 ) {
 	return( -1 );
@@ -199,9 +354,13 @@ do_acksum( const filepath_t *path, char *cksum_b64, struct applefileinfo *afinfo
 	return( -1 );
     }
 
-    EVP_DigestFinal( &mdctx, md_value, &md_len );
+    EVP_DigestFinal_ex( mdctx, md_value, &md_len );
     base64_e( ( char*)&md_value, md_len, cksum_b64 );
 
+    cksum_stats.cs_files++;
+    cksum_stats.cs_bytes += size;
+    cksum_time( &begin );
+
     return( size );
 }
 #else /* __APPLE__ */
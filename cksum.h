@@ -18,4 +18,17 @@ extern size_t rad_fcksum_bufsize;
 extern size_t rad_cksum_bufsize;
 extern size_t rad_acksum_bufsize;
 
+/* files at least this large are mapped rather than read, 0 never maps */
+#define DEFAULT_RAD_CKSUM_MMAP_MIN ( 1024 * 1024 )
+extern off_t rad_cksum_mmap_min;
+
+struct cksum_stats {
+    unsigned long long	cs_files;	/* files checksummed */
+    unsigned long long	cs_bytes;	/* bytes checksummed */
+    unsigned long long	cs_mapped;	/* of those, bytes mapped */
+    unsigned long long	cs_usec;	/* time spent checksumming */
+};
+extern struct cksum_stats cksum_stats;
+extern void cksum_stats_print( FILE *f );
+
 #endif /* defined(_RADMIND_DO_CKSUM_H) */
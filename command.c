@@ -8,11 +8,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -20,13 +22,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <sysexits.h>
 
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif /* HAVE_LINUX_FS_H */
+
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/rand.h>
 
 #ifdef HAVE_LIBPAM
     #ifdef HAVE_PAM_PAM_APPL_H
@@ -51,12 +59,17 @@ extern SSL_CTX  *ctx;
 #include "command.h"
 #include "argcargv.h"
 #include "cksum.h"
+#include "digest.h"
 #include "code.h"
 #include "list.h"
 #include "wildcard.h"
 #include "largefile.h"
 #include "mkdirs.h"
 #include "connect.h"
+#include "delta.h"
+#include "tfile.h"
+#include "statcache.h"
+#include "verified.h"
 
 #define RADMIND_MAX_INCLUDE_DEPTH	10
 
@@ -70,17 +83,23 @@ extern SSL_CTX  *ctx;
 #define K_FILE 4
 
 int 		read_kfile( SNET *sn, const unsigned char *kfile );
+static int	transcript_access( const unsigned char *tran );
+static void	join_remove( const char *tran );
 
 int		f_quit( SNET *, int, char *[] );
 int		f_noop( SNET *, int, char *[] );
 int		f_help( SNET *, int, char *[] );
 int		f_stat( SNET *, int, char *[] );
 int		f_retr( SNET *, int, char *[] );
+int		f_delta( SNET *, int, char *[] );
 int		f_stor( SNET *, int, char *[] );
+int		f_have( SNET *, int, char *[] );
+int		f_join( SNET *, int, char *[] );
 int		f_noauth( SNET *, int, char *[] );
 int		f_notls( SNET *, int, char *[] );
 int		f_starttls( SNET *, int, char *[] );
 int		f_repo( SNET *, int, char *[] );
+int		f_cksum( SNET *, int, char *[] );
 #ifdef HAVE_LIBPAM
 int		f_login( SNET *, int, char *[] );
 int 		exchange( int num_msg, struct pam_message **msgm,
@@ -104,6 +123,7 @@ struct list	*access_list = NULL;
 int		ncommands = 0;
 int		authorized = 0;
 int		prevstor = 0;
+int		upload_joined = 0;
 int		case_sensitive = 1;
 char		hostname[ MAXHOSTNAMELEN ];
 #ifdef HAVE_ZLIB
@@ -122,8 +142,12 @@ struct command	notls[] = {
     { "STATus",		f_notls },
     { "RETRieve",	f_notls },
     { "STORe",		f_notls },
+    { "HAVE",		f_notls },
+    { "JOIN",		f_notls },
     { "STARttls",       f_starttls },
     { "REPOrt",         f_notls },
+    { "CKSUm",		f_notls },
+    { "DELTa",		f_notls },
 #ifdef HAVE_LIBPAM
     { "LOGIn",       	f_notls },
 #endif /* HAVE_LIBPAM */
@@ -139,7 +163,11 @@ struct command	noauth[] = {
     { "STATus",		f_noauth },
     { "RETRieve",	f_noauth },
     { "STORe",		f_noauth },
+    { "HAVE",		f_noauth },
+    { "JOIN",		f_noauth },
     { "REPOrt",         f_noauth },
+    { "CKSUm",		f_noauth },
+    { "DELTa",		f_noauth },
 #ifdef HAVE_LIBPAM
     { "LOGIn",       	f_noauth },
 #endif /* HAVE_LIBPAM */
@@ -155,8 +183,12 @@ struct command	auth[] = {
     { "STATus",		f_stat },
     { "RETRieve",	f_retr },
     { "STORe",		f_stor },
+    { "HAVE",		f_have },
+    { "JOIN",		f_join },
     { "STARttls",       f_starttls },
     { "REPOrt",         f_repo },
+    { "CKSUm",		f_cksum },
+    { "DELTa",		f_delta },
 #ifdef HAVE_LIBPAM
     { "LOGIn",       	f_login },
 #endif /* HAVE_LIBPAM */
@@ -301,19 +333,86 @@ keyword( int ac, char *av[] )
     return( rc );
 }
 
-    int
-f_retr( SNET *sn, int ac, char **av )
+/*
+ * A transcript may be published next to a gzip-compressed copy of
+ * itself, "name.gz".  Clients that see TGZ in CAPA ask for that name
+ * first.  Access is granted by the uncompressed name in the command file.
+ */
+    static int
+transcript_gz_base( const unsigned char *tran, char *base )
 {
+    size_t		len, slen = strlen( TFILE_GZIP_SUFFIX );
 
-    ssize_t		readlen;
-    struct stat		st;
-    struct timeval	tv;
-    char		buf[8192];
-    unsigned char	path[ MAXPATHLEN ];
+    len = strlen( (const char *) tran );
+    if ( len <= slen || len >= MAXPATHLEN ||
+	    strcmp( (const char *) tran + len - slen, TFILE_GZIP_SUFFIX ) != 0 ) {
+	return( 0 );
+    }
+    memcpy( base, tran, len - slen );
+    base[ len - slen ] = '\0';
+    return( 1 );
+}
+
+    static int
+transcript_access( const unsigned char *tran )
+{
+    char		base[ MAXPATHLEN ];
+
+    if ( list_check( access_list, tran )) {
+	return( 1 );
+    }
+    if ( !transcript_gz_base( tran, base )) {
+	return( 0 );
+    }
+    return( list_check( access_list, (const unsigned char *) base ));
+}
+
+/*
+ * A compressed copy older than its transcript, say one lcksum has since
+ * rewritten, is not served, and clients fall back to the transcript.
+ *
+ * Return Value:
+ *	0 - tran may be served
+ *	1 - tran is a stale compressed copy
+ */
+    static int
+transcript_gz_stale( const unsigned char *tran )
+{
+    char		base[ MAXPATHLEN ], path[ MAXPATHLEN ];
+    struct stat		st, gzst;
+
+    if ( !transcript_gz_base( tran, base )) {
+	return( 0 );
+    }
+    if ( snprintf( path, MAXPATHLEN, "transcript/%s%s", base,
+	    TFILE_GZIP_SUFFIX ) >= MAXPATHLEN ) {
+	return( 0 );
+    }
+    if ( stat( path, &gzst ) != 0 ) {
+	return( 0 );
+    }
+    path[ strlen( path ) - strlen( TFILE_GZIP_SUFFIX ) ] = '\0';
+    if ( stat( path, &st ) != 0 ) {
+	return( 0 );
+    }
+    return( gzst.st_mtime < st.st_mtime );
+}
+
+/*
+ * Map the arguments of a RETR, or the tail of a DELT, to a path under
+ * the server's directory, checking access.
+ *
+ * Return Value:
+ *	-1 - error, close the connection
+ *	 0 - OKAY
+ *	 1 - error sent to client
+ */
+    static int
+retr_path( SNET *sn, int ac, char **av, unsigned char *path )
+{
     const unsigned char
       *d_path = NULL,
       *d_tran = NULL;
-    int			fd;
 
     switch ( keyword( ac, av )) {
     case K_COMMAND:
@@ -358,11 +457,17 @@ f_retr( SNET *sn, int ac, char **av )
 	} 
 
 	/* Check for access */
-	if ( !list_check( access_list, d_tran )) {
+	if ( !transcript_access( d_tran )) {
 	  syslog( LOG_WARNING | LOG_AUTH, "attempt to access: %s", (const char *) d_tran );
 	  snet_writef( sn, "%d No access for %s\r\n", 540, (const char *) d_tran );
 	    return( 1 );
 	}
+	if ( transcript_gz_stale( d_tran )) {
+	    syslog( LOG_WARNING, "f_retr: %s: older than its transcript",
+		    (const char *) d_tran );
+	    snet_writef( sn, "%d %s: Stale copy\r\n", 531, (const char *) d_tran );
+	    return( 1 );
+	}
 
 	if ( snprintf( (char *) path, MAXPATHLEN, "transcript/%s", (const char *) d_tran )
 		>= MAXPATHLEN ) {
@@ -427,6 +532,46 @@ f_retr( SNET *sn, int ac, char **av )
 	return( 1 );
     }
 
+    return( 0 );
+}
+
+/*
+ * RETR FILE <transcript> <path> may be followed by an offset and a
+ * length, to retrieve only that much of the file.  The size sent is
+ * what's left of the file from offset, if that's less.
+ */
+    int
+f_retr( SNET *sn, int ac, char **av )
+{
+
+    ssize_t		readlen = 0;
+    struct stat		st;
+    struct timeval	tv;
+    char		buf[8192];
+    unsigned char	path[ MAXPATHLEN ];
+    char		*end;
+    off_t		offset = 0, length = -1;
+    int			fd, rc;
+
+    if (( ac == 6 ) && ( strcasecmp( av[ 1 ], "FILE" ) == 0 )) {
+	errno = 0;
+	offset = strtoofft( av[ 4 ], &end, 10 );
+	if (( errno != 0 ) || ( *end != '\0' ) || ( offset < 0 )) {
+	    snet_writef( sn, "%d RETR Syntax error\r\n", 540 );
+	    return( 1 );
+	}
+	length = strtoofft( av[ 5 ], &end, 10 );
+	if (( errno != 0 ) || ( *end != '\0' ) || ( length < 0 )) {
+	    snet_writef( sn, "%d RETR Syntax error\r\n", 540 );
+	    return( 1 );
+	}
+	ac = 4;
+    }
+
+    if (( rc = retr_path( sn, ac, av, path )) != 0 ) {
+	return( rc );
+    }
+
     if (( fd = open( (const char *) path, O_RDONLY, 0 )) < 0 ) {
         syslog( LOG_ERR, "open: %s: %m", (const char *)  path );
 	snet_writef( sn, "%d Unable to access %s.\r\n", 543, (const char *) path );
@@ -445,21 +590,39 @@ f_retr( SNET *sn, int ac, char **av )
 	return( 1 );
     }
 
+    if ( offset > st.st_size ) {
+	offset = st.st_size;
+    }
+    if (( length < 0 ) || ( length > st.st_size - offset )) {
+	length = st.st_size - offset;
+    }
+    if (( offset > 0 ) && ( lseek( fd, offset, SEEK_SET ) < 0 )) {
+	syslog( LOG_ERR, "f_retr: lseek: %m" );
+	return( -1 );
+    }
+
     /*
      * Here's a problem.  Do we need to add long long support to
      * snet_writef?
      */
-    snet_writef( sn, "240 Retrieving file\r\n%" PRIofft "\r\n", st.st_size );
+    snet_writef( sn, "240 Retrieving file\r\n%" PRIofft "\r\n", length );
 
     /* dump file */
 
-    while (( readlen = read( fd, buf, sizeof( buf ))) > 0 ) {
+    while (( length > 0 ) && (( readlen = read( fd, buf,
+	    MIN( sizeof( buf ), length ))) > 0 )) {
 	tv.tv_sec = 60 ;
 	tv.tv_usec = 0;
 	if ( snet_write( sn, buf, readlen, &tv ) != readlen ) {
 	    syslog( LOG_ERR, "snet_write: %m" );
 	    return( -1 );
 	}
+	length -= readlen;
+    }
+    /* the file shrank */
+    if (( length > 0 ) && ( readlen == 0 )) {
+	syslog( LOG_ERR, "f_retr: %s: short read", (const char *) path );
+	return( -1 );
     }
 
     if ( readlen < 0 ) {
@@ -479,20 +642,122 @@ f_retr( SNET *sn, int ac, char **av )
     return( 0 );
 }
 
+/*
+ * DELT <oldsize> <blocksize> FILE <transcript> <path>, followed by a
+ * signature for each block of the client's old copy.  The reply is the
+ * new size and the instructions of delta_send().
+ */
+    int
+f_delta( SNET *sn, int ac, char **av )
+{
+    struct stat		st;
+    struct timeval	tv;
+    unsigned char	path[ MAXPATHLEN ];
+    unsigned char	*sigs;
+    off_t		oldsize, count;
+    size_t		len, got;
+    ssize_t		rr;
+    long		blocksize;
+    char		*end;
+    int			fd, rc;
+
+    if ( ac < 3 ) {
+	snet_writef( sn, "%d DELT Syntax error\r\n", 501 );
+	return( -1 );
+    }
+    oldsize = strtoofft( av[ 1 ], &end, 10 );
+    if (( *end != '\0' ) || ( oldsize <= 0 )) {
+	snet_writef( sn, "%d DELT Syntax error\r\n", 501 );
+	return( -1 );
+    }
+    blocksize = strtol( av[ 2 ], &end, 10 );
+    if (( *end != '\0' ) || ( blocksize < DELTA_BLOCK_MIN ) ||
+	    ( blocksize > DELTA_BLOCK_MAX )) {
+	snet_writef( sn, "%d DELT Syntax error\r\n", 501 );
+	return( -1 );
+    }
+    count = ( oldsize + blocksize - 1 ) / blocksize;
+    if ( count > DELTA_COUNT_MAX ) {
+	snet_writef( sn, "%d DELT Too many blocks\r\n", 501 );
+	return( -1 );
+    }
+
+    /* the signatures follow whether or not we can use them */
+    len = (size_t)count * DELTA_SIG_LEN;
+    if (( sigs = malloc( len )) == NULL ) {
+	syslog( LOG_ERR, "f_delta: malloc: %m" );
+	return( -1 );
+    }
+    for ( got = 0; got < len; got += rr ) {
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	if (( rr = snet_read( sn, (char *)sigs + got, len - got,
+		&tv )) <= 0 ) {
+	    if ( rr == 0 ) {
+		syslog( LOG_ERR, "f_delta: snet_read: eof" );
+	    } else {
+		syslog( LOG_ERR, "f_delta: snet_read: %m" );
+	    }
+	    free( sigs );
+	    return( -1 );
+	}
+    }
+
+    if (( rc = retr_path( sn, ac - 2, av + 2, path )) != 0 ) {
+	free( sigs );
+	return( rc );
+    }
+
+    if (( fd = open( (const char *) path, O_RDONLY, 0 )) < 0 ) {
+	syslog( LOG_ERR, "open: %s: %m", (const char *) path );
+	snet_writef( sn, "%d Unable to access %s.\r\n", 543,
+		(const char *) path );
+	free( sigs );
+	return( 1 );
+    }
+    if ( fstat( fd, &st ) < 0 ) {
+	syslog( LOG_ERR, "f_delta: fstat: %m" );
+	snet_writef( sn, "%d Access Error: %s\r\n", 543, (const char *) path );
+	free( sigs );
+	if ( close( fd ) < 0 ) {
+	    syslog( LOG_ERR, "close: %m" );
+	    return( -1 );
+	}
+	return( 1 );
+    }
+
+    snet_writef( sn, "240 Delta follows\r\n%" PRIofft "\r\n", st.st_size );
+    rc = delta_send( sn, fd, st.st_size, oldsize, (int)blocksize, sigs );
+    free( sigs );
+    if ( rc != 0 ) {
+	return( -1 );
+    }
+    snet_writef( sn, ".\r\n" );
+
+    if ( close( fd ) < 0 ) {
+	syslog( LOG_ERR, "close: %m" );
+	return( -1 );
+    }
+
+    syslog( LOG_DEBUG, "f_delta: 'file' %s sent", path );
+
+    return( 0 );
+}
+
 /* looks for special file info in transcripts */
     char **
 special_t(const unsigned char *transcript, const unsigned char *epath )
 {
-    FILE		*fs;
+    tfile_t		*fs;
     int			ac, len;
     char		**av = (char **) NULL;
     static char         line[ MAXPATHLEN ];
 
-    if (( fs = fopen( (const char *) transcript, "r" )) == NULL ) {
+    if (( fs = tfile_open( (const char *) transcript )) == NULL ) {
 	return( NULL );
     }
 
-    while ( fgets( line, MAXPATHLEN, fs ) != NULL ) {
+    while ( tfile_gets( line, MAXPATHLEN, fs ) != NULL ) {
 	len = strlen( line );
 	if (( line[ len - 1 ] ) != '\n' ) {
 	    syslog( LOG_ERR, "special_t: %s: line too long", transcript );
@@ -507,12 +772,15 @@ special_t(const unsigned char *transcript, const unsigned char *epath )
 	}
 
 	if ( strcmp( (const char *) av[ 1 ], (const char *) epath ) == 0 ) { 
-	    (void)fclose( fs );
+	    (void)tfile_close( fs );
 	    return(av );
 	}
     }
+    if ( tfile_error( fs )) {
+	syslog( LOG_ERR, "special_t: %s: read error", transcript );
+    }
 
-    (void)fclose( fs );
+    (void)tfile_close( fs );
     return( NULL );
 }
 
@@ -571,11 +839,17 @@ f_stat( SNET *sn, int ac, char *av[] )
 	} 
 
 	/* Check for access */
-	if ( !list_check( access_list, d_tran )) {
+	if ( !transcript_access( d_tran )) {
 	  syslog( LOG_WARNING | LOG_AUTH, "attempt to access: %s", (const char *) d_tran );
 	  snet_writef( sn, "%d No access for %s\r\n", 540, (const char *) d_tran );
 	    return( 1 );
 	}
+	if ( transcript_gz_stale( d_tran )) {
+	    syslog( LOG_WARNING, "f_stat: %s: older than its transcript",
+		    (const char *) d_tran );
+	    snet_writef( sn, "%d %s: Stale copy\r\n", 531, (const char *) d_tran );
+	    return( 1 );
+	}
 
 	if ( snprintf( (char *) path, MAXPATHLEN, "transcript/%s", (const char *) d_tran )
 		>= MAXPATHLEN ) {
@@ -615,14 +889,16 @@ f_stat( SNET *sn, int ac, char *av[] )
     }
 
     /* XXX cksums here, totally the wrong place to do this! */
-    OpenSSL_add_all_digests();
-    md = EVP_get_digestbyname( "sha1" );
-    if ( !md ) {
-	/* XXX */
-	fprintf( stderr, "%s: unsupported checksum\n", "sha1" );
-	exit( EX_SOFTWARE );
+    if ( md == NULL ) {
+	OpenSSL_add_all_digests();
+	md = digest_byname( "sha1" );
+	if ( !md ) {
+	    /* XXX */
+	    fprintf( stderr, "%s: unsupported checksum\n", "sha1" );
+	    exit( EX_SOFTWARE );
+	}
     }
-    if ( do_cksum( path, cksum_b64 ) < 0 ) {
+    if ( stat_cache_cksum( path, &st, cksum_b64 ) < 0 ) {
         syslog( LOG_ERR, "do_cksum: (const char *) %s: %m", (const char *) path );
 	snet_writef( sn, "%d Checksum Error: %s: %m\r\n", 500, (const char *) path );
 	return( 1 );
@@ -719,6 +995,10 @@ f_stor( SNET *sn, int ac, char *av[] )
     unsigned char	upload[ MAXPATHLEN ];
     char		buf[ 8192 ];
     char		*line;
+    char		expected[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ] = "";
+    char		cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    unsigned char	md_value[ EVP_MAX_MD_SIZE ];
+    unsigned int	md_len;
     unsigned char
       *d_tran = NULL,
       *d_path = NULL;
@@ -728,6 +1008,7 @@ f_stor( SNET *sn, int ac, char *av[] )
     ssize_t		rc;
     struct timeval	tv;
     struct protoent	*proto;
+    EVP_MD_CTX		*mdctx = NULL;
 
     if ( !prevstor ) {
 	/* Turn off TCP_NODELAY for stores */
@@ -748,6 +1029,17 @@ f_stor( SNET *sn, int ac, char *av[] )
 	snet_writef( sn, "%d Not logged in\r\n", 551 );
 	exit( EX_NOUSER );
     }
+
+    /* STOR FILE <transcript> <path> <checksum> is checked as it's written */
+    if (( ac == 5 ) && ( strcasecmp( av[ 1 ], "FILE" ) == 0 )) {
+	if ( strlen( av[ 4 ] ) >= sizeof( expected )) {
+	    snet_writef( sn, "%d STOR Syntax error\r\n", 550 );
+	    exit( EX_DATAERR );
+	}
+	strcpy( expected, av[ 4 ] );
+	ac = 4;
+    }
+
     /* decode() uses static mem, so strdup() */
     if (( d_tran = (unsigned char *) decode( av[ 2 ] )) == NULL ) {
 	syslog( LOG_ERR, "f_stor: decode: buffer too small" );
@@ -794,6 +1086,12 @@ f_stor( SNET *sn, int ac, char *av[] )
 
 	    return( 1 );
 	}
+	if ( upload_joined &&
+		( strcmp( (const char *) upload_xscript, av[ 2 ] ) == 0 )) {
+	    /* JOIN made the directory, the files are already there */
+	    join_remove( (const char *) d_tran );
+	    break;
+	}
 	strncpy( (char *) upload_xscript, av[ 2 ], sizeof(upload_xscript)-1);
 
 	/* make the directory for the files of this xscript to live in. */
@@ -887,6 +1185,22 @@ f_stor( SNET *sn, int ac, char *av[] )
     }
 
 
+    if ( *expected != '\0' ) {
+	/* sha1 unless the client said otherwise, as for STAT */
+	if ( md == NULL ) {
+	    OpenSSL_add_all_digests();
+	    md = digest_byname( "sha1" );
+	}
+	if (( md == NULL ) || (( mdctx = verified_ctx( )) == NULL )) {
+	    syslog( LOG_ERR, "f_stor: no checksum context" );
+	    snet_writef( sn, "%d %s: internal error!\r\n", 555,
+		    (const char *) upload );
+	    (void)unlink( (const char *) upload );
+	    exit( 1 );
+	}
+	EVP_DigestInit_ex( mdctx, md, NULL );
+    }
+
     snet_writef( sn, "%d Storing file\r\n", 350 );
 
     tv.tv_sec = 60;
@@ -916,6 +1230,9 @@ f_stor( SNET *sn, int ac, char *av[] )
 			 strerror( errno ));
 	    exit( EX_IOERR );
 	}
+	if ( mdctx != NULL ) {
+	    EVP_DigestUpdate( mdctx, buf, (unsigned int)rc );
+	}
     }
 
     if ( len != 0 ) {
@@ -924,6 +1241,24 @@ f_stor( SNET *sn, int ac, char *av[] )
 	exit( 1 );
     }
 
+    if ( mdctx != NULL ) {
+	EVP_DigestFinal_ex( mdctx, md_value, &md_len );
+	base64_e( md_value, md_len, cksum_b64 );
+	if ( strcmp( cksum_b64, expected ) != 0 ) {
+	    syslog( LOG_WARNING, "f_stor: %s: checksum wrong",
+		    (const char *) upload );
+	    snet_writef( sn, "%d %s: checksum wrong\r\n", 555,
+		    (const char *) upload );
+	    (void)unlink( (const char *) upload );
+	    exit( EX_DATAERR );
+	}
+	/* lcksum needn't read it again, where that can be recorded */
+	if (( verified_mark( fd, cksum_b64 ) != 0 ) && ( errno != ENOTSUP )) {
+	    syslog( LOG_WARNING, "f_stor: %s: verified_mark: %m",
+		    (const char *) upload );
+	}
+    }
+
     if ( close( fd ) < 0 ) {
         snet_writef( sn, "%d %s: %s\r\n", 555, (const char *) upload,
 		     strerror( errno ));
@@ -952,6 +1287,571 @@ f_stor( SNET *sn, int ac, char *av[] )
     return( 0 );
 }
 
+/*
+ * Files the server already has, from the transcripts in the transcript
+ * directory, by size and checksum.  Read when a connection first sends
+ * HAVE: from tmp/have if it was written since the transcript directory
+ * last changed, otherwise from the transcripts, writing tmp/have again
+ * for the connections that follow.
+ *
+ * tmp/have is the transcript directory's mtime on a line, then a line
+ * per file of its transcript, size, checksum and path, names encoded.
+ */
+typedef struct stored_entry stored_entry_t;
+
+struct stored_entry {
+    stored_entry_t	*se_next;
+    off_t		se_size;
+    char		*se_cksum;
+    char		*se_tran;
+    char		*se_path;
+};
+
+#define STORED_BUCKETS	65536
+#define STORED_INDEX	"tmp/have"
+
+static stored_entry_t	**stored_table = NULL;
+static FILE		*stored_out = NULL;
+
+    static unsigned int
+stored_hash( const char *cksum_b64 )
+{
+    unsigned int	h = 0;
+
+    while ( *cksum_b64 != '\0' ) {
+	h = h * 31 + (unsigned char)*cksum_b64++;
+    }
+    return( h % STORED_BUCKETS );
+}
+
+    static int
+stored_add( off_t size, const char *cksum_b64, const char *tran,
+	const char *path )
+{
+    stored_entry_t	*se;
+    unsigned int	h = stored_hash( cksum_b64 );
+
+    for ( se = stored_table[ h ]; se != NULL; se = se->se_next ) {
+	if (( se->se_size == size ) &&
+		( strcmp( se->se_cksum, cksum_b64 ) == 0 ) &&
+		( strcmp( se->se_tran, tran ) == 0 )) {
+	    return( 0 );
+	}
+    }
+    if ((( se = malloc( sizeof( stored_entry_t ))) == NULL ) ||
+	    (( se->se_cksum = strdup( cksum_b64 )) == NULL ) ||
+	    (( se->se_tran = strdup( tran )) == NULL ) ||
+	    (( se->se_path = strdup( path )) == NULL )) {
+	syslog( LOG_ERR, "stored_add: malloc: %m" );
+	return( -1 );
+    }
+    se->se_size = size;
+    se->se_next = stored_table[ h ];
+    stored_table[ h ] = se;
+
+    if ( stored_out != NULL ) {
+	/* encode() uses static mem */
+	fprintf( stored_out, "%s ", encode( tran ));
+	fprintf( stored_out, "%" PRIofft " %s %s\n", size, cksum_b64,
+		encode( path ));
+    }
+    return( 0 );
+}
+
+/*
+ * Return Value:
+ *	-1 - tmp/have isn't there, or is out of date
+ *	 0 - OKAY
+ */
+    static int
+stored_read( ACAV *acav, time_t mtime )
+{
+    FILE		*f;
+    char		**targv;
+    char		line[ 4 * MAXPATHLEN ];
+    char		tran[ MAXPATHLEN ];
+    const char		*d;
+    int			tac;
+
+    if (( f = fopen( STORED_INDEX, "r" )) == NULL ) {
+	return( -1 );
+    }
+    if (( fgets( line, sizeof( line ), f ) == NULL ) ||
+	    ( strtol( line, NULL, 10 ) != (long)mtime )) {
+	fclose( f );
+	return( -1 );
+    }
+    while ( fgets( line, sizeof( line ), f ) != NULL ) {
+	tac = acav_parse( acav, line, &targv );
+	if (( tac != 4 ) || (( d = decode( targv[ 0 ] )) == NULL ) ||
+		( strlen( d ) >= sizeof( tran ))) {
+	    continue;
+	}
+	strcpy( tran, d );
+	if (( d = decode( targv[ 3 ] )) == NULL ) {
+	    continue;
+	}
+	if ( stored_add( strtoofft( targv[ 1 ], NULL, 10 ), targv[ 2 ],
+		tran, d ) != 0 ) {
+	    break;
+	}
+    }
+    fclose( f );
+    return( 0 );
+}
+
+    static int
+stored_load( void )
+{
+    DIR			*dir;
+    struct dirent	*de;
+    struct stat		st, dst;
+    tfile_t		*tf;
+    ACAV		*acav;
+    char		**targv;
+    char		line[ 2 * MAXPATHLEN ];
+    char		tpath[ MAXPATHLEN ];
+    char		fpath[ MAXPATHLEN ];
+    char		base[ MAXPATHLEN ];
+    char		temp[ MAXPATHLEN ];
+    const char		*d_path, *tname;
+    time_t		now;
+    int			tac, len, complete = 1;
+
+    if (( stored_table = calloc( STORED_BUCKETS,
+	    sizeof( stored_entry_t * ))) == NULL ) {
+	syslog( LOG_ERR, "stored_load: calloc: %m" );
+	return( -1 );
+    }
+    if (( acav = acav_alloc( )) == NULL ) {
+	syslog( LOG_ERR, "stored_load: acav_alloc: %m" );
+	return( -1 );
+    }
+    now = time( NULL );
+    if ( stat( "transcript", &dst ) != 0 ) {
+	syslog( LOG_ERR, "stored_load: stat: transcript: %m" );
+	acav_free( acav );
+	return( -1 );
+    }
+    if ( stored_read( acav, dst.st_mtime ) == 0 ) {
+	acav_free( acav );
+	return( 0 );
+    }
+
+    if (( dir = opendir( "transcript" )) == NULL ) {
+	syslog( LOG_ERR, "stored_load: opendir: transcript: %m" );
+	acav_free( acav );
+	return( -1 );
+    }
+
+    /* a change later in the same second would look the same */
+    if (( dst.st_mtime < now ) && ( snprintf( temp, sizeof( temp ),
+	    "%s.%d", STORED_INDEX, (int)getpid( )) < sizeof( temp )) &&
+	    (( stored_out = fopen( temp, "w" )) != NULL )) {
+	fprintf( stored_out, "%ld\n", (long)dst.st_mtime );
+    }
+
+    while (( de = readdir( dir )) != NULL ) {
+	if (( *de->d_name == '.' ) || ( snprintf( tpath, sizeof( tpath ),
+		"transcript/%s", de->d_name ) >= sizeof( tpath ))) {
+	    continue;
+	}
+	tname = de->d_name;
+	if ( transcript_gz_base( (const unsigned char *) tname, base )) {
+	    /* a compressed copy is only read without its transcript */
+	    if (( snprintf( tpath, sizeof( tpath ), "transcript/%s",
+		    base ) >= sizeof( tpath )) || ( stat( tpath, &st ) == 0 )) {
+		continue;
+	    }
+	    snprintf( tpath, sizeof( tpath ), "transcript/%s", tname );
+	    tname = base;
+	}
+	if (( tf = tfile_open( tpath )) == NULL ) {
+	    continue;
+	}
+	while ( tfile_gets( line, sizeof( line ), tf ) != NULL ) {
+	    tac = acav_parse( acav, line, &targv );
+	    if (( tac != 8 ) || ( *targv[ 0 ] != 'f' ) ||
+		    ( strcmp( targv[ 7 ], "-" ) == 0 ) ||
+		    (( d_path = decode( targv[ 1 ] )) == NULL )) {
+		continue;
+	    }
+	    len = snprintf( fpath, sizeof( fpath ),
+		    ( *d_path == '/' ) ? "file/%s%s" : "file/%s/%s",
+		    tname, d_path );
+	    if (( len < 0 ) || ( len >= sizeof( fpath ))) {
+		continue;
+	    }
+	    if ( stored_add( strtoofft( targv[ 6 ], NULL, 10 ), targv[ 7 ],
+		    tname, fpath ) != 0 ) {
+		break;
+	    }
+	}
+	if ( tfile_error( tf )) {
+	    /* what was read is still checked before it's used */
+	    syslog( LOG_ERR, "stored_load: %s: read error", tpath );
+	    complete = 0;
+	}
+	tfile_close( tf );
+    }
+    acav_free( acav );
+    closedir( dir );
+
+    if ( stored_out != NULL ) {
+	/* only kept if the transcripts didn't change while being read */
+	if (( fclose( stored_out ) != 0 ) || !complete ||
+		( stat( "transcript", &st ) != 0 ) ||
+		( st.st_mtime != dst.st_mtime ) ||
+		( rename( temp, STORED_INDEX ) != 0 )) {
+	    (void)unlink( temp );
+	}
+	stored_out = NULL;
+    }
+    return( 0 );
+}
+
+/*
+ * A stored file is linked, or cloned where the filesystem can, to the
+ * upload.  Both are only ever replaced, never written to.
+ */
+    static int
+stored_link( const char *path, const char *upload )
+{
+#ifdef FICLONE
+    int			sfd, dfd;
+#endif /* FICLONE */
+    int			rc = -1;
+
+    if ( link( path, upload ) == 0 ) {
+	return( 0 );
+    }
+    if (( errno == ENOENT ) && ( mkdirs( (unsigned char *) upload ) == 0 ) &&
+	    ( link( path, upload ) == 0 )) {
+	return( 0 );
+    }
+#ifdef FICLONE
+    if (( errno != EXDEV ) && ( errno != EMLINK )) {
+	return( -1 );
+    }
+    if (( sfd = open( path, O_RDONLY, 0 )) < 0 ) {
+	return( -1 );
+    }
+    if (( dfd = open( upload, O_CREAT | O_EXCL | O_WRONLY, 0666 )) >= 0 ) {
+	rc = ioctl( dfd, FICLONE, sfd );
+	if (( close( dfd ) != 0 ) || ( rc != 0 )) {
+	    unlink( upload );
+	    rc = -1;
+	}
+    }
+    close( sfd );
+#endif /* FICLONE */
+    return( rc );
+}
+
+/*
+ * HAVE FILE <transcript> <path> <size> <checksum> stores path in the
+ * transcript being uploaded from a file the server already has, if any,
+ * so that it needn't be sent.  The checksum is the client's, so the
+ * file found is check summed again, in case its transcript is out of
+ * date.
+ */
+    int
+f_have( SNET *sn, int ac, char **av )
+{
+    unsigned char	upload[ MAXPATHLEN ];
+    char		d_tran[ MAXPATHLEN ];
+    char		cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    const char		*d;
+    stored_entry_t	*se;
+    struct stat		st;
+    off_t		size;
+    int			len, fd;
+
+    if ( checkuser && ( !authorized )) {
+	snet_writef( sn, "%d Not logged in\r\n", 551 );
+	exit( EX_NOUSER );
+    }
+    if (( ac != 6 ) || ( strcasecmp( av[ 1 ], "FILE" ) != 0 )) {
+	snet_writef( sn, "%d HAVE Syntax error\r\n", 550 );
+	return( 1 );
+    }
+    /* as STOR FILE, only for the transcript being uploaded */
+    if ( strcmp( (const char *) upload_xscript, av[ 2 ] ) != 0 ) {
+	snet_writef( sn, "%d Incorrect Transcript %s\r\n", 552, av[ 2 ] );
+	return( 1 );
+    }
+
+    /* decode() uses static mem */
+    if ((( d = decode( av[ 2 ] )) == NULL ) ||
+	    ( strlen( d ) >= sizeof( d_tran ))) {
+	snet_writef( sn, "%d Line too long\r\n", 540 );
+	return( 1 );
+    }
+    strcpy( d_tran, d );
+    if (( d = decode( av[ 3 ] )) == NULL ) {
+	snet_writef( sn, "%d Line too long\r\n", 540 );
+	return( 1 );
+    }
+    len = snprintf( (char *) upload, sizeof( upload ),
+	    ( *d == '/' ) ? "tmp/file/%s%s" : "tmp/file/%s/%s", d_tran, d );
+    if (( len < 0 ) || ( len >= sizeof( upload ))) {
+	snet_writef( sn, "%d Path too long\r\n", 540 );
+	return( 1 );
+    }
+    size = strtoofft( av[ 4 ], NULL, 10 );
+
+    /* sha1 unless the client said otherwise, as for STAT */
+    if ( md == NULL ) {
+	OpenSSL_add_all_digests();
+	md = digest_byname( "sha1" );
+    }
+
+    if (( md != NULL ) &&
+	    (( stored_table != NULL ) || ( stored_load( ) == 0 ))) {
+	for ( se = stored_table[ stored_hash( av[ 5 ] )]; se != NULL;
+		se = se->se_next ) {
+	    if (( se->se_size != size ) ||
+		    ( strcmp( se->se_cksum, av[ 5 ] ) != 0 )) {
+		continue;
+	    }
+	    /* only from transcripts this connection could RETR from */
+	    if ( !transcript_access( (const unsigned char *) se->se_tran )) {
+		continue;
+	    }
+	    if (( stat( se->se_path, &st ) != 0 ) || !S_ISREG( st.st_mode ) ||
+		    ( st.st_size != size ) ||
+		    ( do_cksum( (filepath_t *) se->se_path, cksum_b64 ) != size )
+		    || ( strcmp( cksum_b64, av[ 5 ] ) != 0 )) {
+		continue;
+	    }
+	    if ( stored_link( se->se_path, (const char *) upload ) != 0 ) {
+		syslog( LOG_ERR, "f_have: %s: %m", (const char *) upload );
+		break;
+	    }
+	    /* linking changed its ctime, but it was just checked */
+	    if (( fd = open( (const char *) upload, O_RDONLY, 0 )) >= 0 ) {
+		(void)verified_mark( fd, cksum_b64 );
+		close( fd );
+	    }
+	    syslog( LOG_DEBUG, "f_have: file %s stored from %s",
+		    (const char *) upload, se->se_path );
+	    snet_writef( sn, "%d File stored\r\n", 250 );
+	    return( 0 );
+	}
+    }
+
+    snet_writef( sn, "%d File not held\r\n", 451 );
+    return( 0 );
+}
+
+/*
+ * The connection that begins an upload is given a nonce, kept in
+ * tmp/join/<transcript> until the transcript is stored, and only a
+ * connection presenting it can join.
+ */
+#define JOIN_NONCE_LEN	16
+
+    static int
+join_path( const char *tran, char *path, size_t len )
+{
+    if ( snprintf( path, len, "tmp/join/%s", tran ) >= len ) {
+	errno = ENAMETOOLONG;
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY, nonce is the new nonce in hex
+ */
+    static int
+join_begin( const char *tran, char *nonce )
+{
+    char		path[ MAXPATHLEN ];
+    unsigned char	r[ JOIN_NONCE_LEN ];
+    int			fd, i;
+
+    if ( join_path( tran, path, sizeof( path )) != 0 ) {
+	return( -1 );
+    }
+    if ( RAND_bytes( r, sizeof( r )) != 1 ) {
+	errno = EIO;
+	return( -1 );
+    }
+    for ( i = 0; i < JOIN_NONCE_LEN; i++ ) {
+	sprintf( nonce + 2 * i, "%02x", r[ i ] );
+    }
+
+    /* one left by an upload that was abandoned is replaced */
+    if (( fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0600 )) < 0 ) {
+	if (( errno != ENOENT ) || ( mkdirs( (filepath_t *) path ) < 0 ) ||
+		(( fd = open( path, O_WRONLY | O_CREAT | O_TRUNC,
+		0600 )) < 0 )) {
+	    return( -1 );
+	}
+    }
+    if ( write( fd, nonce, 2 * JOIN_NONCE_LEN ) != 2 * JOIN_NONCE_LEN ) {
+	close( fd );
+	unlink( path );
+	return( -1 );
+    }
+    if ( close( fd ) != 0 ) {
+	unlink( path );
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * Return Value:
+ *	0 - nonce isn't the one tran's upload was begun with
+ *	1 - it is
+ */
+    static int
+join_check( const char *tran, const char *nonce )
+{
+    char		path[ MAXPATHLEN ];
+    char		saved[ 2 * JOIN_NONCE_LEN ];
+    int			fd;
+    ssize_t		rc;
+
+    if (( strlen( nonce ) != 2 * JOIN_NONCE_LEN ) ||
+	    ( join_path( tran, path, sizeof( path )) != 0 ) ||
+	    (( fd = open( path, O_RDONLY, 0 )) < 0 )) {
+	return( 0 );
+    }
+    rc = read( fd, saved, sizeof( saved ));
+    close( fd );
+    if ( rc != sizeof( saved )) {
+	return( 0 );
+    }
+    return( CRYPTO_memcmp( saved, nonce, sizeof( saved )) == 0 );
+}
+
+    static void
+join_remove( const char *tran )
+{
+    char		path[ MAXPATHLEN ];
+
+    if (( join_path( tran, path, sizeof( path )) == 0 ) &&
+	    ( unlink( path ) != 0 ) && ( errno != ENOENT )) {
+	syslog( LOG_WARNING, "join_remove: %s: %m", path );
+    }
+}
+
+/*
+ * JOIN <transcript> begins the upload of a transcript whose files are
+ * sent first, and the reply carries the upload's nonce.  JOIN
+ * <transcript> <nonce> joins one begun on another connection, so that a
+ * client can STOR its files over several connections at once.  The
+ * transcript is stored last, with STOR TRANSCRIPT on any of them, and
+ * until then the upload is incomplete.
+ */
+    int
+f_join( SNET *sn, int ac, char **av )
+{
+    char		xscriptdir[ MAXPATHLEN ];
+    char		upload[ MAXPATHLEN ];
+    char		nonce[ 2 * JOIN_NONCE_LEN + 1 ];
+    struct stat		st;
+    const char		*d_tran;
+
+    if ( checkuser && ( !authorized )) {
+	snet_writef( sn, "%d Not logged in\r\n", 551 );
+	exit( EX_NOUSER );
+    }
+    if (( ac != 2 ) && ( ac != 3 )) {
+	snet_writef( sn, "%d JOIN Syntax error\r\n", 550 );
+	return( 1 );
+    }
+    if (( strlen( av[ 1 ] ) >= sizeof( upload_xscript )) ||
+	    (( d_tran = decode( av[ 1 ] )) == NULL )) {
+	snet_writef( sn, "%d Line too long\r\n", 540 );
+	return( 1 );
+    }
+    if (( snprintf( xscriptdir, sizeof( xscriptdir ), "tmp/file/%s",
+	    d_tran ) >= sizeof( xscriptdir )) ||
+	    ( snprintf( upload, sizeof( upload ), "tmp/transcript/%s",
+	    d_tran ) >= sizeof( upload ))) {
+	snet_writef( sn, "%d Path too long\r\n", 540 );
+	return( 1 );
+    }
+
+    if ( ac == 2 ) {
+	if ( mkdir( xscriptdir, 0777 ) < 0 ) {
+	    if ( errno == EEXIST ) {
+		snet_writef( sn, "%d Transcript exists\r\n", 551 );
+		exit( EX_DATAERR );
+	    }
+	    snet_writef( sn, "%d %s: %s\r\n", 551, xscriptdir,
+		    strerror( errno ));
+	    exit( 1 );
+	}
+	if ( join_begin( d_tran, nonce ) != 0 ) {
+	    syslog( LOG_ERR, "f_join: %s: join_begin: %m", d_tran );
+	    snet_writef( sn, "%d %s: %s\r\n", 551, d_tran,
+		    strerror( errno ));
+	    (void)rmdir( xscriptdir );
+	    exit( 1 );
+	}
+	strncpy( (char *) upload_xscript, av[ 1 ],
+		sizeof( upload_xscript ) - 1 );
+	upload_joined = 1;
+	syslog( LOG_DEBUG, "f_join: %s begun", xscriptdir );
+	snet_writef( sn, "%d Upload begun %s\r\n", 250, nonce );
+	return( 0 );
+    }
+
+    /*
+     * Only an upload in progress, begun with this nonce and whose
+     * transcript hasn't arrived, can be joined.
+     */
+    if (( lstat( xscriptdir, &st ) != 0 ) || !S_ISDIR( st.st_mode ) ||
+	    !join_check( d_tran, av[ 2 ] )) {
+	syslog( LOG_WARNING, "f_join: %s: no such upload", xscriptdir );
+	snet_writef( sn, "%d No such upload\r\n", 551 );
+	exit( EX_DATAERR );
+    }
+    if ( lstat( upload, &st ) == 0 ) {
+	snet_writef( sn, "%d Transcript exists\r\n", 551 );
+	exit( EX_DATAERR );
+    }
+
+    strncpy( (char *) upload_xscript, av[ 1 ], sizeof( upload_xscript ) - 1 );
+    upload_joined = 1;
+    syslog( LOG_DEBUG, "f_join: %s joined", xscriptdir );
+    snet_writef( sn, "%d Upload joined\r\n", 250 );
+    return( 0 );
+}
+
+/*
+ * Clients checksumming with something other than sha1 say so, so that
+ * STAT returns checksums they can compare.
+ */
+    int
+f_cksum( SNET *sn, int ac, char **av )
+{
+    const EVP_MD	*cmd;
+
+    if ( ac != 2 ) {
+	snet_writef( sn, "%d Syntax error\r\n", 501 );
+	return( 1 );
+    }
+
+    OpenSSL_add_all_digests();
+    if (( cmd = digest_byname( av[ 1 ] )) == NULL ) {
+	syslog( LOG_WARNING, "f_cksum: %s: unsupported checksum", av[ 1 ] );
+	snet_writef( sn, "%d %s: unsupported checksum\r\n", 525, av[ 1 ] );
+	return( 1 );
+    }
+    md = cmd;
+
+    snet_writef( sn, "%d Checksum %s\r\n", 200, digest_name( md ));
+    return( 0 );
+}
+
     int
 f_repo( SNET *sn, int ac, char **av )
 {
@@ -1449,8 +2349,8 @@ read_kfile( SNET *sn, const unsigned char *kfile )
 	switch( *av[ 0 ] ) {
 	case 'k':
 	  if ( !list_check( access_list, (const unsigned char *) av[ 1 ] )) {
-	    if ( list_insert( access_list, (unsigned char *) av[ 1 ] ) != 0 ) {
-		    syslog( LOG_ERR, "list_insert: %m" );
+	    if ( list_insert_tail( access_list, (unsigned char *) av[ 1 ] ) != 0 ) {
+		    syslog( LOG_ERR, "list_insert_tail: %m" );
 		    snet_writef( sn,
 	"%d Service not available, closing transmission channel\r\n", 421 );
 		    goto error;
@@ -1464,8 +2364,8 @@ read_kfile( SNET *sn, const unsigned char *kfile )
 	case 'p':
 	case 'n':
 	  if ( !list_check( access_list, (unsigned char *) av[ 1 ] )) {
-	    if ( list_insert( access_list, (const unsigned char *) av[ 1 ] ) != 0 ) {
-		    syslog( LOG_ERR, "list_insert: %m" );
+	    if ( list_insert_tail( access_list, (const unsigned char *) av[ 1 ] ) != 0 ) {
+		    syslog( LOG_ERR, "list_insert_tail: %m" );
 		    snet_writef( sn,
 	"%d Service not available, closing transmission channel\r\n", 421 );
 		    goto error;
@@ -1616,6 +2516,13 @@ cmdloop( int fd, struct sockaddr_in *sin )
 	}
 #endif /* HAVE_ZLIB */
 	snet_writef( sn, " REPO" ); 
+	snet_writef( sn, " TGZ" ); 
+	snet_writef( sn, " CKSUM" ); 
+	snet_writef( sn, " DELTA" ); 
+	snet_writef( sn, " RANGE" ); 
+	snet_writef( sn, " HAVE" ); 
+	snet_writef( sn, " JOIN" ); 
+	snet_writef( sn, " VERIFY" ); 
 	snet_writef( sn, "\r\n" ); 
     }
 
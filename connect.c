@@ -325,6 +325,45 @@ print_stats( SNET *sn )
 }
 #endif /* HAVE_ZLIB */
 
+/*
+ * negotiate_cksum: servers checksum with sha1 unless told otherwise,
+ * tell this one to use cksum instead.
+ *
+ * return codes:
+ *	0:	server checksums match ours
+ *	1:	server can't use cksum
+ *	-1:	error
+ */
+    int
+negotiate_cksum( SNET *sn, char **capa, const char *cksum )
+{
+    char		*line;
+    struct timeval	tv;
+
+    if (( cksum == NULL ) || ( strcasecmp( cksum, "sha1" ) == 0 )) {
+	return( 0 );
+    }
+    if ( check_capability( "CKSUM", capa ) == 0 ) {
+	return( 1 );
+    }
+
+    if ( verbose ) printf( ">>> CKSUM %s\n", cksum );
+    snet_writef( sn, "CKSUM %s\r\n", cksum );
+
+    tv = timeout;
+    if (( line = snet_getline( sn, &tv )) == NULL ) {
+	perror( "snet_getline" );
+	return( -1 );
+    }
+    if ( verbose ) printf( "<<< %s\n", line );
+    if ( *line != '2' ) {
+	fprintf( stderr, "%s\n", line );
+	return( 1 );
+    }
+
+    return( 0 );
+}
+
 /*
  * check_capabilities: check to see if type is a listed capability
  *
@@ -22,6 +22,24 @@ extern int zlib_level;
 extern int retr( SNET *sn, const filepath_t *pathdesc, const filepath_t *path,
 	   filepath_t *temppath, mode_t tempmode, off_t transize,
 	   const char *trancksum );
+extern int retr_ahead( SNET *sn, const filepath_t *pathdesc );
+extern int retr_ahead_pending( void );
+extern int retr_ahead_drain( SNET *sn );
+extern int retr_partial;
+extern int retr_delta( SNET *sn, const filepath_t *pathdesc,
+	   const filepath_t *path, const filepath_t *base,
+	   filepath_t *temppath, mode_t tempmode, off_t transize,
+	   const char *trancksum );
+extern int retr_range( SNET *sn, const filepath_t *pathdesc, int fd,
+	   off_t offset, off_t length, off_t *written );
+extern int range_ahead( SNET *sn, const filepath_t *pathdesc, off_t offset,
+	   off_t length );
+extern int retr_resume( SNET *sn, const filepath_t *pathdesc,
+	   const filepath_t *path, const filepath_t *partial,
+	   filepath_t *temppath, mode_t tempmode, off_t transize,
+	   const char *trancksum );
+extern int delta_ahead( SNET *sn, const filepath_t *pathdesc,
+	   const filepath_t *path );
 extern int retr_applefile( SNET *sn, const filepath_t *pathdesc,
 	   const filepath_t *path, filepath_t *temppath, mode_t tempmode,
 	   off_t transize, const char *trancksum );
@@ -36,6 +54,7 @@ extern int stor_response( SNET *sn, int *respcount, struct timeval * );
 
 extern void v_logger( const char *string);
 extern int  check_capability( const char *type, char **capa );
+extern int  negotiate_cksum( SNET *sn, char **capa, const char *cksum );
 
 extern void (*logger)( const char * );
 
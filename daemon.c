@@ -45,6 +45,7 @@
 
 #include "command.h"
 #include "logname.h"
+#include "statcache.h"
 #include "tls.h"
 #include "usageopt.h"
 
@@ -593,6 +594,14 @@ main( int ac, char **av )
 	    exit( EX_IOERR );
 	}
     }
+    if ( mkdir( "tmp/join", 0750 ) != 0 ) {
+	if ( errno != EEXIST ) {
+	    fprintf(stderr, 
+		    "%s: After chdir(\"%s\"), mkdir(\"tmp/join\") failed, errno %d: %s\n", 
+		    progname, radmind_path, errno, strerror(errno));
+	    exit( EX_IOERR );
+	}
+    }
     if ( mkdir( "transcript", 0750 ) != 0 ) {
 	if ( errno != EEXIST ) {
 	    fprintf(stderr, 
@@ -699,6 +708,11 @@ main( int ac, char **av )
 #endif /* ultrix */
     setlogmask( LOG_UPTO( level ));
 
+    /* before any children, so that they all share it */
+    if ( stat_cache_init( ) != 0 ) {
+	syslog( LOG_WARNING, "stat_cache_init: %m" );
+    }
+
     /* catch SIGHUP */
     memset( &sa, 0, sizeof( struct sigaction ));
     sa.sa_handler = hup;
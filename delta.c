@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <openssl/ssl.h>
+#include <openssl/sha.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
+#include <snet.h>
+
+#include "delta.h"
+
+#define DELTA_HASH_SIZE		65536
+#define DELTA_TAG( weak )	((( weak ) ^ (( weak ) >> 16 )) & 0xffff )
+
+/* long runs of new data are sent in pieces */
+#define DELTA_LITERAL_MAX	( 1024 * 1024 )
+
+typedef struct delta_out delta_out_t;
+
+struct delta_out {
+    SNET		*do_sn;
+    unsigned int	do_block;	/* copy not yet sent */
+    unsigned int	do_count;
+    size_t		do_len;
+    unsigned char	do_buf[ 8192 ];
+};
+
+/* about sqrt( size ), as rsync does */
+    int
+delta_blocksize( off_t size )
+{
+    int			bs = DELTA_BLOCK_MIN;
+
+    while (( bs < DELTA_BLOCK_MAX ) && (( off_t )bs * bs < size )) {
+	bs *= 2;
+    }
+    return( bs );
+}
+
+    unsigned int
+delta_weak( const unsigned char *buf, size_t len )
+{
+    unsigned int	a = 0, b = 0;
+    size_t		i;
+
+    for ( i = 0; i < len; i++ ) {
+	a += buf[ i ];
+	b += ( len - i ) * buf[ i ];
+    }
+    return(( a & 0xffff ) | (( b & 0xffff ) << 16 ));
+}
+
+/* slide a len byte window on by one byte */
+    static unsigned int
+delta_roll( unsigned int weak, unsigned char out, unsigned char in,
+	size_t len )
+{
+    unsigned int	a, b;
+
+    a = ( weak - out + in ) & 0xffff;
+    b = (( weak >> 16 ) - len * out + a ) & 0xffff;
+    return( a | ( b << 16 ));
+}
+
+    void
+delta_strong( const unsigned char *buf, size_t len, unsigned char *strong )
+{
+    unsigned char	md[ SHA_DIGEST_LENGTH ];
+
+    SHA1( buf, len, md );
+    memcpy( strong, md, DELTA_STRONG_LEN );
+}
+
+    static unsigned int
+get32( const unsigned char *p )
+{
+    return(( p[ 0 ] << 24 ) | ( p[ 1 ] << 16 ) | ( p[ 2 ] << 8 ) | p[ 3 ] );
+}
+
+    static void
+put32( unsigned char *p, unsigned int v )
+{
+    p[ 0 ] = ( v >> 24 ) & 0xff;
+    p[ 1 ] = ( v >> 16 ) & 0xff;
+    p[ 2 ] = ( v >> 8 ) & 0xff;
+    p[ 3 ] = v & 0xff;
+}
+
+    static int
+out_flush( delta_out_t *out )
+{
+    struct timeval	tv;
+
+    if ( out->do_len == 0 ) {
+	return( 0 );
+    }
+    tv.tv_sec = 60;
+    tv.tv_usec = 0;
+    if ( snet_write( out->do_sn, (char *)out->do_buf, out->do_len,
+	    &tv ) != out->do_len ) {
+	syslog( LOG_ERR, "snet_write: %m" );
+	return( -1 );
+    }
+    out->do_len = 0;
+    return( 0 );
+}
+
+    static int
+out_write( delta_out_t *out, const unsigned char *buf, size_t len )
+{
+    struct timeval	tv;
+
+    if ( out->do_len + len > sizeof( out->do_buf )) {
+	if ( out_flush( out ) != 0 ) {
+	    return( -1 );
+	}
+    }
+    if ( len > sizeof( out->do_buf )) {
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	if ( snet_write( out->do_sn, (const char *)buf, len, &tv ) != len ) {
+	    syslog( LOG_ERR, "snet_write: %m" );
+	    return( -1 );
+	}
+	return( 0 );
+    }
+    memcpy( out->do_buf + out->do_len, buf, len );
+    out->do_len += len;
+    return( 0 );
+}
+
+    static int
+out_copy_flush( delta_out_t *out )
+{
+    unsigned char	hdr[ 9 ];
+
+    if ( out->do_count == 0 ) {
+	return( 0 );
+    }
+    hdr[ 0 ] = DELTA_COPY;
+    put32( hdr + 1, out->do_block );
+    put32( hdr + 5, out->do_count );
+    out->do_count = 0;
+    return( out_write( out, hdr, sizeof( hdr )));
+}
+
+/* runs of blocks are sent as one copy */
+    static int
+out_copy( delta_out_t *out, unsigned int block )
+{
+    if (( out->do_count > 0 ) && ( block == out->do_block + out->do_count )) {
+	out->do_count++;
+	return( 0 );
+    }
+    if ( out_copy_flush( out ) != 0 ) {
+	return( -1 );
+    }
+    out->do_block = block;
+    out->do_count = 1;
+    return( 0 );
+}
+
+    static int
+out_literal( delta_out_t *out, const unsigned char *data, size_t len )
+{
+    unsigned char	hdr[ 5 ];
+
+    if ( len == 0 ) {
+	return( 0 );
+    }
+    if ( out_copy_flush( out ) != 0 ) {
+	return( -1 );
+    }
+    hdr[ 0 ] = DELTA_LITERAL;
+    put32( hdr + 1, len );
+    if ( out_write( out, hdr, sizeof( hdr )) != 0 ) {
+	return( -1 );
+    }
+    return( out_write( out, data, len ));
+}
+
+/*
+ * The client's block matching buf, preferring want so that runs of
+ * blocks stay together, or -1.
+ */
+    static int
+delta_match( const unsigned char *sigs, const int *head, const int *next,
+	unsigned int weak, const unsigned char *buf, size_t len, int want )
+{
+    unsigned char	strong[ DELTA_STRONG_LEN ];
+    const unsigned char	*sig;
+    int			i, found = -1, have = 0;
+
+    for ( i = head[ DELTA_TAG( weak ) ]; i >= 0; i = next[ i ] ) {
+	sig = sigs + (size_t)i * DELTA_SIG_LEN;
+	if ( get32( sig ) != weak ) {
+	    continue;
+	}
+	if ( !have ) {
+	    delta_strong( buf, len, strong );
+	    have = 1;
+	}
+	if ( memcmp( sig + DELTA_WEAK_LEN, strong, DELTA_STRONG_LEN ) != 0 ) {
+	    continue;
+	}
+	if ( i == want ) {
+	    return( i );
+	}
+	if ( found < 0 ) {
+	    found = i;
+	}
+    }
+    return( found );
+}
+
+/*
+ * Send the instructions that turn the client's copy, of oldsize bytes
+ * with the signatures given, into the size bytes open on fd.
+ *
+ * Return Value:
+ *	-1 - error, close the connection
+ *	 0 - OKAY
+ */
+    int
+delta_send( SNET *sn, int fd, off_t size, off_t oldsize, int blocksize,
+	const unsigned char *sigs )
+{
+    delta_out_t		out;
+    unsigned char	*data = NULL;
+    int			*head = NULL, *next = NULL;
+    unsigned int	count, weak, lastlen;
+    off_t		off, lit;
+    int			i, want = 0, rc = -1;
+    unsigned char	end = DELTA_END;
+
+    count = ( oldsize + blocksize - 1 ) / blocksize;
+    lastlen = oldsize - ( off_t )( count - 1 ) * blocksize;
+
+    memset( &out, 0, sizeof( out ));
+    out.do_sn = sn;
+
+    if ( size > 0 ) {
+	if (( data = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 ))
+		== MAP_FAILED ) {
+	    syslog( LOG_ERR, "delta_send: mmap: %m" );
+	    return( -1 );
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise( data, size, MADV_SEQUENTIAL );
+#endif /* MADV_SEQUENTIAL */
+    }
+
+    if ((( head = malloc( DELTA_HASH_SIZE * sizeof( int ))) == NULL ) ||
+	    (( next = malloc( count * sizeof( int ))) == NULL )) {
+	syslog( LOG_ERR, "delta_send: malloc: %m" );
+	goto done;
+    }
+    memset( head, 0xff, DELTA_HASH_SIZE * sizeof( int ));
+    for ( i = count - 1; i >= 0; i-- ) {
+	weak = get32( sigs + (size_t)i * DELTA_SIG_LEN );
+	next[ i ] = head[ DELTA_TAG( weak ) ];
+	head[ DELTA_TAG( weak ) ] = i;
+    }
+
+    off = lit = 0;
+    if ( size >= blocksize ) {
+	weak = delta_weak( data, blocksize );
+    }
+    while ( off + blocksize <= size ) {
+	if (( i = delta_match( sigs, head, next, weak, data + off,
+		blocksize, want )) >= 0 ) {
+	    if (( out_literal( &out, data + lit, off - lit ) != 0 ) ||
+		    ( out_copy( &out, i ) != 0 )) {
+		goto done;
+	    }
+	    want = i + 1;
+	    off += blocksize;
+	    lit = off;
+	    if ( off + blocksize <= size ) {
+		weak = delta_weak( data + off, blocksize );
+	    }
+	    continue;
+	}
+
+	if ( off + blocksize < size ) {
+	    weak = delta_roll( weak, data[ off ], data[ off + blocksize ],
+		    blocksize );
+	}
+	off++;
+	if ( off - lit >= DELTA_LITERAL_MAX ) {
+	    if ( out_literal( &out, data + lit, off - lit ) != 0 ) {
+		goto done;
+	    }
+	    lit = off;
+	}
+    }
+
+    /* a short last block can only be the end of the file */
+    if (( lastlen < blocksize ) && ( size - lit >= lastlen ) &&
+	    ( lastlen > 0 )) {
+	off = size - lastlen;
+	weak = delta_weak( data + off, lastlen );
+	if ( get32( sigs + (size_t)( count - 1 ) * DELTA_SIG_LEN ) == weak ) {
+	    if ( delta_match( sigs, head, next, weak, data + off, lastlen,
+		    count - 1 ) == count - 1 ) {
+		if (( out_literal( &out, data + lit, off - lit ) != 0 ) ||
+			( out_copy( &out, count - 1 ) != 0 )) {
+		    goto done;
+		}
+		lit = size;
+	    }
+	}
+    }
+
+    if (( out_literal( &out, data + lit, size - lit ) != 0 ) ||
+	    ( out_copy_flush( &out ) != 0 ) ||
+	    ( out_write( &out, &end, 1 ) != 0 ) ||
+	    ( out_flush( &out ) != 0 )) {
+	goto done;
+    }
+    rc = 0;
+
+done:
+    free( head );
+    free( next );
+    if ( data != NULL ) {
+	munmap( data, size );
+    }
+    return( rc );
+}
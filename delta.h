@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_DELTA_H)
+#  define _RADMIND_DELTA_H "$Id$"
+
+/*
+ * Delta transfer, after rsync.  The client sends a signature for each
+ * block of the copy it already has: a rolling checksum and the start of
+ * the block's SHA-1.  The server answers with instructions to copy
+ * those blocks or to insert literal data.
+ */
+
+#define DELTA_WEAK_LEN		4
+#define DELTA_STRONG_LEN	16
+#define DELTA_SIG_LEN		( DELTA_WEAK_LEN + DELTA_STRONG_LEN )
+
+#define DELTA_BLOCK_MIN		2048
+#define DELTA_BLOCK_MAX		( 128 * 1024 )
+#define DELTA_COUNT_MAX		( 1 << 22 )
+
+/* each a byte followed by 32 bit big-endian arguments */
+#define DELTA_COPY		'C'	/* first block, number of blocks */
+#define DELTA_LITERAL		'L'	/* length, then the data */
+#define DELTA_END		'E'
+
+extern int		delta_blocksize( off_t size );
+extern unsigned int	delta_weak( const unsigned char *buf, size_t len );
+extern void		delta_strong( const unsigned char *buf, size_t len,
+			    unsigned char *strong );
+extern int		delta_send( SNET *sn, int fd, off_t size,
+			    off_t oldsize, int blocksize,
+			    const unsigned char *sigs );
+
+#endif /* defined(_RADMIND_DELTA_H) */
@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif /* HAVE_BLAKE3 */
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif /* HAVE_XXHASH */
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_dispatch.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/provider.h>
+#endif /* OPENSSL_VERSION_NUMBER */
+
+#include "digest.h"
+
+/*
+ * Each algorithm works on a state of d_ctxsize bytes.  OpenSSL before
+ * 3.0 is handed them as an EVP_MD built by hand, or through the
+ * EVP_MD_meth API; 3.0 deprecates both, so there they are offered by
+ * a small built-in provider and fetched from it.
+ */
+struct digest {
+    const char		*d_name;
+    int			d_size;
+    int			d_block;
+    int			d_ctxsize;
+    int			(*d_init)( void * );
+    int			(*d_update)( void *, const void *, size_t );
+    int			(*d_final)( void *, unsigned char * );
+    int			(*d_cleanup)( void * );
+    EVP_MD		*d_md;
+};
+
+#ifdef HAVE_BLAKE3
+/* below this, handing a buffer to other threads costs more than it saves */
+#define BLAKE3_TBB_MIN		( 128 * 1024 )
+
+    static int
+blake3_init( void *state )
+{
+    blake3_hasher_init( (blake3_hasher *)state );
+    return( 1 );
+}
+
+    static int
+blake3_update( void *state, const void *data, size_t len )
+{
+#ifdef HAVE_BLAKE3_HASHER_UPDATE_TBB
+    if ( len >= BLAKE3_TBB_MIN ) {
+	blake3_hasher_update_tbb( (blake3_hasher *)state, data, len );
+	return( 1 );
+    }
+#endif /* HAVE_BLAKE3_HASHER_UPDATE_TBB */
+    blake3_hasher_update( (blake3_hasher *)state, data, len );
+    return( 1 );
+}
+
+    static int
+blake3_final( void *state, unsigned char *md_value )
+{
+    blake3_hasher_finalize( (blake3_hasher *)state, md_value, BLAKE3_OUT_LEN );
+    return( 1 );
+}
+#endif /* HAVE_BLAKE3 */
+
+#ifdef HAVE_XXHASH
+/*
+ * XXH3_state_t wants more alignment than OpenSSL gives md_data, so the
+ * state only holds a pointer to it.  md_data isn't zeroed by older
+ * OpenSSLs; EVP_DigestInit() has cleaned up any previous state.
+ */
+    static int
+xxh3_init( void *state )
+{
+    XXH3_state_t	**xs = (XXH3_state_t **)state;
+
+    if (( *xs = XXH3_createState()) == NULL ) {
+	return( 0 );
+    }
+    XXH3_128bits_reset( *xs );
+    return( 1 );
+}
+
+    static int
+xxh3_update( void *state, const void *data, size_t len )
+{
+    XXH3_128bits_update( *(XXH3_state_t **)state, data, len );
+    return( 1 );
+}
+
+    static int
+xxh3_final( void *state, unsigned char *md_value )
+{
+    XXH128_canonical_t	canon;
+
+    /* big-endian, as xxhsum prints it */
+    XXH128_canonicalFromHash( &canon,
+	    XXH3_128bits_digest( *(XXH3_state_t **)state ));
+    memcpy( md_value, canon.digest, sizeof( canon.digest ));
+    return( 1 );
+}
+
+    static int
+xxh3_cleanup( void *state )
+{
+    XXH3_state_t	**xs = (XXH3_state_t **)state;
+
+    if (( xs != NULL ) && ( *xs != NULL )) {
+	XXH3_freeState( *xs );
+	*xs = NULL;
+    }
+    return( 1 );
+}
+#endif /* HAVE_XXHASH */
+
+static struct digest	digests[] = {
+#ifdef HAVE_BLAKE3
+    { "blake3", BLAKE3_OUT_LEN, BLAKE3_BLOCK_LEN, sizeof( blake3_hasher ),
+	    blake3_init, blake3_update, blake3_final, NULL, NULL },
+#endif /* HAVE_BLAKE3 */
+#ifdef HAVE_XXHASH
+    { "xxh3-128", sizeof( XXH128_canonical_t ), 64, sizeof( XXH3_state_t * ),
+	    xxh3_init, xxh3_update, xxh3_final, xxh3_cleanup, NULL },
+#endif /* HAVE_XXHASH */
+    { NULL, 0, 0, 0, NULL, NULL, NULL, NULL, NULL },
+};
+
+    static struct digest *
+digest_find( const char *name )
+{
+    struct digest	*d;
+
+    for ( d = digests; d->d_name != NULL; d++ ) {
+	if ( strcasecmp( name, d->d_name ) == 0 ) {
+	    return( d );
+	}
+    }
+    return( NULL );
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define MD_DATA( ctx )		((ctx)->md_data)
+#else /* OPENSSL_VERSION_NUMBER */
+#define MD_DATA( ctx )		EVP_MD_CTX_md_data( ctx )
+#endif /* OPENSSL_VERSION_NUMBER */
+
+/* the EVP_MD callbacks find their algorithm by the context's digest */
+    static struct digest *
+digest_of( EVP_MD_CTX *ctx )
+{
+    struct digest	*d;
+
+    for ( d = digests; d->d_name != NULL; d++ ) {
+	if ( d->d_md == EVP_MD_CTX_md( ctx )) {
+	    return( d );
+	}
+    }
+    return( NULL );
+}
+
+    static int
+digest_evp_init( EVP_MD_CTX *ctx )
+{
+    return( digest_of( ctx )->d_init( MD_DATA( ctx )));
+}
+
+    static int
+digest_evp_update( EVP_MD_CTX *ctx, const void *data, size_t len )
+{
+    return( digest_of( ctx )->d_update( MD_DATA( ctx ), data, len ));
+}
+
+    static int
+digest_evp_final( EVP_MD_CTX *ctx, unsigned char *md_value )
+{
+    return( digest_of( ctx )->d_final( MD_DATA( ctx ), md_value ));
+}
+
+    static int
+digest_evp_cleanup( EVP_MD_CTX *ctx )
+{
+    struct digest	*d = digest_of( ctx );
+
+    if (( d->d_cleanup == NULL ) || ( MD_DATA( ctx ) == NULL )) {
+	return( 1 );
+    }
+    return( d->d_cleanup( MD_DATA( ctx )));
+}
+
+    static EVP_MD *
+digest_md_new( struct digest *d )
+{
+    EVP_MD		*md;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (( md = (EVP_MD *)calloc( 1, sizeof( EVP_MD ))) == NULL ) {
+	return( NULL );
+    }
+    md->type = NID_undef;
+    md->pkey_type = NID_undef;
+    md->md_size = d->d_size;
+    md->init = digest_evp_init;
+    md->update = digest_evp_update;
+    md->final = digest_evp_final;
+    md->cleanup = digest_evp_cleanup;
+    md->block_size = d->d_block;
+    md->ctx_size = d->d_ctxsize;
+#else /* OPENSSL_VERSION_NUMBER */
+    if (( md = EVP_MD_meth_new( NID_undef, NID_undef )) == NULL ) {
+	return( NULL );
+    }
+    if ( !EVP_MD_meth_set_result_size( md, d->d_size ) ||
+	    !EVP_MD_meth_set_input_blocksize( md, d->d_block ) ||
+	    !EVP_MD_meth_set_app_datasize( md, d->d_ctxsize ) ||
+	    !EVP_MD_meth_set_init( md, digest_evp_init ) ||
+	    !EVP_MD_meth_set_update( md, digest_evp_update ) ||
+	    !EVP_MD_meth_set_final( md, digest_evp_final ) ||
+	    !EVP_MD_meth_set_cleanup( md, digest_evp_cleanup )) {
+	EVP_MD_meth_free( md );
+	return( NULL );
+    }
+#endif /* OPENSSL_VERSION_NUMBER */
+
+    return( md );
+}
+
+#else /* OPENSSL_VERSION_NUMBER */
+
+#define DIGEST_PROVIDER		"radmind"
+
+#if defined(HAVE_BLAKE3) || defined(HAVE_XXHASH)
+
+/* a provider context is the algorithm followed by its state */
+struct digest_pctx {
+    struct digest	*dp_d;
+    unsigned char	*dp_state;
+};
+
+    static void *
+digest_newctx( const char *name )
+{
+    struct digest_pctx	*dp;
+
+    if (( dp = calloc( 1, sizeof( struct digest_pctx ))) == NULL ) {
+	return( NULL );
+    }
+    dp->dp_d = digest_find( name );
+    if (( dp->dp_state = calloc( 1, dp->dp_d->d_ctxsize )) == NULL ) {
+	free( dp );
+	return( NULL );
+    }
+    return( dp );
+}
+
+    static void
+digest_freectx( void *vdp )
+{
+    struct digest_pctx	*dp = (struct digest_pctx *)vdp;
+
+    if ( dp->dp_d->d_cleanup != NULL ) {
+	dp->dp_d->d_cleanup( dp->dp_state );
+    }
+    free( dp->dp_state );
+    free( dp );
+}
+
+    static int
+digest_pinit( void *vdp, const OSSL_PARAM params[] )
+{
+    struct digest_pctx	*dp = (struct digest_pctx *)vdp;
+
+    /* a context may be initialised again without being freed */
+    if ( dp->dp_d->d_cleanup != NULL ) {
+	dp->dp_d->d_cleanup( dp->dp_state );
+    }
+    return( dp->dp_d->d_init( dp->dp_state ));
+}
+
+    static int
+digest_pupdate( void *vdp, const unsigned char *data, size_t len )
+{
+    struct digest_pctx	*dp = (struct digest_pctx *)vdp;
+
+    return( dp->dp_d->d_update( dp->dp_state, data, len ));
+}
+
+    static int
+digest_pfinal( void *vdp, unsigned char *md_value, size_t *len, size_t size )
+{
+    struct digest_pctx	*dp = (struct digest_pctx *)vdp;
+
+    if ( size < (size_t)dp->dp_d->d_size ) {
+	return( 0 );
+    }
+    *len = dp->dp_d->d_size;
+    return( dp->dp_d->d_final( dp->dp_state, md_value ));
+}
+
+    static int
+digest_get_params( const char *name, OSSL_PARAM params[] )
+{
+    struct digest	*d = digest_find( name );
+    OSSL_PARAM		*p;
+
+    if ((( p = OSSL_PARAM_locate( params, OSSL_DIGEST_PARAM_SIZE ))
+	    != NULL ) && !OSSL_PARAM_set_size_t( p, d->d_size )) {
+	return( 0 );
+    }
+    if ((( p = OSSL_PARAM_locate( params, OSSL_DIGEST_PARAM_BLOCK_SIZE ))
+	    != NULL ) && !OSSL_PARAM_set_size_t( p, d->d_block )) {
+	return( 0 );
+    }
+    return( 1 );
+}
+
+/* the provider's newctx and get_params aren't told which algorithm */
+#define DIGEST_DISPATCH( alg, name ) \
+    static void *alg##_newctx( void *provctx ) \
+	{ return( digest_newctx( name )); } \
+    static int alg##_get_params( OSSL_PARAM params[] ) \
+	{ return( digest_get_params( name, params )); } \
+    static const OSSL_DISPATCH alg##_dispatch[] = { \
+	{ OSSL_FUNC_DIGEST_NEWCTX, (void (*)( void ))alg##_newctx }, \
+	{ OSSL_FUNC_DIGEST_INIT, (void (*)( void ))digest_pinit }, \
+	{ OSSL_FUNC_DIGEST_UPDATE, (void (*)( void ))digest_pupdate }, \
+	{ OSSL_FUNC_DIGEST_FINAL, (void (*)( void ))digest_pfinal }, \
+	{ OSSL_FUNC_DIGEST_FREECTX, (void (*)( void ))digest_freectx }, \
+	{ OSSL_FUNC_DIGEST_GET_PARAMS, (void (*)( void ))alg##_get_params }, \
+	{ 0, NULL } \
+    };
+
+#ifdef HAVE_BLAKE3
+DIGEST_DISPATCH( blake3, "blake3" )
+#endif /* HAVE_BLAKE3 */
+#ifdef HAVE_XXHASH
+DIGEST_DISPATCH( xxh3, "xxh3-128" )
+#endif /* HAVE_XXHASH */
+
+static const OSSL_ALGORITHM	digest_algorithms[] = {
+#ifdef HAVE_BLAKE3
+    { "blake3", "provider=" DIGEST_PROVIDER, blake3_dispatch, NULL },
+#endif /* HAVE_BLAKE3 */
+#ifdef HAVE_XXHASH
+    { "xxh3-128", "provider=" DIGEST_PROVIDER, xxh3_dispatch, NULL },
+#endif /* HAVE_XXHASH */
+    { NULL, NULL, NULL, NULL },
+};
+
+    static const OSSL_ALGORITHM *
+digest_query( void *provctx, int operation, int *no_cache )
+{
+    *no_cache = 0;
+    return(( operation == OSSL_OP_DIGEST ) ? digest_algorithms : NULL );
+}
+
+static const OSSL_DISPATCH	digest_provider[] = {
+    { OSSL_FUNC_PROVIDER_QUERY_OPERATION, (void (*)( void ))digest_query },
+    { 0, NULL },
+};
+
+    static int
+digest_provider_init( const OSSL_CORE_HANDLE *handle,
+	const OSSL_DISPATCH *in, const OSSL_DISPATCH **out, void **provctx )
+{
+    *out = digest_provider;
+    *provctx = NULL;
+    return( 1 );
+}
+#endif /* HAVE_BLAKE3 || HAVE_XXHASH */
+
+    static EVP_MD *
+digest_md_new( struct digest *d )
+{
+#if defined(HAVE_BLAKE3) || defined(HAVE_XXHASH)
+    static OSSL_PROVIDER	*provider = NULL;
+
+    if ( provider == NULL ) {
+	if ( !OSSL_PROVIDER_add_builtin( NULL, DIGEST_PROVIDER,
+		digest_provider_init )) {
+	    return( NULL );
+	}
+	/* keep the default provider, which loading any other would drop */
+	if (( provider = OSSL_PROVIDER_try_load( NULL, DIGEST_PROVIDER, 1 ))
+		== NULL ) {
+	    return( NULL );
+	}
+    }
+    return( EVP_MD_fetch( NULL, d->d_name, "provider=" DIGEST_PROVIDER ));
+#else /* HAVE_BLAKE3 || HAVE_XXHASH */
+    return( NULL );
+#endif /* HAVE_BLAKE3 || HAVE_XXHASH */
+}
+
+#endif /* OPENSSL_VERSION_NUMBER */
+
+/*
+ * return values:
+ *	NULL	unknown or unsupported checksum
+ *	else	the digest, valid for the life of the process
+ */
+    const EVP_MD *
+digest_byname( const char *name )
+{
+    struct digest	*d;
+
+    if (( d = digest_find( name )) != NULL ) {
+	if ( d->d_md == NULL ) {
+	    d->d_md = digest_md_new( d );
+	}
+	return( d->d_md );
+    }
+
+    return( EVP_get_digestbyname( name ));
+}
+
+    const char *
+digest_name( const EVP_MD *md )
+{
+    struct digest	*d;
+
+    for ( d = digests; d->d_name != NULL; d++ ) {
+	if (( d->d_md != NULL ) && ( d->d_md == md )) {
+	    return( d->d_name );
+	}
+    }
+
+    return( OBJ_nid2sn( EVP_MD_type( md )));
+}
+
+/* whether hashing with md may touch the data from other threads */
+    int
+digest_threaded( const EVP_MD *md )
+{
+#ifdef HAVE_BLAKE3_HASHER_UPDATE_TBB
+    return( strcmp( digest_name( md ), "blake3" ) == 0 );
+#else /* HAVE_BLAKE3_HASHER_UPDATE_TBB */
+    return( 0 );
+#endif /* HAVE_BLAKE3_HASHER_UPDATE_TBB */
+}
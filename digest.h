@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_DIGEST_H)
+#  define _RADMIND_DIGEST_H "$Id$"
+
+/*
+ * Checksum algorithms by name.  digest_byname() knows OpenSSL's digests
+ * and, when radmind was built with the libraries, "blake3" and
+ * "xxh3-128", which are wrapped as EVP_MDs so that the EVP_Digest*
+ * callers don't need to know the difference.
+ */
+
+extern const EVP_MD	*digest_byname( const char *name );
+extern const char	*digest_name( const EVP_MD *md );
+extern int		digest_threaded( const EVP_MD *md );
+
+#endif /* defined(_RADMIND_DIGEST_H) */
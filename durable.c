@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#if defined(HAVE_SYNCFS) || defined(HAVE_SYNC_FILE_RANGE)
+/* syncfs() and sync_file_range() */
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "durable.h"
+#include "journal.h"
+#include "pathcmp.h"
+
+extern int		case_sensitive;
+
+/*
+ * With the batch policy, a rename waits in the queue until
+ * DURABLE_BATCH_FILES files or DURABLE_BATCH_BYTES are waiting.  Writing
+ * out of each file is started as it's queued, where the system allows,
+ * so that there's little left to do when the batch is synced.  A line
+ * isn't marked done in the journal until what was queued before it has
+ * been renamed, so an entry with no temppath holds the line's key.
+ */
+#define DURABLE_NONE		0
+#define DURABLE_FILE		1
+#define DURABLE_BATCH		2
+
+#define DURABLE_BATCH_FILES	1024
+#define DURABLE_BATCH_BYTES	( 256 * 1024 * 1024 )
+
+typedef struct durable_entry durable_entry_t;
+
+struct durable_entry {
+    durable_entry_t	*de_next;
+    filepath_t		*de_temppath;
+    filepath_t		*de_path;
+    unsigned long long	de_key;
+};
+
+/* a directory renamed into, or on a filesystem with a batch waiting */
+typedef struct durable_dir durable_dir_t;
+
+struct durable_dir {
+    durable_dir_t	*dd_next;
+    dev_t		dd_dev;
+    char		*dd_path;
+};
+
+static int		durable = DURABLE_NONE;
+static durable_entry_t	*durable_head = NULL;
+static durable_entry_t	**durable_tail = &durable_head;
+static int		durable_files = 0;
+static off_t		durable_bytes = 0;
+static durable_dir_t	*durable_dirs = NULL;
+static durable_dir_t	*durable_devs = NULL;
+
+/*
+ * Return Value:
+ *	-1 - no such policy
+ *	 0 - OKAY
+ */
+    int
+durable_policy( const char *name )
+{
+    if ( strcmp( name, "none" ) == 0 ) {
+	durable = DURABLE_NONE;
+    } else if ( strcmp( name, "file" ) == 0 ) {
+	durable = DURABLE_FILE;
+    } else if ( strcmp( name, "batch" ) == 0 ) {
+	durable = DURABLE_BATCH;
+    } else {
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/* remember the directory path is in, once */
+    static int
+durable_dir( durable_dir_t **list, const char *path, dev_t dev )
+{
+    durable_dir_t	*dd;
+    char		*p;
+    size_t		len;
+
+    if (( p = strrchr( path, '/' )) == NULL ) {
+	path = ".";
+	len = 1;
+    } else if ( p == path ) {
+	len = 1;
+    } else {
+	len = p - path;
+    }
+
+    if ( list == &durable_devs ) {
+	for ( dd = *list; dd != NULL; dd = dd->dd_next ) {
+	    if ( dd->dd_dev == dev ) {
+		return( 0 );
+	    }
+	}
+    } else if ((( dd = *list ) != NULL ) &&
+	    ( strncmp( dd->dd_path, path, len ) == 0 ) &&
+	    ( dd->dd_path[ len ] == '\0' )) {
+	/* files in a directory come together, a repeat is only slower */
+	return( 0 );
+    }
+
+    if ((( dd = malloc( sizeof( durable_dir_t ))) == NULL ) ||
+	    (( dd->dd_path = malloc( len + 1 )) == NULL )) {
+	perror( "malloc" );
+	return( -1 );
+    }
+    memcpy( dd->dd_path, path, len );
+    dd->dd_path[ len ] = '\0';
+    dd->dd_dev = dev;
+    dd->dd_next = *list;
+    *list = dd;
+    return( 0 );
+}
+
+/* fsync a file or directory by name */
+    static int
+durable_sync( const char *path, int flags )
+{
+    int			fd;
+
+    if (( fd = open( path, flags, 0 )) < 0 ) {
+	perror( path );
+	return( -1 );
+    }
+    if ( fsync( fd ) != 0 ) {
+	perror( path );
+	close( fd );
+	return( -1 );
+    }
+    if ( close( fd ) != 0 ) {
+	perror( path );
+	return( -1 );
+    }
+    return( 0 );
+}
+
+    static int
+durable_move( const filepath_t *temppath, const filepath_t *path )
+{
+    if ( rename( (const char *) temppath, (const char *) path ) != 0 ) {
+	perror( (const char *) temppath );
+	return( -1 );
+    }
+    if ( durable != DURABLE_NONE ) {
+	return( durable_dir( &durable_dirs, (const char *) path, 0 ));
+    }
+    return( 0 );
+}
+
+/*
+ * Rename temppath, whose contents and metadata are complete, to path.
+ * fd is open on temppath, or -1.
+ *
+ * Return Value:
+ *	-1 - error, temppath is still there
+ *	 0 - OKAY, renamed or queued
+ */
+    int
+durable_rename( int fd, const filepath_t *temppath, const filepath_t *path )
+{
+    durable_entry_t	*de;
+    struct stat		st;
+
+    switch ( durable ) {
+    case DURABLE_FILE:
+	if ( fd < 0 ) {
+	    if ( durable_sync( (const char *) temppath, O_RDONLY ) != 0 ) {
+		return( -1 );
+	    }
+	} else if ( fsync( fd ) != 0 ) {
+	    perror( (const char *) temppath );
+	    return( -1 );
+	}
+	/* FALLTHROUGH */
+    case DURABLE_NONE:
+	return( durable_move( temppath, path ));
+
+    default:
+	break;
+    }
+
+    if ((( fd >= 0 ) ? fstat( fd, &st ) :
+	    lstat( (const char *) temppath, &st )) != 0 ) {
+	perror( (const char *) temppath );
+	return( -1 );
+    }
+#ifdef HAVE_SYNC_FILE_RANGE
+    if ( fd >= 0 ) {
+	/* only a hint, the batch is synced anyway */
+	(void)sync_file_range( fd, 0, 0, SYNC_FILE_RANGE_WRITE );
+    }
+#endif /* HAVE_SYNC_FILE_RANGE */
+    if ( durable_dir( &durable_devs, (const char *) temppath,
+	    st.st_dev ) != 0 ) {
+	return( -1 );
+    }
+
+    if ((( de = malloc( sizeof( durable_entry_t ))) == NULL ) ||
+	    (( de->de_temppath = filepath_dup( temppath )) == NULL ) ||
+	    (( de->de_path = filepath_dup( path )) == NULL )) {
+	perror( "malloc" );
+	return( -1 );
+    }
+    de->de_key = 0;
+    de->de_next = NULL;
+    *durable_tail = de;
+    durable_tail = &de->de_next;
+    durable_files++;
+    durable_bytes += st.st_size;
+
+    if (( durable_files >= DURABLE_BATCH_FILES ) ||
+	    ( durable_bytes >= DURABLE_BATCH_BYTES )) {
+	return( durable_flush( ));
+    }
+    return( 0 );
+}
+
+/*
+ * Mark the line known by key done in the journal, once every rename
+ * queued so far has been done.
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY, marked or queued
+ */
+    int
+durable_mark( unsigned long long key )
+{
+    durable_entry_t	*de;
+
+    if ( durable_head == NULL ) {
+	journal_mark( key );
+	return( 0 );
+    }
+
+    if (( de = malloc( sizeof( durable_entry_t ))) == NULL ) {
+	perror( "malloc" );
+	return( -1 );
+    }
+    de->de_temppath = NULL;
+    de->de_path = NULL;
+    de->de_key = key;
+    de->de_next = NULL;
+    *durable_tail = de;
+    durable_tail = &de->de_next;
+    return( 0 );
+}
+
+/*
+ * Anything to be done to path, or to what's below it, waits for the
+ * renames queued there.  A NULL path waits for all of them.
+ */
+    int
+durable_before( const filepath_t *path )
+{
+    durable_entry_t	*de;
+
+    for ( de = durable_head; de != NULL; de = de->de_next ) {
+	if ( de->de_path == NULL ) {
+	    continue;
+	}
+	if (( path == NULL ) ||
+		ischildcase( de->de_path, path, case_sensitive )) {
+	    return( durable_flush( ));
+	}
+    }
+    return( 0 );
+}
+
+/*
+ * Write out every filesystem with renames waiting, then rename them
+ * into place in the order they were queued, marking lines done in the
+ * journal as they come.
+ *
+ * Return Value:
+ *	-1 - error, what couldn't be renamed has been removed, and nothing
+ *	     after it marked done
+ *	 0 - OKAY
+ */
+    int
+durable_flush( void )
+{
+    durable_entry_t	*de;
+    durable_dir_t	*dd;
+    int			rc = 0;
+#ifdef HAVE_SYNCFS
+    int			fd;
+#endif /* HAVE_SYNCFS */
+
+    if ( durable_head == NULL ) {
+	return( 0 );
+    }
+
+#ifndef HAVE_SYNCFS
+    /* everything, not just the filesystems written to */
+    sync( );
+#endif /* HAVE_SYNCFS */
+    while (( dd = durable_devs ) != NULL ) {
+#ifdef HAVE_SYNCFS
+	if ((( fd = open( dd->dd_path, O_RDONLY, 0 )) < 0 ) ||
+		( syncfs( fd ) != 0 )) {
+	    perror( dd->dd_path );
+	    rc = -1;
+	}
+	if ( fd >= 0 ) {
+	    close( fd );
+	}
+#endif /* HAVE_SYNCFS */
+	durable_devs = dd->dd_next;
+	free( dd->dd_path );
+	free( dd );
+    }
+
+    journal_hold( 1 );
+    while (( de = durable_head ) != NULL ) {
+	if ( de->de_temppath == NULL ) {
+	    if ( rc == 0 ) {
+		journal_mark( de->de_key );
+	    }
+	} else {
+	    if ( rc == 0 ) {
+		rc = durable_move( de->de_temppath, de->de_path );
+	    }
+	    if ( rc != 0 ) {
+		unlink( (const char *) de->de_temppath );
+	    }
+	}
+	durable_head = de->de_next;
+	free( de->de_temppath );
+	free( de->de_path );
+	free( de );
+    }
+    journal_hold( 0 );
+    durable_tail = &durable_head;
+    durable_files = 0;
+    durable_bytes = 0;
+
+    return( rc );
+}
+
+/*
+ * Finish the batch waiting, and fsync the directories renamed into so
+ * that the renames themselves are kept.
+ */
+    int
+durable_close( void )
+{
+    durable_dir_t	*dd;
+    int			rc;
+
+    rc = durable_flush( );
+
+    while (( dd = durable_dirs ) != NULL ) {
+	if ( durable_sync( dd->dd_path, O_RDONLY ) != 0 ) {
+	    rc = -1;
+	}
+	durable_dirs = dd->dd_next;
+	free( dd->dd_path );
+	free( dd );
+    }
+    return( rc );
+}
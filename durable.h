@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_DURABLE_H)
+#  define _RADMIND_DURABLE_H "$Id$"
+
+#  include "filepath.h"
+
+/*
+ * How hard lapply works to have the files it installs survive a crash.
+ *
+ *	none	files are renamed into place as soon as they're ready
+ *	file	each file is fsync()ed before it's renamed
+ *	batch	renames are held back until a batch of files has been
+ *		written out together, with one syncfs() per filesystem
+ *
+ * Either of the last two fsyncs the directories renamed into at the end.
+ * durable_mark() marks a line done in the journal once the renames
+ * queued before it have been done.
+ */
+
+extern int  durable_policy( const char *name );
+extern int  durable_rename( int fd, const filepath_t *temppath,
+	    const filepath_t *path );
+extern int  durable_mark( unsigned long long key );
+extern int  durable_before( const filepath_t *path );
+extern int  durable_flush( void );
+extern int  durable_close( void );
+
+#endif /* defined(_RADMIND_DURABLE_H) */
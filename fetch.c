@@ -0,0 +1,669 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
+#include <snet.h>
+
+#include "applefile.h"
+#include "argcargv.h"
+#include "base64.h"
+#include "cksum.h"
+#include "code.h"
+#include "connect.h"
+#include "fetch.h"
+#include "largefile.h"
+#include "progress.h"
+
+extern int		linenum;
+extern int		dodots;
+extern int		verbose;
+extern int		cksum;
+
+typedef struct fetcher fetcher_t;
+
+struct fetcher {
+    pid_t		fe_pid;
+    FILE		*fe_req;
+    FILE		*fe_res;
+    int			fe_pending;
+};
+
+/* requests in the order they were made, which is the order applied */
+typedef struct fetch_entry fetch_entry_t;
+
+struct fetch_entry {
+    fetch_entry_t	*fq_next;
+    fetcher_t		*fq_fetcher;
+    char		*fq_pathdesc;
+    off_t		fq_size;
+    int			fq_segments;	/* pieces, one per fetcher from 0 */
+    int			fq_incomplete;	/* not every piece was asked for */
+    char		*fq_temppath;
+    char		*fq_cksum;
+};
+
+static fetcher_t	*fetchers = NULL;
+static int		nfetchers = 0;
+static int		fetch_next = 0;
+static unsigned int	fetch_seq = 0;
+static int		fetch_broken = 0;
+static int		fetch_count = 0;
+static fetch_entry_t	*fetch_head = NULL;
+static fetch_entry_t	**fetch_tail = &fetch_head;
+static off_t		fetch_segment_min = 0;
+
+static void		fetcher( FILE *req, FILE *res,
+			    SNET *(*connect)( char *** ));
+static int		fetch_segmented( const filepath_t *pathdesc,
+			    const char *stage, off_t size,
+			    const char *trancksum, int lnum );
+static int		fetch_answer( fetcher_t *fe, const char *pathdesc,
+			    filepath_t *temppath, off_t *written );
+static int		fetch_result( filepath_t *temppath );
+static int		fetch_discard( void );
+
+    static void
+fetcher_exit( int rc )
+{
+    fflush( stdout );
+    _exit( rc );
+}
+
+/*
+ * The fetcher process.  Each request line is
+ *
+ *	linenum type size cksum stage pathdesc
+ *
+ * and is answered with "0 temppath" once the file is staged, or with
+ * retr()'s return value.  Requests are answered in the order made.
+ * For type "r" the request is for size bytes from the offset in place
+ * of cksum, written into the existing file stage, and the answer is
+ * "0 stage written".
+ */
+    static void
+fetcher( FILE *req, FILE *res, SNET *(*connect)( char *** ))
+{
+    SNET		*sn;
+    ACAV		*acav;
+    char		**capa;
+    char		**av;
+    char		line[ 5 * MAXPATHLEN ];
+    char		stage[ MAXPATHLEN ];
+    char		pathdesc[ 2 * MAXPATHLEN ];
+    filepath_t		temppath[ 2 * MAXPATHLEN ];
+    const char		*d;
+    off_t		size, written = 0;
+    int			ac, i, rc, fd;
+
+    /* the parent reports progress as files are applied */
+    showprogress = 0;
+    dodots = 0;
+
+    if (( sn = (*connect)( &capa )) == NULL ) {
+	fetcher_exit( 2 );
+    }
+    if (( acav = acav_alloc( )) == NULL ) {
+	fetcher_exit( 2 );
+    }
+
+    while ( fgets( line, sizeof( line ), req ) != NULL ) {
+	if (( ac = acav_parse( acav, line, &av )) < 6 ) {
+	    fprintf( stderr, "fetcher: bad request\n" );
+	    fetcher_exit( 2 );
+	}
+	linenum = atoi( av[ 0 ] );
+	size = strtoofft( av[ 2 ], NULL, 10 );
+	if ((( d = decode( av[ 4 ] )) == NULL ) ||
+		( strlen( d ) >= sizeof( stage ))) {
+	    fprintf( stderr, "fetcher: bad request\n" );
+	    fetcher_exit( 2 );
+	}
+	strcpy( stage, d );
+
+	*pathdesc = '\0';
+	for ( i = 5; i < ac; i++ ) {
+	    if ( i > 5 ) {
+		strcat( pathdesc, " " );
+	    }
+	    strcat( pathdesc, av[ i ] );
+	}
+
+	if ( *av[ 1 ] == 'r' ) {
+	    if (( fd = open( stage, O_WRONLY, 0 )) < 0 ) {
+		perror( stage );
+		rc = 1;
+	    } else {
+		rc = retr_range( sn, (filepath_t *) pathdesc, fd,
+			strtoofft( av[ 3 ], NULL, 10 ), size, &written );
+		if (( close( fd ) != 0 ) && ( rc == 0 )) {
+		    perror( stage );
+		    rc = 1;
+		}
+	    }
+	    strcpy( (char *) temppath, stage );
+	} else if ( *av[ 1 ] == 'a' ) {
+	    rc = retr_applefile( sn, (filepath_t *) pathdesc,
+		    (filepath_t *) stage, temppath, 0600, size, av[ 3 ] );
+	} else {
+	    rc = retr( sn, (filepath_t *) pathdesc, (filepath_t *) stage,
+		    temppath, 0600, size, av[ 3 ] );
+	}
+
+	if (( rc == 0 ) && ( *av[ 1 ] == 'r' )) {
+	    fprintf( res, "0 %s %" PRIofft "\n", encode( (char *) temppath ),
+		    written );
+	} else if ( rc == 0 ) {
+	    fprintf( res, "0 %s\n", encode( (char *) temppath ));
+	} else {
+	    fprintf( res, "%d\n", rc );
+	}
+	if ( fflush( res ) != 0 ) {
+	    /* the parent is gone */
+	    if ( rc == 0 ) {
+		unlink( (char *) temppath );
+	    }
+	    fetcher_exit( 2 );
+	}
+	if ( rc < 0 ) {
+	    fetcher_exit( 2 );
+	}
+    }
+
+    closesn( sn );
+    fetcher_exit( 0 );
+}
+
+/*
+ * Start nfetch fetchers, each with its own connection from connect().
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY
+ */
+    int
+fetch_start( int nfetch, SNET *(*connect)( char *** ))
+{
+    int			reqfd[ 2 ], resfd[ 2 ];
+    int			i, j;
+    pid_t		pid;
+    FILE		*req, *res;
+
+    /* a fetcher that has lost its connection exits */
+    if ( signal( SIGPIPE, SIG_IGN ) == SIG_ERR ) {
+	perror( "signal" );
+	return( -1 );
+    }
+
+    if (( fetchers = calloc( nfetch, sizeof( fetcher_t ))) == NULL ) {
+	perror( "calloc" );
+	return( -1 );
+    }
+
+    fflush( stdout );
+    fflush( stderr );
+
+    for ( i = 0; i < nfetch; i++ ) {
+	if ( pipe( reqfd ) < 0 ) {
+	    perror( "pipe" );
+	    return( -1 );
+	}
+	if ( pipe( resfd ) < 0 ) {
+	    perror( "pipe" );
+	    return( -1 );
+	}
+
+	switch ( pid = fork( )) {
+	case -1:
+	    perror( "fork" );
+	    return( -1 );
+
+	case 0:
+	    close( reqfd[ 1 ] );
+	    close( resfd[ 0 ] );
+	    /* so that the others see end of file when the parent closes */
+	    for ( j = 0; j < i; j++ ) {
+		fclose( fetchers[ j ].fe_req );
+		fclose( fetchers[ j ].fe_res );
+	    }
+	    if ((( req = fdopen( reqfd[ 0 ], "r" )) == NULL ) ||
+		    (( res = fdopen( resfd[ 1 ], "w" )) == NULL )) {
+		perror( "fdopen" );
+		fetcher_exit( 2 );
+	    }
+	    fetcher( req, res, connect );
+	    /* NOTREACHED */
+
+	default:
+	    break;
+	}
+
+	close( reqfd[ 0 ] );
+	close( resfd[ 1 ] );
+	fetchers[ i ].fe_pid = pid;
+	if ((( fetchers[ i ].fe_req = fdopen( reqfd[ 1 ], "w" )) == NULL ) ||
+		(( fetchers[ i ].fe_res = fdopen( resfd[ 0 ], "r" )) == NULL )) {
+	    perror( "fdopen" );
+	    return( -1 );
+	}
+	nfetchers++;
+    }
+
+    return( 0 );
+}
+
+/*
+ * The deepest directory above path that exists now.  Whatever is
+ * created below it later is on the same filesystem, so a file staged
+ * here can be renamed into place once the lines before it are applied.
+ */
+    int
+fetch_stagedir( const char *path, char *dir, size_t len )
+{
+    struct stat		st;
+    char		*p;
+
+    if ( strlen( path ) >= len ) {
+	return( -1 );
+    }
+    strcpy( dir, path );
+
+    for (;;) {
+	if (( p = strrchr( dir, '/' )) == NULL ) {
+	    strcpy( dir, "." );
+	    return( 0 );
+	}
+	if ( p == dir ) {
+	    dir[ 1 ] = '\0';
+	    return( 0 );
+	}
+	*p = '\0';
+	if (( lstat( dir, &st ) == 0 ) && S_ISDIR( st.st_mode )) {
+	    return( 0 );
+	}
+    }
+}
+
+/*
+ * Files at least min bytes are split between the fetchers, each asking
+ * for its piece with a ranged RETR.  0, the default, is for servers
+ * without RANGE.
+ */
+    void
+fetch_segments( off_t min )
+{
+    fetch_segment_min = min;
+}
+
+/*
+ * A large file is made here at its full size, and each fetcher writes
+ * its piece of it in place.
+ */
+    static int
+fetch_segmented( const filepath_t *pathdesc, const char *stage, off_t size,
+	const char *trancksum, int lnum )
+{
+    fetch_entry_t	*fq;
+    char		temppath[ MAXPATHLEN ];
+    off_t		piece, off, len;
+    int			fd, i;
+
+    /* anything we can't make is retrieved when its line is applied */
+    if ( snprintf( temppath, sizeof( temppath ), "%s.radmind.%i", stage,
+	    (int)getpid( )) >= sizeof( temppath )) {
+	return( 0 );
+    }
+    if (( fd = open( temppath, O_WRONLY | O_CREAT | O_EXCL, 0600 )) < 0 ) {
+	return( 0 );
+    }
+    if ( ftruncate( fd, size ) != 0 ) {
+	close( fd );
+	unlink( temppath );
+	return( 0 );
+    }
+    if ( close( fd ) != 0 ) {
+	unlink( temppath );
+	return( 0 );
+    }
+
+    if ((( fq = calloc( 1, sizeof( fetch_entry_t ))) == NULL ) ||
+	    (( fq->fq_pathdesc = strdup( (const char *) pathdesc )) == NULL ) ||
+	    (( fq->fq_temppath = strdup( temppath )) == NULL ) ||
+	    (( fq->fq_cksum = strdup( trancksum )) == NULL )) {
+	perror( "fetch_ahead: malloc" );
+	unlink( temppath );
+	return( -1 );
+    }
+    fq->fq_size = size;
+
+    piece = ( size + nfetchers - 1 ) / nfetchers;
+    for ( i = 0, off = 0; ( i < nfetchers ) && ( off < size );
+	    i++, off += piece ) {
+	len = MIN( piece, size - off );
+	if (( fprintf( fetchers[ i ].fe_req, "%d r %" PRIofft " %" PRIofft
+		" %s %s\n", lnum, len, off, encode( temppath ),
+		(const char *) pathdesc ) < 0 ) ||
+		( fflush( fetchers[ i ].fe_req ) != 0 )) {
+	    /* the pieces asked for are read and thrown away */
+	    fetch_broken = 1;
+	    fq->fq_incomplete = 1;
+	    break;
+	}
+	fetchers[ i ].fe_pending++;
+    }
+    fq->fq_segments = i;
+
+    fq->fq_next = NULL;
+    *fetch_tail = fq;
+    fetch_tail = &fq->fq_next;
+    fetch_count++;
+
+    return( 0 );
+}
+
+/*
+ * Hand pathdesc to the least busy fetcher.  epath is the encoded path
+ * from the transcript line, lnum its line number.
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY, or not sent
+ */
+    int
+fetch_ahead( const filepath_t *pathdesc, const char *epath, char type,
+	off_t size, const char *trancksum, int lnum )
+{
+    fetcher_t		*fe;
+    fetch_entry_t	*fq;
+    const char		*d_path;
+    char		dir[ MAXPATHLEN ];
+    char		stage[ MAXPATHLEN ];
+    int			i;
+
+    if (( nfetchers == 0 ) || fetch_broken ) {
+	return( 0 );
+    }
+
+    /* anything we can't stage is retrieved when its line is applied */
+    if ((( d_path = decode( epath )) == NULL ) ||
+	    ( fetch_stagedir( d_path, dir, sizeof( dir )) != 0 ) ||
+	    ( snprintf( stage, sizeof( stage ), "%s/.radmind.fetch.%u",
+	    ( strcmp( dir, "/" ) == 0 ) ? "" : dir,
+	    fetch_seq++ ) >= sizeof( stage ))) {
+	return( 0 );
+    }
+    if (( type == 'f' ) && ( fetch_segment_min > 0 ) &&
+	    ( size >= fetch_segment_min ) && ( nfetchers > 1 )) {
+	return( fetch_segmented( pathdesc, stage, size, trancksum, lnum ));
+    }
+
+    fe = &fetchers[ fetch_next ];
+    for ( i = 0; i < nfetchers; i++ ) {
+	if ( fetchers[ i ].fe_pending < fe->fe_pending ) {
+	    fe = &fetchers[ i ];
+	}
+    }
+    fetch_next = ( fetch_next + 1 ) % nfetchers;
+
+    if ((( fq = calloc( 1, sizeof( fetch_entry_t ))) == NULL ) ||
+	    (( fq->fq_pathdesc = strdup( (const char *) pathdesc )) == NULL )) {
+	perror( "fetch_ahead: malloc" );
+	return( -1 );
+    }
+
+    if (( fprintf( fe->fe_req, "%d %c %" PRIofft " %s %s %s\n", lnum, type,
+	    size, trancksum, encode( stage ), (const char *) pathdesc ) < 0 ) ||
+	    ( fflush( fe->fe_req ) != 0 )) {
+	/* the fetcher is gone, retrieve from here on */
+	fetch_broken = 1;
+	free( fq->fq_pathdesc );
+	free( fq );
+	return( 0 );
+    }
+
+    fq->fq_next = NULL;
+    fq->fq_fetcher = fe;
+    fq->fq_size = size;
+    *fetch_tail = fq;
+    fetch_tail = &fq->fq_next;
+    fetch_count++;
+    fe->fe_pending++;
+
+    return( 0 );
+}
+
+    int
+fetch_pending( void )
+{
+    return( fetch_count );
+}
+
+/*
+ * Read fe's answer to its oldest request, which is for pathdesc.  For a
+ * piece, written is set to what the fetcher says it wrote.
+ */
+    static int
+fetch_answer( fetcher_t *fe, const char *pathdesc, filepath_t *temppath,
+	off_t *written )
+{
+    char		line[ 3 * MAXPATHLEN ];
+    char		*p, *q;
+    const char		*d;
+    int			rc;
+
+    if ( fgets( line, sizeof( line ), fe->fe_res ) == NULL ) {
+	fprintf( stderr, "retrieve %s failed: fetcher exited\n", pathdesc );
+	rc = -1;
+    } else if (( rc = atoi( line )) == 0 ) {
+	line[ strcspn( line, "\n" ) ] = '\0';
+	if ((( p = strchr( line, ' ' )) != NULL ) &&
+		(( q = strchr( p + 1, ' ' )) != NULL )) {
+	    *q++ = '\0';
+	    if ( written != NULL ) {
+		*written = strtoofft( q, NULL, 10 );
+	    }
+	}
+	if (( p == NULL ) ||
+		(( d = decode( p + 1 )) == NULL ) ||
+		( strlen( d ) >= MAXPATHLEN )) {
+	    fprintf( stderr, "retrieve %s failed: bad reply from fetcher\n",
+		    pathdesc );
+	    rc = -1;
+	} else {
+	    strcpy( (char *) temppath, d );
+	}
+    }
+    fe->fe_pending--;
+
+    return( rc );
+}
+
+/*
+ * Read the answer to the oldest request.  A file fetched in pieces is
+ * only checked once all of them are in: every piece must have been
+ * written in full, whether or not there's a checksum to compare.
+ *
+ * Return Value:
+ *	-1 - network error
+ *	 0 - OKAY, staged at temppath
+ *	 1 - error
+ *	 2 - not fetched
+ */
+    static int
+fetch_result( filepath_t *temppath )
+{
+    fetch_entry_t	*fq = fetch_head;
+    filepath_t		piece[ 2 * MAXPATHLEN ];
+    char		cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    struct stat		st;
+    off_t		piecesize, off, written;
+    int			fd, i, r, rc;
+
+    if ( fq->fq_segments == 0 && !fq->fq_incomplete ) {
+	rc = fetch_answer( fq->fq_fetcher, fq->fq_pathdesc, temppath, NULL );
+    } else {
+	/* every piece is read, whatever became of the others */
+	rc = fq->fq_incomplete ? 2 : 0;
+	piecesize = ( fq->fq_size + nfetchers - 1 ) / nfetchers;
+	for ( i = 0, off = 0; i < fq->fq_segments; i++, off += piecesize ) {
+	    written = -1;
+	    r = fetch_answer( &fetchers[ i ], fq->fq_pathdesc, piece,
+		    &written );
+	    if (( r == 0 ) &&
+		    ( written != MIN( piecesize, fq->fq_size - off ))) {
+		fprintf( stderr, "retrieve %s failed: short piece at %"
+			PRIofft "\n", fq->fq_pathdesc, off );
+		r = 1;
+	    }
+	    if (( r != 0 ) && ( rc != -1 ) && (( rc != 1 ) || ( r == -1 ))) {
+		rc = r;
+	    }
+	}
+	/* the pieces asked for cover the file, and nothing cut it short */
+	if (( rc == 0 ) && (( off < fq->fq_size ) ||
+		( stat( fq->fq_temppath, &st ) != 0 ) ||
+		( st.st_size != fq->fq_size ))) {
+	    fprintf( stderr, "retrieve %s failed: incomplete\n",
+		    fq->fq_pathdesc );
+	    rc = 1;
+	}
+	if (( rc == 0 ) && cksum ) {
+	    if ((( fd = open( fq->fq_temppath, O_RDONLY, 0 )) < 0 ) ||
+		    ( do_fcksum( fd, cksum_b64 ) != fq->fq_size ) ||
+		    ( strcmp( fq->fq_cksum, cksum_b64 ) != 0 )) {
+		fprintf( stderr, "line %d: checksum in transcript does not "
+			"match checksum from server\n", linenum );
+		fprintf( stderr, "%s\n", fq->fq_pathdesc );
+		rc = 1;
+	    }
+	    if ( fd >= 0 ) {
+		close( fd );
+	    }
+	}
+	if ( rc == 0 ) {
+	    strcpy( (char *) temppath, fq->fq_temppath );
+	} else {
+	    unlink( fq->fq_temppath );
+	}
+    }
+
+    if (( fetch_head = fq->fq_next ) == NULL ) {
+	fetch_tail = &fetch_head;
+    }
+    fetch_count--;
+    free( fq->fq_pathdesc );
+    free( fq->fq_temppath );
+    free( fq->fq_cksum );
+    free( fq );
+
+    return( rc );
+}
+
+/* wait for everything outstanding and throw it away */
+    static int
+fetch_discard( void )
+{
+    filepath_t		temppath[ 2 * MAXPATHLEN ];
+    int			rc = 0;
+
+    while ( fetch_head != NULL ) {
+	switch ( fetch_result( temppath )) {
+	case 0:
+	    unlink( (char *) temppath );
+	    break;
+	case -1:
+	    rc = -1;
+	    break;
+	default:
+	    break;
+	}
+    }
+
+    return( rc );
+}
+
+/*
+ * Wait for pathdesc, which should be the oldest request, to be staged.
+ * If it is asked for out of order, everything outstanding is discarded
+ * and no more is handed out.
+ *
+ * Return Value:
+ *	-1 - network error
+ *	 0 - OKAY, staged at temppath
+ *	 1 - error
+ *	 2 - not fetched, the caller must retrieve it
+ */
+    int
+fetch_wait( const filepath_t *pathdesc, const filepath_t *path,
+	filepath_t *temppath )
+{
+    fetch_entry_t	*fq;
+    off_t		size;
+    int			rc;
+
+    for ( fq = fetch_head; fq != NULL; fq = fq->fq_next ) {
+	if ( strcmp( fq->fq_pathdesc, (const char *) pathdesc ) == 0 ) {
+	    break;
+	}
+    }
+    if ( fq == NULL ) {
+	/* never handed out */
+	return( 2 );
+    }
+    if ( fq != fetch_head ) {
+	if ( verbose ) printf( "%s: fetched out of order\n", pathdesc );
+	fetch_broken = 1;
+	if ( fetch_discard( ) != 0 ) {
+	    return( -1 );
+	}
+	return( 2 );
+    }
+
+    size = fetch_head->fq_size;
+    if ((( rc = fetch_result( temppath )) == 0 ) && showprogress ) {
+	progressupdate( (ssize_t)size, path );
+    }
+    return( rc );
+}
+
+/* stop the fetchers, removing anything staged and not applied */
+    void
+fetch_stop( void )
+{
+    int			i, status;
+
+    if ( nfetchers == 0 ) {
+	return;
+    }
+
+    fetch_discard( );
+    for ( i = 0; i < nfetchers; i++ ) {
+	fclose( fetchers[ i ].fe_req );
+	fclose( fetchers[ i ].fe_res );
+	waitpid( fetchers[ i ].fe_pid, &status, 0 );
+    }
+    free( fetchers );
+    fetchers = NULL;
+    nfetchers = 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_FETCH_H)
+#  define _RADMIND_FETCH_H "$Id$"
+
+#  include "filepath.h"
+
+/*
+ * Downloads spread over several connections, each served by its own
+ * fetcher process.  Files are staged beside where they will end up and
+ * handed back, in the order they were asked for, to be updated and
+ * renamed into place.  With a server that offers RANGE, a large file is
+ * split between all of them.
+ */
+
+extern int fetch_start( int nfetch, SNET *(*connect)( char *** ));
+extern int fetch_stagedir( const char *path, char *dir, size_t len );
+extern void fetch_segments( off_t min );
+extern int fetch_ahead( const filepath_t *pathdesc, const char *epath,
+	   char type, off_t size, const char *trancksum, int lnum );
+extern int fetch_pending( void );
+extern int fetch_wait( const filepath_t *pathdesc, const filepath_t *path,
+	   filepath_t *temppath );
+extern void fetch_stop( void );
+
+#endif /* defined(_RADMIND_FETCH_H) */
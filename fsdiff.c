@@ -25,6 +25,7 @@
 #include "radstat.h"
 #include "usageopt.h"
 #include "cksum.h"
+#include "digest.h"
 
 void            (*logger)( char * ) = NULL;
 
@@ -405,7 +406,7 @@ main( int argc, char **argv )
 
 	case 'c':	/* --checksum <checksum-type> */
             OpenSSL_add_all_digests();
-            md = EVP_get_digestbyname( optarg );
+            md = digest_byname( optarg );
             if ( !md ) {
                 fprintf( stderr, "%s: unsupported checksum\n", optarg );
                 exit( 2 );
@@ -642,6 +643,9 @@ main( int argc, char **argv )
         printf ("%u transcripts buffered, %u transcripts not buffered\n", 
 		transcripts_buffered, transcripts_unbuffered);
     }
+    if (( debug > 0 ) && cksum ) {
+	cksum_stats_print( stdout );
+    }
 
 
     exit( 0 );	
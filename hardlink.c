@@ -15,157 +15,185 @@
 #include "transcript.h"
 
 
-typedef struct devlist devlist_t;
-typedef struct inolist inolist_t;
+/*
+ * Hardlinked files are tracked in an open addressed hash table keyed by
+ * ( dev, ino ), probed linearly and kept at most half full.  The first
+ * path seen for each inode is kept in an arena, freed with the table.
+ */
 
-struct devlist {
-    devlist_t		*d_next;
-    dev_t		d_dev;
-    struct inolist	*d_ilist;
-};
+typedef struct hlink hlink_t;
+typedef struct hl_arena hl_arena_t;
 
-struct inolist {
-    inolist_t		*i_next;
-    ino_t		i_ino;
-    char		*i_name;
-    int			i_flag;
+struct hlink {
+    dev_t		h_dev;
+    ino_t		h_ino;
+    char		*h_name;	/* NULL for an empty slot */
+    int			h_flag;
 };
 
+#define HL_HASH_MIN	1024
+#define HL_ARENA_CHUNK	( 64 * 1024 )
 
-static devlist_t	*dev_head = (devlist_t *) NULL;
+struct hl_arena {
+    hl_arena_t		*ha_next;
+    size_t		ha_used;
+    char		ha_data[ HL_ARENA_CHUNK ];
+};
+
+static hlink_t		*hl_table = NULL;
+static size_t		hl_size = 0;
+static size_t		hl_count = 0;
+static hl_arena_t	*hl_arena = NULL;
 
-static char		*i_insert( devlist_t *dev_head, pathinfo_t *pinfo );
-static devlist_t	*d_insert( devlist_t **dev_head, pathinfo_t *pinfo );
+static size_t		hl_hash( dev_t dev, ino_t ino );
+static hlink_t		*hl_lookup( hlink_t *table, size_t size,
+			    dev_t dev, ino_t ino );
+static void		hl_grow( void );
+static char		*hl_arena_dup( const char *name );
 void			hardlink_free( void );
 
-    char *
-hardlink( pathinfo_t *pinfo )
+    static size_t
+hl_hash( dev_t dev, ino_t ino )
 {
-    devlist_t	*device;
-
-    device = d_insert( &dev_head, pinfo );
-
-    return( i_insert( device, pinfo ));
+    unsigned long long	h;
+
+    /* inode numbers are often sequential, so mix well */
+    h = (unsigned long long)ino ^
+	    ((unsigned long long)dev * 0x9e3779b97f4a7c15ULL );
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return( (size_t)h );
 }
 
-    static devlist_t * 
-d_insert( devlist_t **dev_head, pathinfo_t *pinfo )
+/* returns the slot for ( dev, ino ), or the empty slot where it belongs */
+    static hlink_t *
+hl_lookup( hlink_t *table, size_t size, dev_t dev, ino_t ino )
 {
-    devlist_t	*new, **cur;
+    size_t		i;
 
-    for ( cur = dev_head; *cur != NULL; cur = &(*cur)->d_next ) {
-	if ( pinfo->pi_stat.st_dev <= (*cur)->d_dev ) {
+    for ( i = hl_hash( dev, ino ) & ( size - 1 ); table[ i ].h_name != NULL;
+	    i = ( i + 1 ) & ( size - 1 )) {
+	if (( table[ i ].h_ino == ino ) && ( table[ i ].h_dev == dev )) {
 	    break;
 	}
     }
+    return( &table[ i ] );
+}
 
-    if (( (*cur) != NULL ) && ( pinfo->pi_stat.st_dev == (*cur)->d_dev )) {
-	return( *cur );
-    }
+    static void
+hl_grow( void )
+{
+    hlink_t		*table, *cur;
+    size_t		size, i;
 
-    if (( new = ( devlist_t * ) malloc( sizeof( devlist_t ))) 
-	    == NULL ) {
-	perror( "d_insert malloc" );
+    size = ( hl_size == 0 ) ? HL_HASH_MIN : hl_size * 2;
+    if (( table = calloc( size, sizeof( hlink_t ))) == NULL ) {
+	perror( "hl_grow calloc" );
 	exit( 2 );
     }
 
-    new->d_dev = pinfo->pi_stat.st_dev; 
-    new->d_ilist = NULL;
-    new->d_next = *cur;
-    *cur = new;
+    for ( i = 0; i < hl_size; i++ ) {
+	if ( hl_table[ i ].h_name == NULL ) {
+	    continue;
+	}
+	cur = hl_lookup( table, size, hl_table[ i ].h_dev,
+		hl_table[ i ].h_ino );
+	*cur = hl_table[ i ];
+    }
 
-    return( *cur );
+    free( hl_table );
+    hl_table = table;
+    hl_size = size;
 }
 
     static char *
-i_insert( devlist_t *dev_head, pathinfo_t *pinfo )
+hl_arena_dup( const char *name )
 {
-    inolist_t	*new, **cur;
-
-    for ( cur = &dev_head->d_ilist; *cur != NULL; cur = &(*cur)->i_next ) {
-	if ( pinfo->pi_stat.st_ino <= (*cur)->i_ino ) {
-	    break;
+    hl_arena_t		*arena;
+    char		*p;
+    size_t		len = strlen( name ) + 1;
+
+    if ((( arena = hl_arena ) == NULL ) ||
+	    ( arena->ha_used + len > HL_ARENA_CHUNK )) {
+	if (( arena = malloc( sizeof( hl_arena_t ))) == NULL ) {
+	    perror( "hl_arena_dup malloc" );
+	    exit( 2 );
 	}
+	arena->ha_used = 0;
+	arena->ha_next = hl_arena;
+	hl_arena = arena;
     }
 
-    if (( (*cur) != NULL ) && ( pinfo->pi_stat.st_ino == (*cur)->i_ino )) {
-	return( (*cur)->i_name );
-    }
+    p = arena->ha_data + arena->ha_used;
+    memcpy( p, name, len );
+    arena->ha_used += len;
 
-    if (( new = ( inolist_t * ) malloc( sizeof( inolist_t ))) 
-	    == NULL ) {
-	perror( "i_insert malloc" );
-	exit( 2 );
-    }
+    return( p );
+}
 
-    if (( new->i_name = strdup((char *) pinfo->pi_name )) == NULL ) {
-	perror( "i_insert strdup" );
-	exit( 2 );
+/*
+ * return values:
+ *	NULL	first path seen for this inode, now remembered
+ *	else	the first path seen for this inode
+ */
+    char *
+hardlink( pathinfo_t *pinfo )
+{
+    hlink_t	*cur;
+
+    if (( hl_count + 1 ) * 2 > hl_size ) {
+	hl_grow( );
     }
 
-    new->i_ino = pinfo->pi_stat.st_ino;
-    new->i_flag = 0;
+    cur = hl_lookup( hl_table, hl_size, pinfo->pi_stat.st_dev,
+	    pinfo->pi_stat.st_ino );
+    if ( cur->h_name != NULL ) {
+	return( cur->h_name );
+    }
 
-    new->i_next = *cur;
-    *cur = new;
+    cur->h_dev = pinfo->pi_stat.st_dev;
+    cur->h_ino = pinfo->pi_stat.st_ino;
+    cur->h_name = hl_arena_dup( (char *) pinfo->pi_name );
+    cur->h_flag = 0;
+    hl_count++;
 
     return( NULL );
-
 }
 
     void
 hardlink_free( )
 {
-    devlist_t	*dev_next;
-    inolist_t	*ino_head, *ino_next;
-
-    while ( dev_head != (devlist_t *) NULL ) {
-	dev_next = dev_head->d_next;
-	ino_head = dev_head->d_ilist;
-	while ( ino_head != NULL ) {
-	    ino_next = ino_head->i_next;
-	    free( ino_head->i_name);
-	    free( ino_head );
-	    ino_head = ino_next;
-	}
-	free( dev_head );
-	dev_head = dev_next;
+    hl_arena_t	*arena;
+
+    while (( arena = hl_arena ) != NULL ) {
+	hl_arena = arena->ha_next;
+	free( arena );
     }
+    free( hl_table );
+    hl_table = NULL;
+    hl_size = 0;
+    hl_count = 0;
 }
 
     int
 hardlink_changed( pathinfo_t *pinfo, int set )
 {
-    devlist_t	*dcur;
-    inolist_t	*icur;
+    hlink_t	*cur = NULL;
 
-    for ( dcur = dev_head; dcur != (devlist_t *) NULL; dcur = dcur->d_next ) {
-	if ( pinfo->pi_stat.st_dev <= dcur->d_dev ) {
-	    break;
-	}
-    }
-    
-    if (( dcur == (devlist_t *) NULL ) || ( pinfo->pi_stat.st_dev != dcur->d_dev )) {
-	fprintf( stderr, "hardlink_changed: %s: dev not found\n",
-		pinfo->pi_name );
-	exit( 2 );
+    if ( hl_table != NULL ) {
+	cur = hl_lookup( hl_table, hl_size, pinfo->pi_stat.st_dev,
+		pinfo->pi_stat.st_ino );
     }
-
-    for ( icur = dcur->d_ilist; icur != (inolist_t *) NULL; icur = icur->i_next ) {
-	if ( pinfo->pi_stat.st_ino <= icur->i_ino ) {
-	    break;
-	}
-    }
-
-    if (( icur == NULL ) || ( pinfo->pi_stat.st_ino != icur->i_ino )) {
-	fprintf( stderr, "hardlink_changed: %s: ino not found\n",
+    if (( cur == NULL ) || ( cur->h_name == NULL )) {
+	fprintf( stderr, "hardlink_changed: %s: dev/ino not found\n",
 		pinfo->pi_name );
 	exit( 2 );
     }
 
     if ( set ) {
-	icur->i_flag = 1;
+	cur->h_flag = 1;
     }
 
-    return( icur->i_flag );
+    return( cur->h_flag );
 }
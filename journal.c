@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "code.h"
+#include "journal.h"
+
+/*
+ * The journal is a text file of one entry per line, appended to as
+ * lapply goes:
+ *
+ *	D <key>			the line was applied
+ *	P <key> <temppath>	the line's download stopped part way,
+ *				what arrived is in temppath
+ *
+ * A run that finishes removes it, and any partial downloads left unused.
+ */
+
+typedef struct journal_partial journal_partial_t;
+
+struct journal_partial {
+    journal_partial_t	*jp_next;
+    unsigned long long	jp_key;
+    filepath_t		*jp_path;
+};
+
+static char			*journal_path = NULL;
+static FILE			*journal_f = NULL;
+static unsigned long long	*journal_keys = NULL;
+static size_t			journal_nkeys = 0;
+static journal_partial_t	*journal_partials = NULL;
+static int			journal_held = 0;
+
+    static int
+key_cmp( const void *a, const void *b )
+{
+    unsigned long long	ka = *(const unsigned long long *)a;
+    unsigned long long	kb = *(const unsigned long long *)b;
+
+    return(( ka > kb ) - ( ka < kb ));
+}
+
+    int
+journal_open( const char *path )
+{
+    FILE			*f;
+    journal_partial_t		*jp;
+    char			line[ 2 * MAXPATHLEN ];
+    char			epath[ 2 * MAXPATHLEN ];
+    const char			*d_path;
+    unsigned long long		key, *keys;
+    size_t			size = 0;
+
+    if (( f = fopen( path, "r" )) != NULL ) {
+	while ( fgets( line, sizeof( line ), f ) != NULL ) {
+	    if ( sscanf( line, "D %llx", &key ) == 1 ) {
+		if ( journal_nkeys == size ) {
+		    size = size ? size * 2 : 1024;
+		    if (( keys = realloc( journal_keys,
+			    size * sizeof( *keys ))) == NULL ) {
+			perror( "realloc" );
+			fclose( f );
+			return( -1 );
+		    }
+		    journal_keys = keys;
+		}
+		journal_keys[ journal_nkeys++ ] = key;
+
+	    } else if ( sscanf( line, "P %llx %s", &key, epath ) == 2 ) {
+		if (( d_path = decode( epath )) == NULL ) {
+		    continue;
+		}
+		if ((( jp = malloc( sizeof( journal_partial_t ))) == NULL ) ||
+			(( jp->jp_path = (filepath_t *) strdup( d_path ))
+			== NULL )) {
+		    perror( "malloc" );
+		    fclose( f );
+		    return( -1 );
+		}
+		jp->jp_key = key;
+		jp->jp_next = journal_partials;
+		journal_partials = jp;
+	    }
+	    /* anything else is the end of a write cut short */
+	}
+	fclose( f );
+	qsort( journal_keys, journal_nkeys, sizeof( *journal_keys ), key_cmp );
+    } else if ( errno != ENOENT ) {
+	perror( path );
+	return( -1 );
+    }
+
+    if (( journal_f = fopen( path, "a" )) == NULL ) {
+	perror( path );
+	return( -1 );
+    }
+    if (( journal_path = strdup( path )) == NULL ) {
+	perror( "strdup" );
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/* FNV-1a */
+    unsigned long long
+journal_key( const filepath_t *tran, const char *tline )
+{
+    unsigned long long	h = 14695981039346656037ULL;
+    const unsigned char	*p;
+
+    for ( p = (const unsigned char *) tran; *p != '\0'; p++ ) {
+	h = ( h ^ *p ) * 1099511628211ULL;
+    }
+    h = ( h ^ ':' ) * 1099511628211ULL;
+    for ( p = (const unsigned char *) tline; *p != '\0'; p++ ) {
+	h = ( h ^ *p ) * 1099511628211ULL;
+    }
+    return( h );
+}
+
+/* an earlier run left entries to pick up from */
+    int
+journal_resuming( void )
+{
+    return(( journal_nkeys != 0 ) || ( journal_partials != NULL ));
+}
+
+/* applied by an earlier run */
+    int
+journal_done( unsigned long long key )
+{
+    if ( journal_nkeys == 0 ) {
+	return( 0 );
+    }
+    return( bsearch( &key, journal_keys, journal_nkeys,
+	    sizeof( *journal_keys ), key_cmp ) != NULL );
+}
+
+/*
+ * An entry is on disk before the next line is started, so that what a
+ * crash leaves of the journal covers everything done before it.
+ */
+    static void
+journal_sync( void )
+{
+    if (( fflush( journal_f ) != 0 ) ||
+	    ( fsync( fileno( journal_f )) != 0 )) {
+	perror( journal_path );
+    }
+}
+
+/*
+ * While held, entries are only written, and they're synced together
+ * once released, for when a batch of lines is marked done at once.
+ */
+    void
+journal_hold( int hold )
+{
+    journal_held = hold;
+    if ( !hold && ( journal_f != NULL )) {
+	journal_sync( );
+    }
+}
+
+    void
+journal_mark( unsigned long long key )
+{
+    if ( journal_f == NULL ) {
+	return;
+    }
+    fprintf( journal_f, "D %016llx\n", key );
+    if ( journal_held ) {
+	fflush( journal_f );
+    } else {
+	journal_sync( );
+    }
+}
+
+    void
+journal_partial( unsigned long long key, const filepath_t *temppath )
+{
+    if ( journal_f == NULL ) {
+	return;
+    }
+    fprintf( journal_f, "P %016llx %s\n", key,
+	    encode( (const char *) temppath ));
+    journal_sync( );
+}
+
+/*
+ * What an earlier run received of the line's file, or NULL.  The caller
+ * removes it once done with it.
+ */
+    const filepath_t *
+journal_resume( unsigned long long key )
+{
+    journal_partial_t	*jp;
+    struct stat		st;
+
+    for ( jp = journal_partials; jp != NULL; jp = jp->jp_next ) {
+	if ( jp->jp_key != key ) {
+	    continue;
+	}
+	if (( lstat( (const char *) jp->jp_path, &st ) == 0 ) &&
+		S_ISREG( st.st_mode ) && ( st.st_size > 0 )) {
+	    return( jp->jp_path );
+	}
+    }
+    return( NULL );
+}
+
+/*
+ * Once every line has been applied the journal has nothing more to say.
+ * Otherwise it's kept for the next run.
+ */
+    void
+journal_close( int complete )
+{
+    journal_partial_t	*jp;
+
+    if ( journal_f == NULL ) {
+	return;
+    }
+    fclose( journal_f );
+    journal_f = NULL;
+
+    if ( !complete ) {
+	return;
+    }
+    for ( jp = journal_partials; jp != NULL; jp = jp->jp_next ) {
+	if (( unlink( (const char *) jp->jp_path ) != 0 ) &&
+		( errno != ENOENT )) {
+	    perror( (const char *) jp->jp_path );
+	}
+    }
+    if ( unlink( journal_path ) != 0 ) {
+	perror( journal_path );
+    }
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_JOURNAL_H)
+#  define _RADMIND_JOURNAL_H "$Id$"
+
+#  include "filepath.h"
+
+/*
+ * A record of the transcript lines lapply has applied, and of downloads
+ * cut short, so that a run that fails can be picked up where it left
+ * off.  Lines are known by a hash of the transcript name and the line.
+ * Nothing is recorded until journal_open() is called.
+ */
+
+extern int  journal_open( const char *path );
+extern unsigned long long journal_key( const filepath_t *tran,
+	    const char *tline );
+extern int  journal_resuming( void );
+extern int  journal_done( unsigned long long key );
+extern void journal_hold( int hold );
+extern void journal_mark( unsigned long long key );
+extern void journal_partial( unsigned long long key,
+	    const filepath_t *temppath );
+extern const filepath_t *journal_resume( unsigned long long key );
+extern void journal_close( int complete );
+
+#endif /* defined(_RADMIND_JOURNAL_H) */
@@ -38,6 +38,7 @@
 #include "applefile.h"
 #include "base64.h"
 #include "cksum.h"
+#include "digest.h"
 #include "connect.h"
 #include "argcargv.h"
 #include "list.h"
@@ -50,13 +51,15 @@
 #include "report.h"
 #include "mkprefix.h"
 #include "usageopt.h"
+#include "tfile.h"
 
 static void ktcheck_usage (FILE *out, int verbose);
 static int cleandirs( const filepath_t *path, llist_t *khead );
 static int clean_client_dir( void );
 static int check( SNET *sn, const char *type, const filepath_t *path); 
 static int createspecial( SNET *sn, struct list *special_list );
-static int getstat( SNET *sn, const char *description, char *stats );
+static int getstat( SNET *sn, const char *description, char *stats,
+		    int optional );
 static int read_kfile( const filepath_t *kfile, const char *event );
 SNET *sn;
 
@@ -72,6 +75,7 @@ int			change = 0;
 int			case_sensitive = 1;
 int			report = 1;
 int			create_prefix = 0;
+int			tgz = 0;	/* server offers compressed transcripts */
 static filepath_t	*base_kfile= (filepath_t *) _RADMIND_COMMANDFILE;
 static filepath_t	*radmind_path = (filepath_t *) _RADMIND_PATH;
 static filepath_t	*kdir= (filepath_t *) "";
@@ -267,8 +271,15 @@ clean_client_dir( void )
     return( 0 );
 }
 
+/*
+ * return codes:
+ *	0	okay
+ *	1	optional object not on server
+ *	-1	system error
+ */
+
     static int 
-getstat( SNET *sn, const char *description, char *stats ) 
+getstat( SNET *sn, const char *description, char *stats, int optional ) 
 {
     struct timeval      tv;
     char		*line;
@@ -286,6 +297,9 @@ getstat( SNET *sn, const char *description, char *stats )
 	return( -1 );
     }
     if ( *line != '2' ) {
+	if ( optional && *line == '5' ) {
+	    return( 1 );
+	}
 	fprintf( stderr, "%s\n", line );
 	exit( 2 );
     }
@@ -336,7 +350,7 @@ createspecial( SNET *sn, struct list *special_list )
 	    return( 1 );
 	}
 
-	if ( getstat( sn, filedesc, stats ) != 0 ) {
+	if ( getstat( sn, filedesc, stats, 0 ) != 0 ) {
 	    return( 1 );
 	}
 
@@ -468,9 +482,29 @@ check( SNET *sn, const char *type, const filepath_t *file )
 	filepath_cpy( path, base_kfile );
     }
 
-    if ( getstat( sn, pathdesc, stats ) != 0 ) {
+    /* prefer the compressed copy of a transcript, if the server has one */
+    if ( tgz && file != base_kfile && strcmp( type, "TRANSCRIPT" ) == 0 ) {
+	char	gzdesc[ 2 * MAXPATHLEN ];
+
+	if ( snprintf( gzdesc, MAXPATHLEN * 2, "%s%s", pathdesc,
+		TFILE_GZIP_SUFFIX ) < ( MAXPATHLEN * 2 )) {
+	    switch ( getstat( sn, gzdesc, stats, 1 )) {
+	    case 0:
+		strcpy( pathdesc, gzdesc );
+		goto gotstat;
+	    case 1:
+		break;
+	    default:
+		return( 2 );
+	    }
+	}
+    }
+
+    if ( getstat( sn, pathdesc, stats, 0 ) != 0 ) {
 	return( 2 );
     }
+
+gotstat:
     tac = acav_parse( NULL, stats, &targv );
     if ( tac != 8 ) {
 	perror( "Incorrect number of arguments\n" );
@@ -695,6 +729,7 @@ main( int argc, char **argv )
     struct stat		tst, lst;
     extern int          optind;
     char		*host = _RADMIND_HOST, *p;
+    char		*cksum_name = NULL;
     filepath_t		path[ MAXPATHLEN ];
     filepath_t		tempfile[ MAXPATHLEN ];
     char	        **capa = (char **) NULL; /* capabilities */
@@ -719,12 +754,13 @@ main( int argc, char **argv )
 
 	case 'c':
             OpenSSL_add_all_digests();
-            md = EVP_get_digestbyname( optarg );
+            md = digest_byname( optarg );
             if ( !md ) {
                 fprintf( stderr, "%s: unsupported checksum\n", optarg );
 		ktcheck_usage (stderr, 0);
                 exit( 2 );
             }
+            cksum_name = optarg;
             cksum = 1;
             break;
 
@@ -942,6 +978,29 @@ main( int argc, char **argv )
 	report = 0;
     }
 
+    /* STAT checksums are useless unless the server uses ours */
+    if ( cksum ) {
+	switch ( negotiate_cksum( sn, capa, cksum_name )) {
+	case 0:
+	    break;
+
+	case 1:
+	    fprintf( stderr, "server does not support %s checksums\n",
+		    cksum_name );
+	    exit( 2 );
+
+	default:
+	    exit( 2 );
+	}
+    }
+
+#ifdef HAVE_ZLIB
+    /* only fetch compressed transcripts we can read */
+    if ( check_capability( "TGZ", capa ) == 1 ) {
+	tgz = 1;
+    }
+#endif /* HAVE_ZLIB */
+
     /* Check/get correct base command file */
     switch( check( sn, "COMMAND", NULL )) { 
     case 0:
@@ -11,6 +11,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,10 +32,17 @@
 
 #include "applefile.h"
 #include "base64.h"
+#include "cache.h"
 #include "cksum.h"
+#include "digest.h"
 #include "connect.h"
+#include "fetch.h"
+#include "durable.h"
+#include "journal.h"
+#include "local.h"
 #include "argcargv.h"
 #include "radstat.h"
+#include "transcript.h"
 #include "code.h"
 #include "pathcmp.h"
 #include "update.h"
@@ -77,12 +85,94 @@ struct apply_node {
     apply_node_t        *next;
 };
 
+typedef struct ahead_line ahead_line_t;
+typedef struct stage_entry stage_entry_t;
+
+/*
+ * Lines read ahead of the one being applied.  Downloads are requested
+ * as their lines are read, up to retr_window at a time, so that each
+ * RETR's round trip overlaps applying the lines before it.
+ */
+struct ahead_line {
+    ahead_line_t	*al_next;
+    char		*al_line;
+};
+
+/* downloads fetched by -S, in transcript order */
+struct stage_entry {
+    stage_entry_t	*se_next;
+    unsigned long long	se_key;
+    filepath_t		*se_temppath;
+};
+
+#define LAPPLY_RETR_WINDOW	16
+#define LAPPLY_AHEAD_LINES	4096
+
+/* smaller files aren't worth the signatures */
+#define LAPPLY_DELTA_MIN	( 1024 * 1024 )
+/* or splitting between connections */
+#define LAPPLY_SEGMENT_MIN	( 64 * 1024 * 1024 )
+
+static ahead_line_t	*ahead_head = NULL;
+static ahead_line_t	**ahead_tail = &ahead_head;
+static int		ahead_lines = 0;
+static int		ahead_eof = 0;
+static ahead_line_t	*ahead_hold = NULL;	/* read no further */
+static filepath_t	ahead_tran[ 2 * MAXPATHLEN ] = { 0 };
+static int		ahead_special = 0;
+static int		retr_window = LAPPLY_RETR_WINDOW;
+static int		connections = 1;
+static char		*cache_path = NULL;
+static char		*journal_path = NULL;
+static int		delta = 0;
+static int		range = 0;
+static int		jobs = 1;
+static int		stage = 0;
+static int		bootstrap = 0;
+static stage_entry_t	*stage_head = NULL;
+static stage_entry_t	**stage_tail = &stage_head;
+static unsigned int	stage_seq = 0;
+
+static char		*host = _RADMIND_HOST;
+static unsigned short	port = 0;
+static int		authlevel = _RADMIND_AUTHLEVEL;
+
 static void             lapply_usage (FILE *out, int verbose);
 static apply_node_t 	*apply_node_create( const filepath_t *path, const char *tline,
 					    const filepath_t *tran );
 static void 		apply_node_free( apply_node_t *ap_node );
 static int 		do_line( char *tline, const filepath_t *tran, int present,
 				struct stat *st, SNET *sn );
+static int		download( SNET *sn, const filepath_t *tran,
+				char **targv, unsigned long long key,
+				const filepath_t *path, const filepath_t *dest,
+				filepath_t *temppath );
+static FILE		*stage_copy( FILE *f );
+static int		stage_all( FILE *f, SNET *sn );
+static int		stage_take( unsigned long long key,
+				filepath_t *temppath );
+static void		stage_discard( void );
+static int		update_line( const filepath_t *path, int present,
+				struct stat *st, int tac, char **targv );
+static int		local_apply( char *tline, int present );
+static int		apply_line( char *tline, const filepath_t *tran,
+				int present, struct stat *st, SNET *sn );
+static int		apply_remove( const filepath_t *path, int isdir,
+				int structural );
+static SNET		*lapply_connect( char ***p_capa );
+static void		cache_removed( const filepath_t *path );
+static int		ahead_request( const char *tline, int lnum, SNET *sn );
+static const filepath_t	*resume_partial( unsigned long long key,
+			    off_t size );
+static int		delta_wanted( const filepath_t *path, off_t size,
+				const char *cksum_b64 );
+static const filepath_t	*delta_base( unsigned long long key,
+				const filepath_t *path, off_t size,
+				const char *cksum_b64 );
+static int		journal_verified( const filepath_t *path,
+				struct stat *st, char fstype, int tac,
+				char **targv );
+static char		*ahead_fgets( char *tline, int size, FILE *f, SNET *sn );
 
    static apply_node_t *
 apply_node_create( const filepath_t *path, const char *tline, const filepath_t *tran )
@@ -136,6 +226,571 @@ apply_node_free( apply_node_t *ap_node )
     free( ap_node );
 }
 
+/* keep a file about to be removed, in case it's installed elsewhere */
+    static void
+cache_removed( const filepath_t *path )
+{
+    char		cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+
+    if ( cache_path == NULL ) {
+	return;
+    }
+    if ( do_cksum( path, cksum_b64 ) < 0 ) {
+	return;
+    }
+    cache_add( path, cksum_b64 );
+}
+
+/*
+ * Connect, start TLS and compression as asked.  Used for the main
+ * connection and by each fetcher for its own.
+ */
+    static SNET *
+lapply_connect( char ***p_capa )
+{
+    SNET		*sn;
+
+    if (( sn = connectsn( host, port )) == NULL ) {
+	return( NULL );
+    }
+    if (( *p_capa = get_capabilities( sn )) == NULL ) {
+	return( NULL );
+    }
+
+    if ( authlevel != 0 ) {
+	if ( tls_client_start( sn, host, authlevel ) != 0 ) {
+	    /* error message printed in tls_cleint_starttls */
+	    return( NULL );
+	}
+    }
+
+#ifdef HAVE_ZLIB
+    /* Enable compression */
+    if ( zlib_level > 0 ) {
+	if ( negotiate_compression( sn, *p_capa ) != 0 ) {
+	    return( NULL );
+	}
+    }
+#endif /* HAVE_ZLIB */
+
+    return( sn );
+}
+
+/*
+ * Request tline's file now if it's a download, building the request
+ * just as do_line() will.  With more than one connection it goes to a
+ * fetcher, otherwise the RETR is sent on sn.
+ *
+ * Return Value:
+ *	-1 - network error
+ *	 0 - OKAY, or nothing to send
+ *	 1 - not sent, do_line() will send it, and nothing after it may be
+ *	     sent before then
+ */
+    static int
+ahead_request( const char *tline, int lnum, SNET *sn )
+{
+    static ACAV			*acav = NULL;
+    char			line[ 2 * MAXPATHLEN ];
+    char			**targv;
+    int				tac;
+    size_t			len;
+    const char			*d_path;
+    const filepath_t		*base;
+    unsigned long long		key;
+    off_t			size;
+    struct stat			st;
+    filepath_t			pathdesc[ 2 * MAXPATHLEN ];
+
+    if (( acav == NULL ) && (( acav = acav_alloc( )) == NULL )) {
+	return( 0 );
+    }
+    strcpy( line, tline );
+    tac = acav_parse( acav, line, &targv );
+
+    if ( tac == 1 ) {
+	len = strlen( targv[ 0 ] );
+	if (( len > 1 ) && ( targv[ 0 ][ len - 1 ] == ':' )) {
+	    memcpy( ahead_tran, targv[ 0 ], len - 1 );
+	    ahead_tran[ len - 1 ] = '\0';
+	    ahead_special = ( filepath_cmp( ahead_tran,
+		    (filepath_t *) "special.T" ) == 0 );
+	}
+	return( 0 );
+    }
+
+    if (( tac < 9 ) || ( *targv[ 0 ] != '+' ) || ( *ahead_tran == '\0' ) ||
+	    (( *targv[ 1 ] != 'f' ) && ( *targv[ 1 ] != 'a' ))) {
+	return( 0 );
+    }
+    /* retr() refuses these without asking the server */
+    if ( cksum && ( strcmp( targv[ 8 ], "-" ) == 0 )) {
+	return( 0 );
+    }
+    /* or copies them from the cache */
+    if (( *targv[ 1 ] == 'f' ) && cache_has( strtoofft( targv[ 7 ], NULL, 10 ),
+	    targv[ 8 ] )) {
+	return( 0 );
+    }
+    /* or an earlier run got them */
+    key = journal_key( ahead_tran, tline );
+    if ( journal_done( key )) {
+	return( 0 );
+    }
+
+    if ( ahead_special ) {
+	if ( snprintf( (char *) pathdesc, MAXPATHLEN * 2, "SPECIAL %s",
+		targv[ 2 ]) >= ( MAXPATHLEN * 2 )) {
+	    return( 0 );
+	}
+    } else {
+	if ( snprintf( (char *) pathdesc, MAXPATHLEN * 2, "FILE %s %s",
+		ahead_tran, targv[ 2 ]) >= ( MAXPATHLEN * 2 )) {
+	    return( 0 );
+	}
+    }
+
+    size = strtoofft( targv[ 7 ], NULL, 10 );
+    if ( connections > 1 ) {
+	return( fetch_ahead( pathdesc, targv[ 2 ], *targv[ 1 ],
+		size, targv[ 8 ], lnum ));
+    }
+    if (( *targv[ 1 ] == 'f' ) &&
+	    (( base = resume_partial( key, size )) != NULL ) &&
+	    ( lstat( (const char *) base, &st ) == 0 )) {
+	return( range_ahead( sn, pathdesc, st.st_size, size - st.st_size ));
+    }
+    if (( *targv[ 1 ] == 'f' ) && (( d_path = decode( targv[ 2 ] )) != NULL )
+	    && (( base = delta_base( key, (filepath_t *) d_path,
+	    size, targv[ 8 ] )) != NULL )) {
+	return( delta_ahead( sn, pathdesc, base ));
+    }
+    return( retr_ahead( sn, pathdesc ));
+}
+
+/*
+ * What an earlier run received of a file, when the server can send just
+ * the rest of it.
+ */
+    static const filepath_t *
+resume_partial( unsigned long long key, off_t size )
+{
+    const filepath_t		*partial;
+    struct stat			st;
+
+    if ( !range || ( connections > 1 ) ||
+	    (( partial = journal_resume( key )) == NULL ) ||
+	    ( lstat( (const char *) partial, &st ) != 0 ) ||
+	    ( st.st_size >= size )) {
+	return( NULL );
+    }
+    return( partial );
+}
+
+/*
+ * Large files already here are fetched as a delta against the old copy,
+ * when the server offers it and the cache doesn't have the new one.
+ */
+    static int
+delta_wanted( const filepath_t *path, off_t size, const char *cksum_b64 )
+{
+    struct stat			st;
+
+    if ( !delta || ( connections > 1 ) || ( size < LAPPLY_DELTA_MIN )) {
+	return( 0 );
+    }
+    if (( lstat( (const char *) path, &st ) != 0 ) ||
+	    !S_ISREG( st.st_mode ) || ( st.st_size < LAPPLY_DELTA_MIN )) {
+	return( 0 );
+    }
+    return( !cache_has( size, cksum_b64 ));
+}
+
+/*
+ * The copy to ask for a delta against: what an earlier run received,
+ * or the file already at path, or NULL for the whole file.
+ */
+    static const filepath_t *
+delta_base( unsigned long long key, const filepath_t *path, off_t size,
+	const char *cksum_b64 )
+{
+    const filepath_t		*partial;
+
+    if ( delta && ( connections == 1 ) &&
+	    (( partial = journal_resume( key )) != NULL ) &&
+	    !cache_has( size, cksum_b64 )) {
+	return( partial );
+    }
+    if ( delta_wanted( path, size, cksum_b64 )) {
+	return( path );
+    }
+    return( NULL );
+}
+
+/*
+ * A line an earlier run applied is skipped if the file system still
+ * matches it.  Links and applefiles are simply applied again.
+ */
+    static int
+journal_verified( const filepath_t *path, struct stat *st, char fstype,
+	int tac, char **targv )
+{
+    char			cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+
+    if ( fstype != *targv[ 0 ] ) {
+	return( 0 );
+    }
+    switch ( *targv[ 0 ] ) {
+    case 'f':
+	if (( tac != 8 ) ||
+		( st->st_size != strtoofft( targv[ 6 ], NULL, 10 )) ||
+		( st->st_mtime != atoi( targv[ 5 ] ))) {
+	    return( 0 );
+	}
+	if ( cksum && ( strcmp( targv[ 7 ], "-" ) != 0 )) {
+	    if (( do_cksum( path, cksum_b64 ) < 0 ) ||
+		    ( strcmp( targv[ 7 ], cksum_b64 ) != 0 )) {
+		return( 0 );
+	    }
+	}
+	break;
+
+    case 'd':
+    case 'p':
+    case 'b':
+    case 'c':
+    case 's':
+    case 'D':
+	if ( tac < 5 ) {
+	    return( 0 );
+	}
+	break;
+
+    default:
+	return( 0 );
+    }
+
+    if ((( T_MODE & st->st_mode ) != strtol( targv[ 2 ], NULL, 8 )) ||
+	    ( st->st_uid != atoi( targv[ 3 ] )) ||
+	    ( st->st_gid != atoi( targv[ 4 ] ))) {
+	return( 0 );
+    }
+    return( 1 );
+}
+
+/*
+ * fgets() for the main loop.  With a network connection, lines are
+ * read ahead until retr_window downloads per connection are outstanding.
+ */
+    static char *
+ahead_fgets( char *tline, int size, FILE *f, SNET *sn )
+{
+    ahead_line_t		*al;
+    char			buf[ MAXPATHLEN ];
+
+    while (( sn != NULL ) && ( retr_window > 0 ) && !ahead_eof &&
+	    ( ahead_hold == NULL ) && ( ahead_lines < LAPPLY_AHEAD_LINES ) &&
+	    ( retr_ahead_pending( ) + fetch_pending( ) <
+	    retr_window * connections )) {
+	if ( fgets( buf, MIN( size, sizeof( buf )), f ) == NULL ) {
+	    ahead_eof = 1;
+	    break;
+	}
+	if ((( al = malloc( sizeof( ahead_line_t ))) == NULL ) ||
+		(( al->al_line = strdup( buf )) == NULL )) {
+	    perror( "ahead_fgets: malloc" );
+	    exit( 2 );
+	}
+	al->al_next = NULL;
+	*ahead_tail = al;
+	ahead_tail = &al->al_next;
+	ahead_lines++;
+
+	switch ( ahead_request( buf, linenum + ahead_lines, sn )) {
+	case 0:
+	    break;
+
+	case 1:
+	    /* its request waits until the replies before it are read */
+	    ahead_hold = al;
+	    break;
+
+	default:
+	    /* the RETR for this line will fail in turn */
+	    retr_window = 0;
+	    break;
+	}
+    }
+
+    if (( al = ahead_head ) == NULL ) {
+	if ( ahead_eof ) {
+	    return( NULL );
+	}
+	return( fgets( tline, size, f ));
+    }
+
+    if (( ahead_head = al->al_next ) == NULL ) {
+	ahead_tail = &ahead_head;
+    }
+    if ( al == ahead_hold ) {
+	ahead_hold = NULL;
+    }
+    ahead_lines--;
+    strcpy( tline, al->al_line );
+    free( al->al_line );
+    free( al );
+
+    return( tline );
+}
+
+/*
+ * Retrieve the file for a "+" line, whose targv has had the "+" taken
+ * off, to a temporary file beside dest.  path is where it will go.
+ *
+ * Return Value:
+ *	-1 - network error, what arrived may be kept for the journal
+ *	 0 - OKAY, in temppath
+ *	 1 - error
+ */
+    static int
+download( SNET *sn, const filepath_t *tran, char **targv,
+	unsigned long long key, const filepath_t *path,
+	const filepath_t *dest, filepath_t *temppath )
+{
+    filepath_t			pathdesc[ 2 * MAXPATHLEN ];
+    const filepath_t		*base;
+    const filepath_t		*partial;
+    struct stat			tst;
+    off_t			size;
+    int				rc;
+
+    if ( special ) {
+      if ( snprintf( (char *) pathdesc, MAXPATHLEN * 2, "SPECIAL %s",
+		targv[ 1 ]) >= ( MAXPATHLEN * 2 )) {
+	    fprintf( stderr, "SPECIAL %s: too long\n", targv[ 1 ]);
+	    return( 1 );
+	}
+    } else {
+      if ( snprintf( (char *) pathdesc, MAXPATHLEN * 2, "FILE %s %s",
+		tran, targv[ 1 ]) >= ( MAXPATHLEN * 2 )) {
+	    fprintf( stderr, "FILE %s %s: command too long\n",
+		tran, targv[ 1 ]);
+	    return( 1 );
+	}
+    }
+    size = strtoofft( targv[ 6 ], NULL, 10 );
+    *temppath = '\0';
+
+    /* a fetcher may have staged it already */
+    if (( rc = fetch_wait( pathdesc, path, temppath )) == 2 ) {
+	if ( *targv[ 0 ] == 'a' ) {
+	    rc = retr_applefile( sn, pathdesc, dest, temppath, 0600,
+		size, targv[ 7 ] );
+	} else {
+	    if (( partial = resume_partial( key, size )) != NULL ) {
+		rc = retr_resume( sn, pathdesc, dest, partial, temppath, 0600,
+		    size, targv[ 7 ] );
+	    }
+	    if (( rc == 2 ) && (( base = delta_base( key, path, size,
+		    targv[ 7 ] )) != NULL )) {
+		rc = retr_delta( sn, pathdesc, dest, base, temppath, 0600,
+		    size, targv[ 7 ] );
+		/* an earlier run's partial download is used up */
+		if (( base != path ) && ( rc != -1 )) {
+		    unlink( (const char *) base );
+		}
+	    }
+	    if ( rc == 2 ) {
+		rc = retr( sn, pathdesc, dest, temppath, 0600,
+		    size, targv[ 7 ] );
+	    }
+	}
+    }
+    if ( rc == -1 ) {
+	/* Network problem */
+	network = 0;
+	if (( *temppath != '\0' ) &&
+		( lstat( (const char *) temppath, &tst ) == 0 )) {
+	    journal_partial( key, temppath );
+	}
+    }
+    return( rc );
+}
+
+/*
+ * With -S, every download is retrieved before anything is changed, to
+ * a name in the deepest directory above it that exists now.  Lines are
+ * read ahead just as they are when applied, so the same requests are
+ * sent the same way.
+ *
+ * Return Value:
+ *	-1 - network error
+ *	 0 - OKAY
+ *	 1 - error
+ */
+    static int
+stage_all( FILE *f, SNET *sn )
+{
+    ACAV			*acav;
+    char			tline[ 2 * MAXPATHLEN ];
+    char			line[ 2 * MAXPATHLEN ];
+    char			**targv;
+    char			dir[ MAXPATHLEN ];
+    int				tac, rc = 0;
+    size_t			len;
+    const char			*d_path;
+    unsigned long long		key;
+    filepath_t			tran[ 2 * MAXPATHLEN ] = { 0 };
+    filepath_t			dest[ MAXPATHLEN ];
+    filepath_t			temppath[ 2 * MAXPATHLEN ];
+    stage_entry_t		*se;
+
+    if (( acav = acav_alloc( )) == NULL ) {
+	return( 1 );
+    }
+
+    while ( ahead_fgets( tline, MAXPATHLEN, f, sn ) != NULL ) {
+	linenum++;
+	if ( strlen( tline ) >= sizeof( line )) {
+	    continue;
+	}
+	strcpy( line, tline );
+	tac = acav_parse( acav, line, &targv );
+
+	if ( tac == 1 ) {
+	    len = strlen( targv[ 0 ] );
+	    if (( len > 1 ) && ( targv[ 0 ][ len - 1 ] == ':' )) {
+		memcpy( tran, targv[ 0 ], len - 1 );
+		tran[ len - 1 ] = '\0';
+		special = ( filepath_cmp( tran,
+			(filepath_t *) "special.T" ) == 0 );
+	    }
+	    continue;
+	}
+	/* anything unexpected is left to be reported when it's applied */
+	if (( tac != 9 ) || ( *targv[ 0 ] != '+' ) || ( *tran == '\0' ) ||
+		(( *targv[ 1 ] != 'f' ) && ( *targv[ 1 ] != 'a' ))) {
+	    continue;
+	}
+	targv++;
+	tac--;
+
+	key = journal_key( tran, tline );
+	if ( journal_done( key )) {
+	    continue;
+	}
+	if ((( d_path = decode( targv[ 1 ] )) == NULL ) ||
+		( fetch_stagedir( d_path, dir, sizeof( dir )) != 0 ) ||
+		( snprintf( (char *) dest, sizeof( dest ),
+		"%s/.radmind.stage.%u", ( strcmp( dir, "/" ) == 0 ) ? "" : dir,
+		stage_seq++ ) >= sizeof( dest ))) {
+	    continue;
+	}
+
+	if (( rc = download( sn, tran, targv, key, (filepath_t *) d_path,
+		dest, temppath )) != 0 ) {
+	    break;
+	}
+	if ((( se = malloc( sizeof( stage_entry_t ))) == NULL ) ||
+		(( se->se_temppath = filepath_dup( temppath )) == NULL )) {
+	    perror( "malloc" );
+	    unlink( (char *) temppath );
+	    rc = 1;
+	    break;
+	}
+	se->se_key = key;
+	se->se_next = NULL;
+	*stage_tail = se;
+	stage_tail = &se->se_next;
+    }
+    acav_free( acav );
+
+    /* the transcript is read again from the top */
+    linenum = 0;
+    special = 0;
+    ahead_eof = 0;
+    *ahead_tran = '\0';
+    ahead_special = 0;
+
+    return( rc );
+}
+
+/* a copy of the transcript on f that can be read twice */
+    static FILE *
+stage_copy( FILE *f )
+{
+    FILE			*tmp;
+    char			buf[ 8192 ];
+    size_t			len;
+
+    if (( tmp = tmpfile( )) == NULL ) {
+	perror( "tmpfile" );
+	return( NULL );
+    }
+    while (( len = fread( buf, 1, sizeof( buf ), f )) > 0 ) {
+	if ( fwrite( buf, 1, len, tmp ) != len ) {
+	    perror( "tmpfile" );
+	    fclose( tmp );
+	    return( NULL );
+	}
+    }
+    if ( ferror( f ) || ( fflush( tmp ) != 0 ) ||
+	    ( fseeko( tmp, 0, SEEK_SET ) != 0 )) {
+	perror( "tmpfile" );
+	fclose( tmp );
+	return( NULL );
+    }
+    fclose( f );
+    return( tmp );
+}
+
+/*
+ * The staged download for the line known by key.  They're asked for in
+ * the order they were staged, unless a line was skipped.
+ *
+ * Return Value:
+ *	0 - OKAY, in temppath
+ *	2 - not staged
+ */
+    static int
+stage_take( unsigned long long key, filepath_t *temppath )
+{
+    stage_entry_t		**sep, *se;
+
+    for ( sep = &stage_head; *sep != NULL; sep = &(*sep)->se_next ) {
+	if ( (*sep)->se_key == key ) {
+	    break;
+	}
+    }
+    if (( se = *sep ) == NULL ) {
+	return( 2 );
+    }
+    if (( *sep = se->se_next ) == NULL ) {
+	stage_tail = sep;
+    }
+    filepath_cpy( temppath, se->se_temppath );
+    free( se->se_temppath );
+    free( se );
+    return( 0 );
+}
+
+/* remove whatever was staged and not applied */
+    static void
+stage_discard( void )
+{
+    stage_entry_t		*se;
+
+    while (( se = stage_head ) != NULL ) {
+	stage_head = se->se_next;
+	if ( unlink( (char *) se->se_temppath ) != 0 ) {
+	    perror( (char *) se->se_temppath );
+	}
+	free( se->se_temppath );
+	free( se );
+    }
+    stage_tail = &stage_head;
+}
+
     static int
 do_line( char *tline, const filepath_t *tran, int present, struct stat *st, SNET *sn )
 {
@@ -143,13 +798,16 @@ do_line( char *tline, const filepath_t *tran, int present, struct stat *st, SNET
     char        	        *command = "";
     const char                  *d_path;
     ACAV               		*acav;
-    int				tac;
+    int				tac, rc, tfd = -1;
     char 	               	**targv;
     struct applefileinfo        afinfo;
     filepath_t 	       		path[ 2 * MAXPATHLEN ];
     filepath_t			temppath[ 2 * MAXPATHLEN ];
-    filepath_t			pathdesc[ 2 * MAXPATHLEN ];
     char			cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    unsigned long long		key;
+
+    /* before the line is split up */
+    key = journal_key( tran, tline );
 
     acav = acav_alloc( );
 
@@ -175,86 +833,212 @@ do_line( char *tline, const filepath_t *tran, int present, struct stat *st, SNET
 	}
 	strcpy( cksum_b64, targv[ 7 ] );
 
-	if ( special ) {
-	  if ( snprintf( (char *) pathdesc, MAXPATHLEN * 2, "SPECIAL %s",
-		    targv[ 1 ]) >= ( MAXPATHLEN * 2 )) {
-		fprintf( stderr, "SPECIAL %s: too long\n", targv[ 1 ]);
-		return( 1 );
-	    }
-	} else {
-	  if ( snprintf( (char *) pathdesc, MAXPATHLEN * 2, "FILE %s %s",
-		    tran, targv[ 1 ]) >= ( MAXPATHLEN * 2 )) {
-		fprintf( stderr, "FILE %s %s: command too long\n",
-		    tran, targv[ 1 ]);
-		return( 1 );
-	    }
+	/* -S got it before anything was changed */
+	if (( rc = stage_take( key, temppath )) == 2 ) {
+	    rc = download( sn, tran, targv, key, path, path, temppath );
 	}
-	if ( *targv[ 0 ] == 'a' ) {
-	    switch ( retr_applefile( sn, pathdesc, path, temppath, 0600,
-		strtoofft( targv[ 6 ], NULL, 10 ), cksum_b64 )) {
-	    case -1:
-		/* Network problem */
-		network = 0;
-		return( 1 );
-	    case 1:
-		return( 1 );
-	    default:
-		break;
-	    }
-	} else {
-	    switch ( retr( sn, pathdesc, path, temppath, 0600,
-		strtoofft( targv[ 6 ], NULL, 10 ), cksum_b64 )) {
-	    case -1:
-		/* Network problem */
-		network = 0;
-		return( 1 );
-	    case 1:
+	switch ( rc ) {
+	case -1:
+	    return( 1 );
+	case 1:
+	    return( 1 );
+	default:
+	    break;
+	}
+	/* one lookup, then metadata is set through the fd */
+	if ( *targv[ 0 ] == 'f' ) {
+	    if (( tfd = open( (char *) temppath, O_RDONLY | O_NOFOLLOW,
+		    0 )) < 0 || fstat( tfd, st ) != 0 ) {
+		perror( (char *) temppath );
+		if ( tfd >= 0 ) {
+		    close( tfd );
+		}
 		return( 1 );
-	    default:
-		break;
 	    }
-	}
-	if ( radstat( temppath, st, &fstype, &afinfo ) < 0 ) {
+	} else if ( radstat( temppath, st, &fstype, &afinfo ) < 0 ) {
 	  perror( (char *) temppath );
 	    return( 1 );
 	}
 	/* Update temp file*/
-	switch( update( temppath, path, present, 1, st, tac, targv, &afinfo )) {
-	case 0:
+	rc = update( temppath, path, present, 1, st, tac, targv, &afinfo,
+		tfd );
+	if ( rc == 0 ) {
+	    if ( *targv[ 0 ] == 'f' ) {
+		cache_add( temppath, cksum_b64 );
+	    }
 	    /* rename doesn't mangle forked files */
-	  if ( rename( (char *) temppath, (char *) path ) != 0 ) {
-		perror( (char *) temppath );
-		return( 1 );
+	    if ( durable_rename( tfd, temppath, path ) != 0 ) {
+		rc = 1;
 	    }
-	    break;
-
-	case 2:
-	    break;
-
-	default:
+	}
+	if (( tfd >= 0 ) && ( close( tfd ) != 0 )) {
+	    perror( (char *) temppath );
+	    return( 1 );
+	}
+	if (( rc != 0 ) && ( rc != 2 )) {
 	    return( 1 );
 	}
 
     } else { 
 	/* UPDATE */
-	if ( present ) {
-	    if ( radstat( path, st, &fstype, &afinfo ) < 0 ) {
-	        perror( (char *) path );
-		return( 1 );
-	    }
+	if ( durable_before(( *targv[ 0 ] == 'h' ) ? NULL : path ) != 0 ) {
+	    return( 1 );
 	}
-	switch ( update( path, path, present, 0, st, tac, targv, &afinfo )) {
-        case 0:
-        case 2:	    /* door or socket, can't be created, but not an error */
-            break;
-        default:
+	if ( update_line( path, present, st, tac, targv ) == 1 ) {
 	    return( 1 );
 	}
     }
+    if ( durable_mark( key ) != 0 ) {
+	return( 1 );
+    }
     acav_free( acav ); 
     return( 0 );
 }
 
+/*
+ * Return Value:
+ *	0 - OKAY
+ *	1 - error
+ *	2 - door or socket, can't be created, but not an error
+ */
+    static int
+update_line( const filepath_t *path, int present, struct stat *st, int tac,
+	char **targv )
+{
+    char			fstype;
+    struct applefileinfo	afinfo;
+
+    if ( present ) {
+	if ( radstat( path, st, &fstype, &afinfo ) < 0 ) {
+	    perror( (char *) path );
+	    return( 1 );
+	}
+    }
+    switch ( update( path, path, present, 0, st, tac, targv, &afinfo,
+	    -1 )) {
+    case 0:
+	return( 0 );
+    case 2:
+	return( 2 );
+    default:
+	return( 1 );
+    }
+}
+
+/* a line without a download, in a worker */
+    static int
+local_apply( char *tline, int present )
+{
+    static ACAV			*acav = NULL;
+    char			**targv;
+    int				tac;
+    const char			*d_path;
+    filepath_t			path[ 2 * MAXPATHLEN ];
+    struct stat			st;
+
+    if (( acav == NULL ) && (( acav = acav_alloc( )) == NULL )) {
+	return( 1 );
+    }
+    tac = acav_parse( acav, tline, &targv );
+    if (( tac > 0 ) && ( *targv[ 0 ] == '-' )) {
+	targv++;
+	tac--;
+    }
+    if (( tac < 2 ) || (( d_path = decode( targv[ 1 ] )) == NULL )) {
+	fprintf( stderr, "line %d: too long\n", linenum );
+	return( 1 );
+    }
+    filepath_cpy( path, (filepath_t *) d_path );
+    return( update_line( path, present, &st, tac, targv ));
+}
+
+/*
+ * With workers, a line that needs nothing from the server is handed to
+ * one, once what it depends on is done.  Downloads are applied here.
+ */
+    static int
+apply_line( char *tline, const filepath_t *tran, int present,
+	struct stat *st, SNET *sn )
+{
+    static ACAV			*acav = NULL;
+    char			line[ 2 * MAXPATHLEN ];
+    char			**targv;
+    int				tac;
+    const char			*d_path;
+    filepath_t			path[ 2 * MAXPATHLEN ];
+    filepath_t			target[ 2 * MAXPATHLEN ];
+
+    if ( !local_running( )) {
+	return( do_line( tline, tran, present, st, sn ));
+    }
+
+    if (( acav == NULL ) && (( acav = acav_alloc( )) == NULL )) {
+	return( 1 );
+    }
+    strcpy( line, tline );
+    tac = acav_parse( acav, line, &targv );
+    if (( tac > 0 ) && (( *targv[ 0 ] == '+' ) || ( *targv[ 0 ] == '-' ))) {
+	targv++;
+	tac--;
+    }
+    if (( tac < 2 ) || (( d_path = decode( targv[ 1 ] )) == NULL )) {
+	fprintf( stderr, "line %d: too long\n", linenum );
+	return( 1 );
+    }
+    filepath_cpy( path, (filepath_t *) d_path );
+
+    if ( *line == '+' ) {
+	if ( local_before( path ) != 0 ) {
+	    return( 1 );
+	}
+	return( do_line( tline, tran, present, st, sn ));
+    }
+
+    *target = '\0';
+    if (( *targv[ 0 ] == 'h' ) && ( tac == 3 ) &&
+	    (( d_path = decode( targv[ 2 ] )) != NULL )) {
+	filepath_cpy( target, (filepath_t *) d_path );
+    }
+    if ( durable_before(( *targv[ 0 ] == 'h' ) ? NULL : path ) != 0 ) {
+	return( 1 );
+    }
+    /* what's made in a new directory waits for it */
+    if ( local_line( tline, path, ( *target != '\0' ) ? target : NULL,
+	    present, ( *targv[ 0 ] == 'd' ) && !present,
+	    journal_key( tran, tline )) != 0 ) {
+	return( 1 );
+    }
+    return( 0 );
+}
+
+/*
+ * Remove path, here or by a worker.  structural is set if something
+ * else is to be made in its place.
+ */
+    static int
+apply_remove( const filepath_t *path, int isdir, int structural )
+{
+    if ( durable_before( path ) != 0 ) {
+	return( -1 );
+    }
+    if ( local_running( )) {
+	return( local_remove( path, isdir, structural ));
+    }
+
+    update_forget( );
+    if ((( isdir ) ? rmdir( (char *) path ) : unlink( (char *) path )) != 0 ) {
+	perror( (char *) path );
+	return( -1 );
+    }
+    if ( !quiet && !showprogress ) {
+	printf( "%s: deleted\n", path );
+    }
+    if ( showprogress ) {
+	progressupdate( PROGRESSUNIT, path );
+    }
+    return( 0 );
+}
+
 
 extern char *optarg;
 extern int optind, opterr, optopt;
@@ -262,7 +1046,7 @@ extern int optind, opterr, optopt;
 /*
  * Command-line options
  *
- * Formerly getopt - "%c:Ce:Fh:iInp:P:qru:Vvw:x:y:z:Z:"
+ * Formerly getopt - "%Bc:Ce:Fh:iIj:J:k:nN:p:P:qrs:Su:VvW:w:x:y:z:Z:"
  *
  * Remaining opts: ""
  */
@@ -272,6 +1056,9 @@ static const usageopt_t main_usage[] =
     { (struct option) { "percentage",   no_argument,       NULL, '%' }, 
      		"Show percentage done progress", NULL }, 
 
+    { (struct option) { "bootstrap",    no_argument,       NULL, 'B' },
+              "The file system is empty: skip presence checks", NULL},
+
     { (struct option) { "create",    no_argument,       NULL, 'C' },
               "Create missing intermediate directories", NULL},
 
@@ -300,12 +1087,27 @@ static const usageopt_t main_usage[] =
     { (struct option) { "random-file",   no_argument,        NULL, 'r' },
 	      "use random seed file $RANDFILE if that environment variable is set, $HOME/.rnd otherwise.  See RAND_load_file(3o).", NULL},
 
+    { (struct option) { "sync",         required_argument, NULL, 's' },
+	      "Durability of installed files: none, file or batch, default none", "policy" },
+
+    { (struct option) { "stage",        no_argument,       NULL, 'S' },
+	      "Download everything before changing anything", NULL },
+
     { (struct option) { "force", no_argument, NULL, 'F' },
               "remove all user defined flags for a file if they exist", NULL },
 
     { (struct option) { "umask",        required_argument,  NULL, 'u' },
 	      "specifies the umask for temporary files, by default 0077", "number" },
 
+    { (struct option) { "jobs",         required_argument, NULL, 'j' },
+	      "Number of processes to remove and update files with, default 1", "number" },
+
+    { (struct option) { "journal",      required_argument, NULL, 'J' },
+	      "Record progress in a journal, and pick up from it after a failed run", "pathname" },
+
+    { (struct option) { "cache",        required_argument, NULL, 'k' },
+	      "Keep downloaded and removed files in a cache directory, and copy from it rather than download.  Requires -c", "pathname" },
+
     { (struct option) { "hostname",     required_argument, NULL, 'h' },
               "Radmind server hostname to contact, defaults to '" _RADMIND_HOST "'", "domain-name" },
 
@@ -318,6 +1120,12 @@ static const usageopt_t main_usage[] =
     { (struct option) { "authentication",  required_argument, NULL, 'w' },
 	      "Specify the authentication level, default " STRINGIFY(_RADMIND_AUTHLEVEL), "number" },
 
+    { (struct option) { "connections",   required_argument, NULL, 'N' },
+	      "Number of connections to download over, default 1", "number" },
+
+    { (struct option) { "retr-window",   required_argument, NULL, 'W' },
+	      "Number of downloads to request ahead, default " STRINGIFY(LAPPLY_RETR_WINDOW) ", 0 to request each as it's applied", "number" },
+
     { (struct option) { "ca-file",       required_argument, NULL, 'x' },
 	      "Specify the certificate authority file", "pem-file" },
 
@@ -375,10 +1183,8 @@ static const usageopt_t main_usage[] =
 main( int argc, char **argv )
 {
     int			c, err = 0;
-    unsigned short	port = 0;
     extern int          optind;
     FILE		*f = NULL; 
-    char		*host = _RADMIND_HOST;
     const char 		*d_path;
     char		tline[ 2 * MAXPATHLEN ];
     char		targvline[ 2 * MAXPATHLEN ];
@@ -395,7 +1201,6 @@ main( int argc, char **argv )
       			*ap_node;
     ACAV		*acav;
     SNET		*sn = NULL;
-    int			authlevel = _RADMIND_AUTHLEVEL;
     int			force = 0;
     int			use_randfile = 0;
     char	        **capa = NULL;		/* capabilities */
@@ -420,7 +1225,7 @@ main( int argc, char **argv )
 
 	case 'c':
             OpenSSL_add_all_digests();
-            md = EVP_get_digestbyname( optarg );
+            md = digest_byname( optarg );
             if ( !md ) {
                 fprintf( stderr, "%s: unsupported checksum\n", optarg );
                 exit( 2 );
@@ -428,6 +1233,10 @@ main( int argc, char **argv )
             cksum = 1;
             break;
 
+	case 'B':
+	    bootstrap = 1;
+	    break;
+
 	case 'C':
 	    create_prefix = 1;
 	    break;
@@ -444,6 +1253,21 @@ main( int argc, char **argv )
 	    host = optarg;
 	    break;
 
+	case 'k':
+	    cache_path = optarg;
+	    break;
+
+	case 'J':
+	    journal_path = optarg;
+	    break;
+
+	case 'j':
+	    if (( jobs = atoi( optarg )) < 1 ) {
+		fprintf( stderr, "%s: invalid number of jobs\n", optarg );
+		exit( 2 );
+	    }
+	    break;
+
 	case 'i':
 	    setvbuf( stdout, ( char * )NULL, _IOLBF, 0 );
 	    break;
@@ -456,6 +1280,14 @@ main( int argc, char **argv )
 	    network = 0;
 	    break;
 
+	case 'N':
+	    if (( connections = atoi( optarg )) < 1 ) {
+		fprintf( stderr, "%s: invalid number of connections\n",
+			optarg );
+		exit( 2 );
+	    }
+	    break;
+
 	case 'p':
 	    /* connect.c handles things if atoi returns 0 */
 	    port = htons( atoi( optarg ));
@@ -473,6 +1305,17 @@ main( int argc, char **argv )
 	    use_randfile = 1;
 	    break;
 
+	case 's':
+	    if ( durable_policy( optarg ) != 0 ) {
+		fprintf( stderr, "%s: invalid durability policy\n", optarg );
+		err++;
+	    }
+	    break;
+
+	case 'S':
+	    stage = 1;
+	    break;
+
         case 'u' :              /* umask */
             umask( (mode_t)strtol( optarg, (char **)NULL, 0 ));
             break;
@@ -482,6 +1325,13 @@ main( int argc, char **argv )
 	    printf( "%s\n", checksumlist );
 	    exit( 0 );
 
+	case 'W':
+	    if (( retr_window = atoi( optarg )) < 0 ) {
+		fprintf( stderr, "%s: invalid retrieve window\n", optarg );
+		exit( 2 );
+	    }
+	    break;
+
 	case 'H': /* --help */
 	    lapply_usage (stdout, 1);
 	    exit (0);
@@ -561,6 +1411,10 @@ main( int argc, char **argv )
     if ( quiet && ( verbose || showprogress )) {
 	err++;
     }
+    /* the cache is named by checksum */
+    if (( cache_path != NULL ) && !cksum ) {
+	err++;
+    }
     if ( verbose && showprogress ) {
 	err++;
     }
@@ -574,6 +1428,13 @@ main( int argc, char **argv )
 	authlevel = 0;
     }
 
+    if (( cache_path != NULL ) && ( cache_init( cache_path ) != 0 )) {
+	exit( 2 );
+    }
+    if (( journal_path != NULL ) && ( journal_open( journal_path ) != 0 )) {
+	exit( 2 );
+    }
+
     if ( authlevel != 0 ) {
         if ( tls_client_setup( use_randfile, authlevel, caFile, caDir, cert, 
                 privatekey ) != 0 ) {
@@ -583,40 +1444,66 @@ main( int argc, char **argv )
     }
 
     if ( network ) {
-	if (( sn = connectsn( host, port )) == NULL ) {
-	    exit( 2 );
-	}
-	if (( capa = get_capabilities( sn )) == NULL ) {
-		exit( 2 );
-	}
-
-	if ( authlevel != 0 ) {
-	    if ( tls_client_start( sn, host, authlevel ) != 0 ) {
-		/* error message printed in tls_cleint_starttls */
+	/* fetchers only download lines read ahead */
+	if (( connections > 1 ) && ( retr_window > 0 )) {
+	    if ( fetch_start( connections, lapply_connect ) != 0 ) {
 		exit( 2 );
 	    }
-        }
+	} else {
+	    connections = 1;
+	}
 
-#ifdef HAVE_ZLIB
-	/* Enable compression */
-	if ( zlib_level > 0 ) {
-	    if ( negotiate_compression( sn, capa ) != 0 ) {
-		    exit( 2 );
-	    }
+	if (( sn = lapply_connect( &capa )) == NULL ) {
+	    exit( 2 );
+	}
+	/* fetchers' downloads aren't journaled */
+	if (( journal_path != NULL ) && ( connections == 1 )) {
+	    retr_partial = 1;
 	}
-#endif /* HAVE_ZLIB */
 
 	/* Turn off reporting if server doesn't support it */
 	if ( check_capability( "REPO", capa ) == 0 ) {
 	    report = 0;
 	}
+	if ( cksum && check_capability( "DELTA", capa )) {
+	    delta = 1;
+	}
+	if ( check_capability( "RANGE", capa )) {
+	    range = 1;
+	    if ( connections > 1 ) {
+		fetch_segments( LAPPLY_SEGMENT_MIN );
+	    }
+	}
     } else {
 	if ( !quiet ) printf( "No network connection\n" );
     }
 
+    if ( stage && network ) {
+	/* a pipe is kept so that it can be read again */
+	if ( fseeko( f, 0, SEEK_CUR ) != 0 ) {
+	    if (( f = stage_copy( f )) == NULL ) {
+		goto error1;
+	    }
+	}
+	if ( stage_all( f, sn ) != 0 ) {
+	    goto error2;
+	}
+	if ( fseeko( f, 0, SEEK_SET ) != 0 ) {
+	    perror( "fseeko" );
+	    goto error2;
+	}
+	/* anything not staged is retrieved as its line is applied */
+	retr_window = 0;
+    }
+
+    /* after the fetchers, which mustn't hold the workers' pipes open */
+    if (( jobs > 1 ) && ( local_start( jobs, local_apply ) != 0 )) {
+	exit( 2 );
+    }
+
     acav = acav_alloc( );
 
-    while ( fgets( tline, MAXPATHLEN, f ) != NULL ) {
+    while ( ahead_fgets( tline, MAXPATHLEN, f, sn ) != NULL ) {
 	linenum++;
 
 	/* Check line length */
@@ -697,6 +1584,20 @@ main( int argc, char **argv )
 	}
 	filepath_cpy( prepath, path );
 
+	/*
+	 * Nothing is expected on an empty file system.  What is there
+	 * anyway makes making the line's object fail.  Directories are
+	 * still checked, as the root and mountpoints are there already.
+	 * A resumed run isn't empty, and checks as usual.
+	 */
+	if ( bootstrap && !journal_resuming( ) && ( *targv[ 0 ] != 'd' )) {
+	    if ( *command == '-' ) {
+		continue;
+	    }
+	    present = 0;
+	    goto apply;
+	}
+
 	/* Do type check on local file */
 	switch ( radstat( path, &st, &fstype, &afinfo )) {
 	case 0:
@@ -715,6 +1616,16 @@ main( int argc, char **argv )
 	    break;
 	}
 
+	/* skip what an earlier run did */
+	if ( journal_path != NULL ) {
+	    if (( *command == '-' ) ? !present :
+		    ( present && journal_done( journal_key( transcript, tline ))
+		    && journal_verified( path, &st, fstype, tac, targv ))) {
+		if ( verbose ) printf( "%s: already applied\n", path );
+		continue;
+	    }
+	}
+
 #ifdef UF_IMMUTABLE
 #define CHFLAGS	( UF_IMMUTABLE | UF_APPEND | SF_IMMUTABLE | SF_APPEND )
 
@@ -751,20 +1662,14 @@ dirchecklist:
 			ap_head = new_ap_node;
 		    } else {
 			/* remove ap_head */
-		        if ( rmdir( (char *) ap_head->path ) != 0 ) {
-			    perror( (char *) ap_head->path );
+			if ( apply_remove( ap_head->path, 1,
+				ap_head->doline ) != 0 ) {
 			    goto error2;
 			}
-			if ( !quiet && !showprogress ) {
-			    printf( "%s: deleted\n", ap_head->path );
-			}
-			if ( showprogress ) {
-			    progressupdate( PROGRESSUNIT, ap_head->path );
-			}
 			ap_node = ap_head;
 			ap_head = ap_node->next;
 			if ( ap_node->doline ) {
-			    if ( do_line( ap_node->tline, ap_node->tran, 0,
+			    if ( apply_line( ap_node->tline, ap_node->tran, 0,
 					&st, sn ) != 0 ) {
 				goto error2;
 			    }
@@ -775,46 +1680,29 @@ dirchecklist:
 		    }
 		}
 	    } else {
+		if ( fstype == 'f' ) {
+		    cache_removed( path );
+		}
 filechecklist:
 		if ( ap_head == NULL ) {
-		    if ( unlink( (char *) path ) != 0 ) {
-		        perror( (char *) path );
+		    if ( apply_remove( path, 0, *command != '-' ) != 0 ) {
 			goto error2;
 		    }
-		    if ( !quiet && !showprogress ) {
-			printf( "%s: deleted\n", path );
-		    }
-		    if ( showprogress ) {
-			progressupdate( PROGRESSUNIT, path );
-		    }
 		} else {
 		    if ( ischildcase( path, ap_head->path, case_sensitive )) {
-		        if ( unlink( (char *) path ) != 0 ) {
-			    perror( (char *) path );
+			if ( apply_remove( path, 0, *command != '-' ) != 0 ) {
 			    goto error2;
 			}
-			if ( !quiet && !showprogress ) {
-			    printf( "%s: deleted\n", path );
-			}
-			if ( showprogress ) {
-			    progressupdate( PROGRESSUNIT, path );
-			}
 		    } else {
 			/* remove ap_head */
-		        if ( rmdir( (char *) ap_head->path ) != 0 ) {
-			    perror( (char *) ap_head->path );
+			if ( apply_remove( ap_head->path, 1,
+				ap_head->doline ) != 0 ) {
 			    goto error2;
 			}
-			if ( !quiet && !showprogress ) {
-			    printf( "%s: deleted\n", ap_head->path );
-			}
-			if ( showprogress ) {
-			    progressupdate( PROGRESSUNIT, ap_head->path );
-			}
 			ap_node = ap_head;
 			ap_head = ap_node->next;
 			if ( ap_node->doline ) {
-			    if ( do_line( ap_node->tline, ap_node->tran, 0,
+			    if ( apply_line( ap_node->tline, ap_node->tran, 0,
 					&st, sn ) != 0 ) {
 				goto error2;
 			    }
@@ -836,20 +1724,14 @@ filechecklist:
 	while ( ap_head != NULL && !ischildcase( path, ap_head->path,
 		case_sensitive )) {
 	    /* remove ap_head */
-	    if ( rmdir( (char *) ap_head->path ) != 0 ) {
-	        perror( (char *) ap_head->path );
+	    if ( apply_remove( ap_head->path, 1, ap_head->doline ) != 0 ) {
 		goto error2;
 	    }
-	    if ( !quiet && !showprogress ){
-		printf( "%s: deleted\n", ap_head->path );
-	    }
-	    if ( showprogress ) {
-		progressupdate( PROGRESSUNIT, ap_head->path );
-	    }
 	    ap_node = ap_head;
 	    ap_head = ap_node->next;
 	    if ( ap_node->doline ) {
-		if ( do_line( ap_node->tline, ap_node->tran, 0, &st, sn ) != 0 ) {
+		if ( apply_line( ap_node->tline, ap_node->tran, 0, &st,
+			sn ) != 0 ) {
 		    goto error2;
 		}
 		change = 1;
@@ -857,7 +1739,8 @@ filechecklist:
 	    apply_node_free( ap_node );
 	}
 
-	if ( do_line( tline, transcript, present, &st, sn ) != 0 ) {
+apply:
+	if ( apply_line( tline, transcript, present, &st, sn ) != 0 ) {
 	    goto error2;
 	}
 	change = 1;
@@ -866,18 +1749,13 @@ filechecklist:
     /* Clear out remove list */ 
     while ( ap_head != NULL ) {
 	/* remove ap_head */
-        if ( rmdir( (char *) ap_head->path ) != 0 ) {
-	    perror( (char *) ap_head->path );
+	if ( apply_remove( ap_head->path, 1, ap_head->doline ) != 0 ) {
 	    goto error2;
 	}
-	if ( !quiet && !showprogress ) printf( "%s: deleted\n", ap_head->path );
-	if ( showprogress ) {
-	    progressupdate( PROGRESSUNIT, ap_head->path );
-	}
 	ap_node = ap_head;
 	ap_head = ap_node->next;
 	if ( ap_node->doline ) {
-	    if ( do_line( ap_node->tline, ap_node->tran, 0, &st, sn ) != 0 ) {
+	    if ( apply_line( ap_node->tline, ap_node->tran, 0, &st, sn ) != 0 ) {
 		goto error2;
 	    }
 	    change = 1;
@@ -885,13 +1763,32 @@ filechecklist:
 	apply_node_free( ap_node );
     }
     acav_free( acav ); 
+    if ( local_wait( ) != 0 ) {
+	goto error2;
+    }
+    local_stop( );
+    if ( durable_close( ) != 0 ) {
+	goto error2;
+    }
     
     if ( fclose( f ) != 0 ) {
 	perror( argv[ optind ] );
 	goto error1;
     }
 
+    /* staged for lines an earlier run had applied */
+    stage_discard( );
+    cache_prune( );
+    /* without the network, downloads are still to do */
+    journal_close( network );
+
     if ( network ) {
+	/* normally nothing is left, every line has been applied */
+	fetch_stop( );
+	if ( retr_ahead_drain( sn ) != 0 ) {
+	    fprintf( stderr, "warning: could not close connection\n" );
+	    exit( 0 );
+	}
 	if ( report ) {
 	    if ( report_event( sn, event,
 		    "Changes applied successfully" ) != 0 ) {
@@ -912,6 +1809,16 @@ filechecklist:
 error2:
     fclose( f );
 error1:
+    local_stop( );
+    /* what's been applied is kept */
+    durable_close( );
+    fetch_stop( );
+    stage_discard( );
+    cache_prune( );
+    journal_close( 0 );
+    if ( network && ( retr_ahead_drain( sn ) != 0 )) {
+	network = 0;
+    }
     if ( network ) {
 #ifdef HAVE_ZLIB
 	if( verbose && zlib_level < 0 ) print_stats(sn);
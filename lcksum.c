@@ -18,16 +18,23 @@
 
 #include <openssl/evp.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
 #include "applefile.h"
 #include "base64.h"
 #include "argcargv.h"
 #include "cksum.h"
+#include "digest.h"
 #include "code.h"
 #include "pathcmp.h"
 #include "largefile.h"
 #include "progress.h"
 #include "root.h"
+#include "tfile.h"
 #include "usageopt.h"
+#include "verified.h"
 
 int	cksum = 0;
 int	verbose = 1;
@@ -37,6 +44,7 @@ int	case_sensitive = 1;
 int	checkall = 0;
 int	checkapplefile = 0;
 int	updatetran = 1;
+int	recheck = 0;
 char	*prefix = NULL;
 char	*progname = "lcksum";
 filepath_t	*radmind_path = (filepath_t *) _RADMIND_PATH;
@@ -47,6 +55,9 @@ filepath_t       prepath[ MAXPATHLEN ] = {0};
 
 
 static void cleanup( int clean, const char *path);
+#ifdef HAVE_ZLIB
+static int gzip_file( const char *src, const char *dst, mode_t mode );
+#endif /* HAVE_ZLIB */
 static int do_lcksum( const filepath_t *tpath);
 static off_t check_applefile( const filepath_t *applefile, int afd );
 
@@ -145,6 +156,63 @@ cleanup( int clean, const char *path )
     }
 }
 
+#ifdef HAVE_ZLIB
+/*
+ * Compress src into a new file dst, so that a rewritten gzip transcript
+ * is still a gzip transcript.
+ *
+ * Return Value:
+ *	-1 - error, dst removed
+ *	 0 - OKAY
+ */
+    static int
+gzip_file( const char *src, const char *dst, mode_t mode )
+{
+    char		buf[ 8192 ];
+    ssize_t		rr;
+    int			sfd, dfd;
+    gzFile		gz;
+
+    if (( sfd = open( src, O_RDONLY, 0 )) < 0 ) {
+	perror( src );
+	return( -1 );
+    }
+    if (( dfd = open( dst, O_WRONLY | O_CREAT | O_EXCL, mode )) < 0 ) {
+	perror( dst );
+	close( sfd );
+	return( -1 );
+    }
+    if (( gz = gzdopen( dfd, "w" )) == NULL ) {
+	fprintf( stderr, "%s: gzdopen failed\n", dst );
+	close( dfd );
+	goto error;
+    }
+    while (( rr = read( sfd, buf, sizeof( buf ))) > 0 ) {
+	if ( gzwrite( gz, buf, (unsigned)rr ) != rr ) {
+	    fprintf( stderr, "%s: gzwrite failed\n", dst );
+	    gzclose( gz );
+	    goto error;
+	}
+    }
+    if ( rr < 0 ) {
+	perror( src );
+	gzclose( gz );
+	goto error;
+    }
+    if ( gzclose( gz ) != Z_OK ) {
+	fprintf( stderr, "%s: gzclose failed\n", dst );
+	goto error;
+    }
+    close( sfd );
+    return( 0 );
+
+error:
+    close( sfd );
+    unlink( dst );
+    return( -1 );
+}
+#endif /* HAVE_ZLIB */
+
     static int
 do_lcksum(const filepath_t *tpath )
 {
@@ -167,8 +235,10 @@ do_lcksum(const filepath_t *tpath )
     filepath_t		path[ 2 * MAXPATHLEN ];
     char		upath[ 2 * MAXPATHLEN ] = { 0 };
     char		lcksum[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
-    FILE		*f, *ufs = NULL;
+    FILE		*ufs = NULL;
+    tfile_t		*f;
     struct stat		st;
+    mode_t		tmode = 0;
     off_t		cksumsize;
 
     if ( getcwd( (char *) cwd, sizeof(cwd)-1 ) == NULL ) {
@@ -209,7 +279,7 @@ do_lcksum(const filepath_t *tpath )
 	exit( 2 );
     }
 
-    if (( f = fopen( (char *) tpath, "r" )) == NULL ) {
+    if (( f = tfile_open( (char *) tpath )) == NULL ) {
 	perror( (char *) tpath );
 	exit( 2 );
     }
@@ -226,9 +296,11 @@ do_lcksum(const filepath_t *tpath )
 	    exit( 2 );
 	}
 
+	tmode = st.st_mode;
+
 	/* Open file */
 	if (( ufd = open( upath, O_WRONLY | O_CREAT | O_EXCL,
-		st.st_mode )) < 0 ) {
+		tmode )) < 0 ) {
 	    perror( upath );
 	    exit( 2 );
 	}
@@ -250,7 +322,7 @@ do_lcksum(const filepath_t *tpath )
 
     memset( prepath, 0, sizeof( prepath ));
 
-    while ( fgets( tline, MAXPATHLEN, f ) != NULL ) {
+    while ( tfile_gets( tline, MAXPATHLEN, f ) != NULL ) {
 	linenum++;
 	updateline = 0;
 
@@ -382,7 +454,11 @@ do_lcksum(const filepath_t *tpath )
 	    goto badline;
 	}
 
-	if (( cksumsize = do_fcksum( fd, lcksum )) < 0 ) {
+	if ( !recheck && verified_check( fd, targv[ 7 ] )) {
+	    /* checked as it was stored, and unchanged since */
+	    strcpy( lcksum, targv[ 7 ] );
+	    cksumsize = st.st_size;
+	} else if (( cksumsize = do_fcksum( fd, lcksum )) < 0 ) {
 	    fprintf( stderr, "line %d: %s: %s\n", linenum,
 			path, strerror( errno ));
 	    goto badline;
@@ -465,6 +541,13 @@ done:
 	}
 	free( line );
     }
+    if ( tfile_error( f )) {
+	/* never put a transcript cut short in place of the whole one */
+	fprintf( stderr, "%s: read error, transcript corrupt or truncated\n",
+		tpath );
+	cleanup( updatetran, upath );
+	exit( 2 );
+    }
     if ( showprogress ) {
         progressupdate( bytes, (filepath_t *) "" );
     }
@@ -475,6 +558,26 @@ done:
 
     if ( updatetran ) {
 	if ( ucount ) {
+	    if ( fclose( ufs ) != 0 ) {
+		perror( upath );
+		cleanup( updatetran, upath );
+		exit( 2 );
+	    }
+#ifdef HAVE_ZLIB
+	    /* compress the new transcript rather than leave plain text */
+	    if ( tfile_compressed( f )) {
+		char	zpath[ 2 * MAXPATHLEN + 4 ];
+
+		snprintf( zpath, sizeof( zpath ), "%s%s", upath,
+			TFILE_GZIP_SUFFIX );
+		if ( gzip_file( upath, zpath, tmode ) != 0 ) {
+		    cleanup( updatetran, upath );
+		    exit( 2 );
+		}
+		cleanup( updatetran, upath );
+		strcpy( upath, zpath );
+	    }
+#endif /* HAVE_ZLIB */
 	    if ( rename( upath, (char *) tpath ) != 0 ) {
 		fprintf( stderr, "rename %s to %s failed: %s\n", upath, tpath,
 		    strerror( errno ));
@@ -520,7 +623,7 @@ extern int optind, opterr, optopt;
 /*
  * Command-line options
  *
- * Formerly getopt - "%Aac:D:iInP:qV"
+ * Formerly getopt - "%Aac:D:iInP:qRV"
  * Remaining ""
  */
 
@@ -551,6 +654,9 @@ static const usageopt_t main_usage[] =
     { (struct option) { "nochange", no_argument, NULL, 'n' },
 	      "verify but do not modify transcript", NULL},
 
+    { (struct option) { "recheck", no_argument, NULL, 'R' },
+	      "checksum files the server verified as they were stored", NULL},
+
     { (struct option) { "debug", no_argument, NULL, 'd' },
       		"Raise debugging level to see what's happening", NULL},
 
@@ -603,7 +709,7 @@ main( int argc, char **argv )
 
 	case 'c':
 	    OpenSSL_add_all_digests();
-	    md = EVP_get_digestbyname( optarg );
+	    md = digest_byname( optarg );
 	    if ( !md ) {
 		
 	        usageopt_usage (stderr, 0 /* not verbose */, progname,  main_usage,
@@ -640,6 +746,10 @@ main( int argc, char **argv )
 	    verbose = 0;
 	    break;
 
+	case 'R':
+	    recheck = 1;
+	    break;
+
 	case 'v':
 	    verbose++ ;
 	    break;
@@ -703,5 +813,9 @@ main( int argc, char **argv )
 	}
     }
 
+    if ( debug > 0 ) {
+	cksum_stats_print( stdout );
+    }
+
     exit( err );
 }
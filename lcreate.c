@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -35,6 +36,7 @@
 #include "radstat.h"
 #include "base64.h"
 #include "cksum.h"
+#include "digest.h"
 #include "connect.h"
 #include "argcargv.h"
 #include "code.h"
@@ -51,6 +53,23 @@
  * C: <size bytes of file data>
  * C: ".\r\n"
  * S: 250 File stored "\r\n"
+ *
+ * HAVE, before any files are sent, when the server offers it
+ * C: HAVE FILE <transcript> <path> <size> <checksum> "\r\n"
+ * S: 250 File stored "\r\n"
+ *    or 451 File not held "\r\n", and the file is sent with STOR
+ *
+ * With -c, to a server that offers VERIFY, the checksum is sent too
+ * C: STOR FILE <transcript> <path> <checksum> "\r\n"
+ * and the server refuses a file that doesn't match it
+ *
+ * JOIN, on each connection when files are sent over more than one
+ * C: JOIN <transcript> "\r\n"
+ * S: 250 Upload begun <nonce> "\r\n"
+ * on the first, and on the others
+ * C: JOIN <transcript> <nonce> "\r\n"
+ * S: 250 Upload joined "\r\n"
+ * and STOR TRANSCRIPT is sent last, once every file has been stored
  */
 
 int		verbose = 0;
@@ -71,10 +90,34 @@ SSL_CTX  	*ctx;
 extern char *optarg;
 extern int optind, opterr, optopt;
 
+/* HAVE requests outstanding at once */
+#define LCREATE_HAVE_WINDOW	64
+
+static char		*have_held = NULL;
+static int		have_lines = 0;
+
+static int		have_files( SNET *sn, FILE *tran, const char *tname );
+
+/* files are stored over this many connections, one process each */
+static int		connections = 1;
+static int		worker = 0;
+static char		upload_nonce[ MAXPATHLEN ];
+static off_t		*upload_load = NULL;
+static pid_t		*upload_pids = NULL;
+static int		upload_running = 0;
+
+static SNET		*upload_connect( char *host, unsigned short port,
+			    int authlevel, char ***capap, char *user,
+			    char *password );
+static int		upload_join( SNET *sn, const char *tname );
+static int		upload_mine( off_t size );
+static int		upload_reap( int block );
+static void		upload_stop( void );
+
 /*
  * Command-line options
  *
- * Formerly getopt - "%c:Fh:ilnNp:P:qrt:TU:vVw:x:y:z:Z:"
+ * Formerly getopt - "%c:Fh:ij:lnNp:P:qrt:TU:vVw:x:y:z:Z:"
  *
  * Remaining "FlnNqrt:TU:vVw:x:y:z:Z:"
  */
@@ -114,6 +157,9 @@ static const usageopt_t main_usage[] =
 	      "Not available", "(number)"},
 #endif /* defined(HAVE_ZLIB) */
 
+    { (struct option) { "connections",   required_argument, NULL, 'j' },
+	      "Store files over this many connections, by default 1", "number" },
+
     { (struct option) { "ignore-file-size", no_argument, NULL, 'F' },
 	      "Ignore file size differences", NULL},
 
@@ -169,6 +215,274 @@ static const usageopt_t main_usage[] =
     { (struct option) {(char *) NULL, 0, (int *) NULL, 0}, (char *) NULL, (char *) NULL}
   }; /* end of main_usage[] */
 
+/*
+ * Ask the server to store each file it already has a copy of, before any
+ * are sent.  Lines it has stored are marked in have_held by line number.
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY
+ */
+    static int
+have_files( SNET *sn, FILE *tran, const char *tname )
+{
+    char		tline[ 2 * MAXPATHLEN ];
+    char		**targv;
+    char		*line, *held;
+    int			queue[ LCREATE_HAVE_WINDOW ];
+    int			tac, lnum = 0, sent = 0, answered = 0, eof = 0;
+    struct timeval	tv;
+
+    for ( ;; ) {
+	/* answers are read as the window fills, and at the end */
+	while (( sent - answered == LCREATE_HAVE_WINDOW ) ||
+		( eof && ( sent > answered ))) {
+	    tv = timeout;
+	    if (( line = snet_getline_multi( sn, logger, &tv )) == NULL ) {
+		fprintf( stderr, "HAVE failed: %s\n", strerror( errno ));
+		return( -1 );
+	    }
+	    switch ( *line ) {
+	    case '2':
+		have_held[ queue[ answered % LCREATE_HAVE_WINDOW ]] = 1;
+		break;
+
+	    case '4':
+		break;
+
+	    default:
+		fprintf( stderr, "%s\n", line );
+		return( -1 );
+	    }
+	    answered++;
+	}
+	if ( eof ) {
+	    break;
+	}
+
+	if ( fgets( tline, MAXPATHLEN, tran ) == NULL ) {
+	    eof = 1;
+	    continue;
+	}
+	lnum++;
+	if ( lnum >= have_lines ) {
+	    if (( held = realloc( have_held, have_lines + 4096 )) == NULL ) {
+		perror( "realloc" );
+		return( -1 );
+	    }
+	    memset( held + have_lines, 0, 4096 );
+	    have_held = held;
+	    have_lines += 4096;
+	}
+
+	tac = argcargv( tline, &targv );
+	if (( tac != 8 ) || ( *targv[ 0 ] != 'f' ) ||
+		( strcmp( targv[ 7 ], "-" ) == 0 ) ||
+		( strtoofft( targv[ 6 ], NULL, 10 ) <= 0 )) {
+	    continue;
+	}
+	if ( snet_writef( sn, "HAVE FILE %s %s %s %s\r\n", tname, targv[ 1 ],
+		targv[ 6 ], targv[ 7 ] ) < 0 ) {
+	    fprintf( stderr, "HAVE failed: %s\n", strerror( errno ));
+	    return( -1 );
+	}
+	if ( verbose ) printf( ">>> HAVE FILE %s %s %s %s\n", tname,
+		targv[ 1 ], targv[ 6 ], targv[ 7 ] );
+	queue[ sent % LCREATE_HAVE_WINDOW ] = lnum;
+	sent++;
+    }
+
+    rewind( tran );
+    return( 0 );
+}
+
+/*
+ * Connect to the server, start TLS and compression, and log in if user
+ * is given.  Errors are fatal.
+ */
+    static SNET *
+upload_connect( char *host, unsigned short port, int authlevel,
+	char ***capap, char *user, char *password )
+{
+    SNET		*sn;
+    char		*line;
+    struct timeval	tv;
+
+    if (( sn = connectsn( host, port )) == NULL ) {
+	exit( 2 );
+    }
+    if (( *capap = get_capabilities( sn )) == NULL ) { 
+	exit( 2 );
+    }           
+
+    if ( authlevel != 0 ) {
+	if ( tls_client_start( sn, host, authlevel ) != 0 ) {
+	    /* error message printed in tls_cleint_starttls */
+	    exit( 2 );
+	}
+    }
+
+#ifdef HAVE_ZLIB
+    /* Enable compression */
+    if ( zlib_level > 0 ) {
+	if ( negotiate_compression( sn, *capap ) != 0 ) {
+	    exit( 2 );
+	}
+    }
+#endif /* HAVE_ZLIB */
+
+    if ( user == NULL ) {
+	return( sn );
+    }
+
+    if ( verbose ) printf( ">>> LOGIN %s\n", user );
+    if ( snet_writef( sn, "LOGIN %s %s\n", user, password ) < 0 ) {
+	fprintf( stderr, "login %s failed: 1-%s\n", user, 
+	    strerror( errno ));
+	exit( 2 );                       
+    }                            
+
+    tv = timeout;
+    if (( line = snet_getline_multi( sn, logger, &tv )) == NULL ) {
+	fprintf( stderr, "login %s failed: 2-%s\n", user,
+	    strerror( errno ));
+	exit( 2 );
+    }
+    if ( *line != '2' ) {
+	fprintf( stderr, "%s\n", line );
+	exit( 1 );
+    }
+    return( sn );
+}
+
+/*
+ * Begin the upload of tname, whose transcript is then stored after its
+ * files, or join it with the nonce the server gave when it was begun.
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY
+ */
+    static int
+upload_join( SNET *sn, const char *tname )
+{
+    char		*line, **av;
+    struct timeval	tv;
+    int			ac;
+
+    if ( *upload_nonce == '\0' ) {
+	if ( verbose ) printf( ">>> JOIN %s\n", tname );
+	if ( snet_writef( sn, "JOIN %s\r\n", tname ) < 0 ) {
+	    fprintf( stderr, "JOIN failed: %s\n", strerror( errno ));
+	    return( -1 );
+	}
+    } else {
+	if ( verbose ) printf( ">>> JOIN %s %s\n", tname, upload_nonce );
+	if ( snet_writef( sn, "JOIN %s %s\r\n", tname, upload_nonce ) < 0 ) {
+	    fprintf( stderr, "JOIN failed: %s\n", strerror( errno ));
+	    return( -1 );
+	}
+    }
+    tv = timeout;
+    if (( line = snet_getline_multi( sn, logger, &tv )) == NULL ) {
+	fprintf( stderr, "JOIN failed: %s\n", strerror( errno ));
+	return( -1 );
+    }
+    if ( *line != '2' ) {
+	fprintf( stderr, "%s\n", line );
+	return( -1 );
+    }
+    if ( *upload_nonce == '\0' ) {
+	/* "250 Upload begun <nonce>" */
+	if ((( ac = argcargv( line, &av )) != 4 ) ||
+		( strlen( av[ 3 ] ) >= sizeof( upload_nonce ))) {
+	    fprintf( stderr, "JOIN failed: no nonce\n" );
+	    return( -1 );
+	}
+	strcpy( upload_nonce, av[ 3 ] );
+    }
+    return( 0 );
+}
+
+/*
+ * Every process reads the whole transcript and gives each file to the
+ * connection with the fewest bytes to send so far.  They all see the
+ * same sizes, so they agree on who sends what without talking.
+ *
+ * Return Value:
+ *	0 - another connection sends it
+ *	1 - this one does
+ */
+    static int
+upload_mine( off_t size )
+{
+    int			i, least = 0;
+
+    for ( i = 1; i < connections; i++ ) {
+	if ( upload_load[ i ] < upload_load[ least ] ) {
+	    least = i;
+	}
+    }
+    /* empty files count for something */
+    upload_load[ least ] += size + 1;
+    return( least == worker );
+}
+
+/*
+ * Collect the processes sending files that have exited, and wait for
+ * the rest if block is set.
+ *
+ * Return Value:
+ *	-1 - one failed
+ *	 0 - OKAY so far
+ */
+    static int
+upload_reap( int block )
+{
+    pid_t		pid;
+    int			i, status;
+
+    while ( upload_running > 0 ) {
+	if (( pid = waitpid( -1, &status, block ? 0 : WNOHANG )) == 0 ) {
+	    break;
+	}
+	if ( pid < 0 ) {
+	    if ( errno == EINTR ) {
+		continue;
+	    }
+	    perror( "waitpid" );
+	    upload_running = 0;
+	    return( -1 );
+	}
+	for ( i = 1; i < connections; i++ ) {
+	    if ( upload_pids[ i ] == pid ) {
+		upload_pids[ i ] = 0;
+		upload_running--;
+	    }
+	}
+	if ( !WIFEXITED( status ) || ( WEXITSTATUS( status ) != 0 )) {
+	    /* it has said why */
+	    return( -1 );
+	}
+    }
+    return( 0 );
+}
+
+/* the upload won't be finished, so don't wait for the others */
+    static void
+upload_stop( void )
+{
+    int			i;
+
+    for ( i = 1; i < connections; i++ ) {
+	if ( upload_pids[ i ] > 0 ) {
+	    kill( upload_pids[ i ], SIGTERM );
+	}
+    }
+    while (( upload_running > 0 ) && ( upload_reap( 1 ) != 0 ))
+	;
+}
+
 /* Main */
 
 extern char             *caFile, *caDir, *cert, *privatekey;
@@ -184,6 +498,9 @@ main( int argc, char **argv )
       			rc,
       			negative = 0,
       			tran_only = 0,
+      			have = 0,
+      			verify = 0,
+      			fd,
       			respcount = 0;
     unsigned short	port = 0;
     extern int		optind;
@@ -200,7 +517,7 @@ main( int argc, char **argv )
     extern char		*optarg;
     struct timeval	tv;
     FILE		*tran = NULL;
-    struct stat		st;
+    struct stat		st, st_tran;
     struct applefileinfo	afinfo;
     int                 authlevel = _RADMIND_AUTHLEVEL;
     int                 use_randfile = 0;
@@ -228,7 +545,7 @@ main( int argc, char **argv )
 
         case 'c':
             OpenSSL_add_all_digests();
-            md = EVP_get_digestbyname( optarg );
+            md = digest_byname( optarg );
             if ( !md ) {
 	        usageopt_usage (stderr, 0 /* not verbose */, progname,  main_usage,
 				"<transcript>", 80);
@@ -251,6 +568,14 @@ main( int argc, char **argv )
 	    setvbuf( stdout, ( char * )NULL, _IOLBF, 0 );
 	    break;
 
+	case 'j':
+	    if (( connections = atoi( optarg )) < 1 ) {
+		fprintf( stderr, "%s: invalid number of connections\n",
+			optarg );
+		exit( 2 );
+	    }
+	    break;
+
         case 'l':
             login = 1;
             break;
@@ -446,32 +771,7 @@ main( int argc, char **argv )
 	    }
 	}
 
-	if (( sn = connectsn( host, port )) == NULL ) {
-	    exit( 2 );
-	}
-	if (( capa = get_capabilities( sn )) == NULL ) { 
-		exit( 2 );
-	}           
-
-        if ( authlevel != 0 ) {
-            if ( tls_client_start( sn, host, authlevel ) != 0 ) {
-                /* error message printed in tls_cleint_starttls */
-                exit( 2 );
-            }
-        }
-
-#ifdef HAVE_ZLIB
-	/* Enable compression */
-	if ( zlib_level > 0 ) {
-	    if ( negotiate_compression( sn, capa ) != 0 ) {
-		    exit( 2 );
-	    }
-	}
-#endif /* HAVE_ZLIB */
-		
         if ( login ) {
-	    char		*line;
-
 	    if ( authlevel < 1 ) {
 		fprintf( stderr, "login requires TLS\n" );
 		exit( 2 );
@@ -494,29 +794,28 @@ main( int argc, char **argv )
 		fprintf( stderr, "Invalid null password\n" );
 		exit( 2 );
 	    }
+        }
 
-            if ( verbose ) printf( ">>> LOGIN %s\n", user );
-            if ( snet_writef( sn, "LOGIN %s %s\n", user, password ) < 0 ) {
-                fprintf( stderr, "login %s failed: 1-%s\n", user, 
-                    strerror( errno ));
-                exit( 2 );                       
-            }                            
+	sn = upload_connect( host, port, authlevel, &capa,
+		login ? user : NULL, password );
 
-	    /* clear the password from memory */
-	    memset( password, 0, len );
+	/* the server can only match or check files by checksums like ours */
+	if ( cksum && !negative && !tran_only &&
+		( check_capability( "HAVE", capa ) ||
+		check_capability( "VERIFY", capa ))) {
+	    switch ( negotiate_cksum( sn, capa, digest_name( md ))) {
+	    case 0:
+		have = check_capability( "HAVE", capa );
+		verify = check_capability( "VERIFY", capa );
+		break;
 
-	    tv = timeout;
-	    if (( line = snet_getline_multi( sn, logger, &tv )) == NULL ) {
-		fprintf( stderr, "login %s failed: 2-%s\n", user,
-		    strerror( errno ));
+	    case 1:
+		break;
+
+	    default:
 		exit( 2 );
 	    }
-	    if ( *line != '2' ) {
-		fprintf( stderr, "%s\n", line );
-		return( 1 );
-	    }
-
-        }
+	}
 
 	if ( cksum ) {
 	  if ( do_cksum( (filepath_t *) argv[ optind ], cksumval ) < 0 ) {
@@ -532,7 +831,7 @@ main( int argc, char **argv )
 	}
 
 	/* Get transcript size */
-	if ( stat( argv[ optind ], &st ) != 0 ) {
+	if ( stat( argv[ optind ], &st_tran ) != 0 ) {
 	    perror( argv[ optind ] );
 	    exit( 2 );
 	}
@@ -540,17 +839,105 @@ main( int argc, char **argv )
 	if ( ! tran_only ) {
 	    lsize = loadsetsize( tran );
 	}
-	lsize += st.st_size;
+	lsize += st_tran.st_size;
 
-	respcount += 2;
-	if (( rc = stor_file( sn, pathdesc, (filepath_t *) argv[ optind ], st.st_size,
-		cksumval )) <  0 ) {
-	    goto stor_failed;
+	if (( connections > 1 ) && ( tran_only ||
+		!check_capability( "JOIN", capa ))) {
+	    if ( !tran_only && !quiet ) {
+		fprintf( stderr, "warning: %s: server stores files over "
+			"one connection only\n", host );
+	    }
+	    connections = 1;
+	}
+
+	if ( connections > 1 ) {
+	    /* the transcript is stored last, once every file is */
+	    if ( upload_join( sn, tname ) != 0 ) {
+		exit( 2 );
+	    }
+	} else {
+	    respcount += 2;
+	    if (( rc = stor_file( sn, pathdesc, (filepath_t *) argv[ optind ],
+		    st_tran.st_size, cksumval )) <  0 ) {
+		goto stor_failed;
+	    }
 	}
 
 	if ( tran_only ) {	/* don't upload files */
 	    goto done;
 	}
+
+	if ( have ) {
+	    /* files are only stored once the transcript is */
+	    while ( respcount > 0 ) {
+		if ( stor_response( sn, &respcount, NULL ) < 0 ) {
+		    exit( 2 );
+		}
+	    }
+	    if ( have_files( sn, tran, tname ) != 0 ) {
+		exit( 2 );
+	    }
+	}
+
+	if ( connections > 1 ) {
+	    if ((( upload_load = calloc( connections, sizeof( off_t )))
+		    == NULL ) ||
+		    (( upload_pids = calloc( connections, sizeof( pid_t )))
+		    == NULL )) {
+		perror( "calloc" );
+		exit( 2 );
+	    }
+	    fflush( stdout );
+	    for ( c = 1; c < connections; c++ ) {
+		switch ( upload_pids[ c ] = fork( )) {
+		case -1:
+		    perror( "fork" );
+		    upload_stop( );
+		    exit( 2 );
+
+		case 0:
+		    /* leave the first connection to the parent */
+		    close( snet_fd( sn ));
+		    worker = c;
+
+		    /*
+		     * tran was just rewound, so it can be given a file
+		     * offset of its own, not the one shared with the parent.
+		     */
+		    if ((( fd = open( argv[ optind ], O_RDONLY, 0 )) < 0 ) ||
+			    ( dup2( fd, fileno( tran )) < 0 )) {
+			perror( argv[ optind ] );
+			exit( 2 );
+		    }
+		    close( fd );
+		    upload_running = 0;
+		    sn = upload_connect( host, port, authlevel, &capa,
+			    login ? user : NULL, password );
+		    if ( verify && ( negotiate_cksum( sn, capa,
+			    digest_name( md )) != 0 )) {
+			exit( 2 );
+		    }
+		    if ( upload_join( sn, tname ) != 0 ) {
+			exit( 2 );
+		    }
+		    if ( showprogress ) {
+			/* the first process reports for everyone */
+			showprogress = 0;
+			quiet = 1;
+		    }
+		    break;
+
+		default:
+		    upload_running++;
+		    continue;
+		}
+		break;
+	    }
+	}
+	if ( password != NULL ) {
+	    /* clear the password from memory */
+	    memset( password, 0, strlen( password ));
+	}
     }
 
     while ( fgets( tline, MAXPATHLEN, tran ) != NULL ) {
@@ -561,6 +948,9 @@ main( int argc, char **argv )
 		exit( 2 );
 	    }
 	}
+	if (( upload_running > 0 ) && ( upload_reap( 0 ) != 0 )) {
+	    goto stor_failed;
+	}
 
 	len = strlen( tline );
 	if (( tline[ len - 1 ] ) != '\n' ) {
@@ -592,6 +982,19 @@ main( int argc, char **argv )
 		return( 1 );
 	    } 
 
+	    if ( network && ( connections > 1 ) &&
+		    ((( linenum < have_lines ) && have_held[ linenum ] ) ?
+		    ( worker != 0 ) :
+		    !upload_mine( negative ? 0 :
+		    strtoofft( targv[ 6 ], NULL, 10 )))) {
+		/* another connection sends it */
+		if ( showprogress ) {
+		    progressupdate( strtoofft( targv[ 6 ], NULL, 10 ),
+			    (filepath_t *) d_path );
+		}
+		continue;
+	    }
+
 	    if ( !negative ) {
 		/* Verify transcript line is correct */
 	        if ( radstat( (filepath_t *) d_path, &st, &type, &afinfo ) != 0 ) {
@@ -641,8 +1044,10 @@ main( int argc, char **argv )
 		    }
 		}
 	    } else {
-	        if ( snprintf( (char *) pathdesc, MAXPATHLEN * 2, "STOR FILE %s %s", 
-			tname, targv[ 1 ] ) >= ( MAXPATHLEN * 2 )) {
+		/* the server checks what it's sent against the transcript */
+	        if ( snprintf( (char *) pathdesc, MAXPATHLEN * 2,
+			verify ? "STOR FILE %s %s %s" : "STOR FILE %s %s",
+			tname, targv[ 1 ], targv[ 7 ] ) >= ( MAXPATHLEN * 2 )) {
 		    fprintf( stderr, "STOR FILE %s %s: path description too"
 			    " long\n", tname, d_path );
 		    exit( 2 );
@@ -659,6 +1064,25 @@ main( int argc, char **argv )
 			goto stor_failed;
 		    }
 
+		} else if (( linenum < have_lines ) && have_held[ linenum ]) {
+		    /* the server had it, the transcript says what it is */
+		    if ( st.st_size != strtoofft( targv[ 6 ], NULL, 10 )) {
+			if ( force ) {
+			    fprintf( stderr, "warning: " );
+			}
+			fprintf( stderr, "line %d: size in transcript does "
+			    "not match size of file\n", linenum );
+			if ( ! force ) {
+			    exit( 2 );
+			}
+		    }
+		    if ( showprogress ) {
+			progressupdate( st.st_size, (filepath_t *) d_path );
+		    }
+		    if ( !quiet && !showprogress ) {
+			printf( "%s: already on server\n", d_path );
+		    }
+
 		} else {
 		    if ( *targv[ 0 ] == 'a' ) {
 		        rc = stor_applefile( sn, pathdesc, (filepath_t *) d_path,
@@ -681,8 +1105,33 @@ done:
     if ( network ) {
 	while ( respcount > 0 ) {
 	    if ( stor_response( sn, &respcount, NULL ) < 0 ) {
+		if ( worker == 0 ) {
+		    upload_stop( );
+		}
+		exit( 2 );
+	    }
+	}
+	if (( connections > 1 ) && ( worker == 0 )) {
+	    /* nothing shows the upload complete until every file is in */
+	    if ( upload_reap( 1 ) != 0 ) {
+		goto stor_failed;
+	    }
+	    if ( snprintf( (char *) pathdesc, MAXPATHLEN * 2,
+		    "STOR TRANSCRIPT %s", tname ) >= ( MAXPATHLEN * 2 )) {
+		fprintf( stderr, "STOR TRANSCRIPT %s: path description "
+			"too long\n", tname );
 		exit( 2 );
 	    }
+	    respcount += 2;
+	    if ( stor_file( sn, pathdesc, (filepath_t *) argv[ optind ],
+		    st_tran.st_size, cksumval ) < 0 ) {
+		goto stor_failed;
+	    }
+	    while ( respcount > 0 ) {
+		if ( stor_response( sn, &respcount, NULL ) < 0 ) {
+		    exit( 2 );
+		}
+	    }
 	}
 	if (( closesn( sn )) != 0 ) {
 	    fprintf( stderr, "cannot close sn\n" );
@@ -697,6 +1146,9 @@ done:
 
 stor_failed:
     if ( dodots ) { putchar( (char)'\n' ); }
+    if (( worker == 0 ) && ( upload_running > 0 )) {
+	upload_stop( );
+    }
     while ( respcount > 0 ) {
 	tv.tv_sec = 30;
 	tv.tv_usec = 0;
@@ -14,10 +14,111 @@
 #include "list.h"
 #include "pathcmp.h"
 
-static node_t *   _list_create_node( const filepath_t *path );
+#define LIST_HASH_MIN		64
+#define LIST_ARENA_CHUNK	( 16 * 1024 )
+
+struct list_arena
+{
+    list_arena_t	*la_next;
+    size_t		la_used;
+    filepath_t		la_data[ LIST_ARENA_CHUNK ];
+};
+
+static node_t *		_list_create_node( list_t *list,
+				const filepath_t *path );
+static filepath_t *	_list_arena_dup( list_t *list, const filepath_t *path );
+static unsigned int	_list_hash( const filepath_t *path );
+static int		_list_hash_add( list_t *list, node_t *node );
+static void		_list_hash_remove( list_t *list, node_t *node );
+static node_t *		_list_lookup( const list_t *list,
+				const filepath_t *path );
+
+/* FNV-1a.  list_check() matches exactly, so hash every byte. */
+    static unsigned int
+_list_hash( const filepath_t *path )
+{
+    unsigned int	h = 2166136261U;
+
+    for ( ; *path != '\0'; path++ ) {
+	h ^= (unsigned char)*path;
+	h *= 16777619U;
+    }
+    return( h );
+}
+
+    static filepath_t *
+_list_arena_dup( list_t *list, const filepath_t *path )
+{
+    list_arena_t	*arena;
+    filepath_t		*p;
+    size_t		len = filepath_len( path ) + 1;
+
+    if (( arena = list->l_arena ) == NULL ||
+	    arena->la_used + len > LIST_ARENA_CHUNK ) {
+	if (( arena = malloc( sizeof( list_arena_t ))) == NULL ) {
+	    return( NULL );
+	}
+	arena->la_used = 0;
+	arena->la_next = list->l_arena;
+	list->l_arena = arena;
+    }
+
+    p = arena->la_data + arena->la_used;
+    memcpy( p, path, len );
+    arena->la_used += len;
+
+    return( p );
+}
+
+    static int
+_list_hash_add( list_t *list, node_t *node )
+{
+    node_t		**hash, *cur, *next;
+    unsigned int	hsize, i, b;
+
+    /* keep the load factor at or below one */
+    if ( (unsigned int)list->l_count >= list->l_hsize ) {
+	hsize = list->l_hsize ? list->l_hsize * 2 : LIST_HASH_MIN;
+	if (( hash = calloc( hsize, sizeof( node_t * ))) == NULL ) {
+	    return( -1 );
+	}
+	for ( i = 0; i < list->l_hsize; i++ ) {
+	    for ( cur = list->l_hash[ i ]; cur != NULL; cur = next ) {
+		next = cur->n_hnext;
+		b = _list_hash( cur->n_path ) & ( hsize - 1 );
+		cur->n_hnext = hash[ b ];
+		hash[ b ] = cur;
+	    }
+	}
+	free( list->l_hash );
+	list->l_hash = hash;
+	list->l_hsize = hsize;
+    }
+
+    b = _list_hash( node->n_path ) & ( list->l_hsize - 1 );
+    node->n_hnext = list->l_hash[ b ];
+    list->l_hash[ b ] = node;
+
+    return( 0 );
+}
+
+    static void
+_list_hash_remove( list_t *list, node_t *node )
+{
+    node_t		**cur;
+
+    cur = &list->l_hash[ _list_hash( node->n_path ) & ( list->l_hsize - 1 ) ];
+    for ( ; *cur != NULL; cur = &(*cur)->n_hnext ) {
+	if ( *cur == node ) {
+	    *cur = node->n_hnext;
+	    node->n_hnext = NULL;
+	    return;
+	}
+    }
+}
 
    static node_t *
-_list_create_node( const filepath_t *path )
+_list_create_node( list_t *list, const filepath_t *path )
 {
     node_t 	*new_node;
 
@@ -30,7 +131,14 @@ _list_create_node( const filepath_t *path )
 	return( NULL );
     }
     memset( new_node, 0, sizeof( node_t ));
-    filepath_ncpy (new_node->n_path, path, sizeof(new_node->n_path)-1);
+    if (( new_node->n_path = _list_arena_dup( list, path )) == NULL ) {
+	free( new_node );
+	return( NULL );
+    }
+    if ( _list_hash_add( list, new_node ) != 0 ) {
+	free( new_node );
+	return( NULL );
+    }
 
     return( new_node );
 }
@@ -51,16 +159,24 @@ list_new( void )
     void
 list_clear( list_t *list )
 {
+    list_arena_t	*arena;
+
     /* Remove items from tail of list */
     while ( list->l_tail != NULL ) {
 	list_remove_tail( list );
     }
+
+    while (( arena = list->l_arena ) != NULL ) {
+	list->l_arena = arena->la_next;
+	free( arena );
+    }
 }
 
     void
 list_free( list_t *list )
 {
     list_clear( list );
+    free( list->l_hash );
     free( list );
 }
 	
@@ -101,7 +217,7 @@ list_insert_case( list_t *list, const filepath_t *path, int case_sensitive )
     }
 
     /* Insert in middle */
-    if (( new_node = _list_create_node( path )) == NULL ) {
+    if (( new_node = _list_create_node( list, path )) == NULL ) {
 	return( -1 );
     }
     new_node->n_next = cur;
@@ -124,7 +240,7 @@ list_insert_head( list_t *list, const filepath_t *path )
 {
     node_t		*new_node;
 
-    if (( new_node = _list_create_node( path )) == NULL ) {
+    if (( new_node = _list_create_node( list, path )) == NULL ) {
 	return( -1 );
     }
 
@@ -145,7 +261,7 @@ list_insert_tail( list_t *list, const filepath_t *path )
 {
     node_t		*new_node;
 
-    if (( new_node = _list_create_node( path )) == NULL ) {
+    if (( new_node = _list_create_node( list, path )) == NULL ) {
 	return( -1 );
     }
 
@@ -167,26 +283,22 @@ list_remove( list_t *list, const filepath_t *path )
     int			count = 0;
     node_t		*cur;
 
-    for ( cur = list->l_head; cur != NULL; cur = cur->n_next ) {
-	if ( pathcmp( cur->n_path, path ) == 0 ) {
-
-	    if ( list->l_head == cur ) {
-		list_remove_head( list );
-		count++;
-		
-	    } else if ( list->l_tail == cur ) {
-		list_remove_tail( list );
-		count++;
-
-	    } else {
-		/* Remove item */
-		cur->n_prev->n_next = cur->n_next;
-		cur->n_next->n_prev = cur->n_prev;
-		free( cur );
-		list->l_count--;
-		count++;
-	    }
+    while (( cur = _list_lookup( list, path )) != NULL ) {
+	if ( list->l_head == cur ) {
+	    list_remove_head( list );
+	    
+	} else if ( list->l_tail == cur ) {
+	    list_remove_tail( list );
+
+	} else {
+	    /* Remove item */
+	    _list_hash_remove( list, cur );
+	    cur->n_prev->n_next = cur->n_next;
+	    cur->n_next->n_prev = cur->n_prev;
+	    free( cur );
+	    list->l_count--;
 	}
+	count++;
     }
 
     return( count );
@@ -211,6 +323,7 @@ list_pop_tail( list_t * list )
 	return( NULL );
     }
     node = list->l_tail;
+    _list_hash_remove( list, node );
     if ( list->l_count == 1 ) {
 	list->l_tail = NULL;
 	list->l_head = NULL;
@@ -241,6 +354,7 @@ list_pop_head( list_t *list )
 	return( NULL );
     }
     node = list->l_head;
+    _list_hash_remove( list, node );
     if ( list->l_count == 1 ) {
 	list->l_tail = NULL;
 	list->l_head = NULL;
@@ -253,16 +367,27 @@ list_pop_head( list_t *list )
     return( node );
 }
 
-    int
-list_check( const list_t *list, const filepath_t *path )
+    static node_t *
+_list_lookup( const list_t *list, const filepath_t *path )
 {
     node_t		*cur;
 
-    for ( cur = list->l_head; cur != (node_t *) NULL; cur = cur->n_next ) {
-	if ( pathcmp( cur->n_path, path ) == 0 ) {
-	    return( 1 );
+    if ( list->l_hsize == 0 ) {
+	return( NULL );
+    }
+
+    cur = list->l_hash[ _list_hash( path ) & ( list->l_hsize - 1 ) ];
+    for ( ; cur != (node_t *) NULL; cur = cur->n_hnext ) {
+	if ( filepath_cmp( cur->n_path, path ) == 0 ) {
+	    return( cur );
 	}
     }
 
-    return( 0 );
+    return( NULL );
+}
+
+    int
+list_check( const list_t *list, const filepath_t *path )
+{
+    return( _list_lookup( list, path ) != NULL );
 }
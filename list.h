@@ -9,19 +9,30 @@
 #  include "filepath.h"
 
 typedef struct node node_t;
+typedef struct list_arena list_arena_t;
 
+/*
+ * An ordered, doubly linked list of paths, indexed by a hash table so
+ * list_check() doesn't walk the list.  Path strings live in an arena
+ * owned by the list: a popped node's n_path stays valid until the list
+ * is cleared or freed.
+ */
 struct list
 {
     int		l_count;
     node_t	*l_head;	
     node_t	*l_tail;	
+    node_t	**l_hash;	/* l_hsize buckets, chained by n_hnext */
+    unsigned int l_hsize;
+    list_arena_t *l_arena;	/* storage for n_path */
 };
 
 struct node
 {
-    filepath_t	n_path[ MAXPATHLEN ];
+    filepath_t	*n_path;
     node_t 	*n_next;
     node_t 	*n_prev;
+    node_t	*n_hnext;	/* hash chain */
 };
 
 typedef struct list list_t;
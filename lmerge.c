@@ -21,6 +21,7 @@
 #include "pathcmp.h"
 #include "root.h"
 #include "filepath.h"
+#include "tfile.h"
 #include "usageopt.h"
 
 char	       *progname = "lmerge";
@@ -73,7 +74,7 @@ merge_node_free( merge_node_t *node )
 
 struct tran {
     merge_node_t        *t_next;	/* Next tran in list */
-    FILE                *t_fd;		/* open file descriptor */
+    tfile_t             *t_fd;		/* open transcript stream */
     int                 t_num;		/* Tran num from command line */
     filepath_t          *t_path;	/* Path from command line */
     int                 t_eof;		/* Tran at end of file */
@@ -100,8 +101,13 @@ getnextline( struct tran *tran )
     const char	*d_path;
 
 getline:
-    if ( fgets( tran->t_tline, MAXPATHLEN, tran->t_fd ) == NULL ) {
-	if ( feof( tran->t_fd )) {
+    if ( tfile_gets( tran->t_tline, MAXPATHLEN, tran->t_fd ) == NULL ) {
+	if ( tfile_error( tran->t_fd )) {
+	    fprintf( stderr, "%s: read error, transcript corrupt or truncated\n",
+		    (char *) tran->t_path );
+	    return( -1 );
+	}
+	if ( tfile_eof( tran->t_fd )) {
 	    tran->t_eof = 1;
 	    return( 0 );
 	}
@@ -486,7 +492,7 @@ main( int argc, char **argv )
 	}
 
 	/* open tran */
-	if (( trans[ i ]->t_fd = fopen( (char *) trans[ i ]->t_path, "r" )) == NULL ) {
+	if (( trans[ i ]->t_fd = tfile_open( (char *) trans[ i ]->t_path )) == NULL ) {
 	  perror( (char *) trans[ i ]->t_path );
 	    return( 1 );
 	}
@@ -0,0 +1,518 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "code.h"
+#include "durable.h"
+#include "journal.h"
+#include "local.h"
+#include "pathcmp.h"
+#include "progress.h"
+#include "update.h"
+
+extern int		linenum;
+extern int		quiet;
+extern int		case_sensitive;
+
+/* requests a worker may have outstanding, and written before a flush */
+#define LOCAL_DEPTH	64
+#define LOCAL_BATCH	8
+
+typedef struct local_worker local_worker_t;
+
+struct local_worker {
+    pid_t		lw_pid;
+    FILE		*lw_req;
+    int			lw_pending;
+    int			lw_unflushed;
+};
+
+typedef struct local_op local_op_t;
+
+struct local_op {
+    local_op_t		*lo_next;
+    unsigned int	lo_seq;
+    local_worker_t	*lo_worker;
+    filepath_t		*lo_path;
+    int			lo_structural;	/* others below it wait */
+    int			lo_journal;
+    unsigned long long	lo_key;
+};
+
+static local_worker_t	*workers = NULL;
+static int		nworkers = 0;
+static FILE		*local_res = NULL;
+static local_op_t	*local_ops = NULL;
+static int		local_count = 0;
+static int		local_structural = 0;
+static unsigned int	local_seq = 0;
+
+    static void
+local_exit( int rc )
+{
+    fflush( stdout );
+    _exit( rc );
+}
+
+/*
+ * The worker process.  Each request line is
+ *
+ *	seq op present linenum rest
+ *
+ * where op is U to unlink or R to rmdir the encoded path in rest, or L
+ * to apply the transcript line in rest.  It's answered with "seq rc".
+ */
+    static void
+local_worker( FILE *req, FILE *res, int (*apply)( char *, int ))
+{
+    char		line[ 3 * MAXPATHLEN ];
+    char		*p, *rest;
+    const char		*d;
+    unsigned int	seq;
+    int			op, present, rc;
+
+    /* the parent reports progress as operations finish */
+    if ( showprogress ) {
+	showprogress = 0;
+	quiet = 1;
+    }
+
+    while ( fgets( line, sizeof( line ), req ) != NULL ) {
+	seq = strtoul( line, &p, 10 );
+	op = *++p;
+	present = atoi( p + 2 );
+	if ((( p = strchr( p + 2, ' ' )) == NULL ) ||
+		(( rest = strchr( p + 1, ' ' )) == NULL )) {
+	    fprintf( stderr, "worker: bad request\n" );
+	    local_exit( 2 );
+	}
+	linenum = atoi( p + 1 );
+	rest++;
+
+	switch ( op ) {
+	case 'U':
+	case 'R':
+	    rest[ strcspn( rest, "\n" ) ] = '\0';
+	    if (( d = decode( rest )) == NULL ) {
+		fprintf( stderr, "worker: bad request\n" );
+		local_exit( 2 );
+	    }
+	    update_forget( );
+	    if ((( op == 'R' ) ? rmdir( d ) : unlink( d )) != 0 ) {
+		perror( d );
+		rc = 1;
+		break;
+	    }
+	    if ( !quiet ) printf( "%s: deleted\n", d );
+	    rc = 0;
+	    break;
+
+	case 'L':
+	    rc = (*apply)( rest, present );
+	    break;
+
+	default:
+	    fprintf( stderr, "worker: bad request\n" );
+	    local_exit( 2 );
+	}
+
+	/* whole lines, so that workers' output doesn't interleave */
+	fflush( stdout );
+	fprintf( res, "%u %d\n", seq, rc );
+	if ( fflush( res ) != 0 ) {
+	    local_exit( 2 );
+	}
+    }
+
+    local_exit( 0 );
+}
+
+/*
+ * Start nworkers workers, which apply lines with apply().
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY
+ */
+    int
+local_start( int n, int (*apply)( char *tline, int present ))
+{
+    int			reqfd[ 2 ], resfd[ 2 ];
+    int			i, j;
+    pid_t		pid;
+    FILE		*req, *res;
+
+    /* a worker that has exited is noticed by its missing answers */
+    if ( signal( SIGPIPE, SIG_IGN ) == SIG_ERR ) {
+	perror( "signal" );
+	return( -1 );
+    }
+
+    if (( workers = calloc( n, sizeof( local_worker_t ))) == NULL ) {
+	perror( "calloc" );
+	return( -1 );
+    }
+    /* every worker answers on the same pipe, a line at a time */
+    if ( pipe( resfd ) < 0 ) {
+	perror( "pipe" );
+	return( -1 );
+    }
+
+    fflush( stdout );
+    fflush( stderr );
+
+    for ( i = 0; i < n; i++ ) {
+	if ( pipe( reqfd ) < 0 ) {
+	    perror( "pipe" );
+	    return( -1 );
+	}
+
+	switch ( pid = fork( )) {
+	case -1:
+	    perror( "fork" );
+	    return( -1 );
+
+	case 0:
+	    close( reqfd[ 1 ] );
+	    close( resfd[ 0 ] );
+	    /* so that the others see end of file when the parent closes */
+	    for ( j = 0; j < i; j++ ) {
+		fclose( workers[ j ].lw_req );
+	    }
+	    if ((( req = fdopen( reqfd[ 0 ], "r" )) == NULL ) ||
+		    (( res = fdopen( resfd[ 1 ], "w" )) == NULL )) {
+		perror( "fdopen" );
+		local_exit( 2 );
+	    }
+	    local_worker( req, res, apply );
+	    /* NOTREACHED */
+
+	default:
+	    break;
+	}
+
+	close( reqfd[ 0 ] );
+	workers[ i ].lw_pid = pid;
+	if (( workers[ i ].lw_req = fdopen( reqfd[ 1 ], "w" )) == NULL ) {
+	    perror( "fdopen" );
+	    return( -1 );
+	}
+	nworkers++;
+    }
+
+    close( resfd[ 1 ] );
+    if (( local_res = fdopen( resfd[ 0 ], "r" )) == NULL ) {
+	perror( "fdopen" );
+	return( -1 );
+    }
+
+    return( 0 );
+}
+
+    int
+local_running( void )
+{
+    return( nworkers > 0 );
+}
+
+    static int
+local_flush( local_worker_t *lw )
+{
+    if ( lw->lw_unflushed == 0 ) {
+	return( 0 );
+    }
+    lw->lw_unflushed = 0;
+    if ( fflush( lw->lw_req ) != 0 ) {
+	fprintf( stderr, "worker exited\n" );
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * Wait for an answer.  A failed operation has said why on stderr.
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY
+ */
+    static int
+local_result( void )
+{
+    local_op_t		**lop, *lo;
+    char		line[ MAXPATHLEN ];
+    unsigned int	seq;
+    int			i, rc;
+
+    for ( i = 0; i < nworkers; i++ ) {
+	if ( local_flush( &workers[ i ] ) != 0 ) {
+	    return( -1 );
+	}
+    }
+
+    if (( fgets( line, sizeof( line ), local_res ) == NULL ) ||
+	    ( sscanf( line, "%u %d", &seq, &rc ) != 2 )) {
+	fprintf( stderr, "worker exited\n" );
+	return( -1 );
+    }
+    for ( lop = &local_ops; *lop != NULL; lop = &(*lop)->lo_next ) {
+	if ( (*lop)->lo_seq == seq ) {
+	    break;
+	}
+    }
+    if (( lo = *lop ) == NULL ) {
+	fprintf( stderr, "worker: bad reply\n" );
+	return( -1 );
+    }
+    *lop = lo->lo_next;
+    local_count--;
+    if ( lo->lo_structural ) {
+	local_structural--;
+    }
+    lo->lo_worker->lw_pending--;
+
+    switch ( rc ) {
+    case 0:
+	if ( showprogress ) {
+	    progressupdate( PROGRESSUNIT, lo->lo_path );
+	}
+	/* FALLTHROUGH */
+    case 2:
+	rc = 0;
+	if ( lo->lo_journal && ( durable_mark( lo->lo_key ) != 0 )) {
+	    rc = -1;
+	}
+	break;
+
+    default:
+	rc = -1;
+	break;
+    }
+
+    free( lo->lo_path );
+    free( lo );
+    return( rc );
+}
+
+/* the outstanding operation path must wait for, if any */
+    static local_op_t *
+local_depends( const filepath_t *path, const filepath_t *target, int isdir )
+{
+    local_op_t		*lo;
+
+    if (( local_structural == 0 ) && !isdir && ( target == NULL )) {
+	return( NULL );
+    }
+    for ( lo = local_ops; lo != NULL; lo = lo->lo_next ) {
+	/* made or replaced above, or at, path */
+	if ( lo->lo_structural &&
+		ischildcase( path, lo->lo_path, case_sensitive )) {
+	    return( lo );
+	}
+	/* still in the directory being removed */
+	if ( isdir && ischildcase( lo->lo_path, path, case_sensitive )) {
+	    return( lo );
+	}
+	if (( target != NULL ) &&
+		ischildcase( target, lo->lo_path, case_sensitive )) {
+	    return( lo );
+	}
+    }
+    return( NULL );
+}
+
+    static int
+local_ready( const filepath_t *path, const filepath_t *target, int isdir )
+{
+    while ( local_depends( path, target, isdir ) != NULL ) {
+	if ( local_result( ) != 0 ) {
+	    return( -1 );
+	}
+    }
+    while ( local_count >= nworkers * LOCAL_DEPTH ) {
+	if ( local_result( ) != 0 ) {
+	    return( -1 );
+	}
+    }
+    return( 0 );
+}
+
+    static int
+local_send( int op, int present, const char *rest, const filepath_t *path,
+	int structural, int journal, unsigned long long key )
+{
+    local_worker_t	*lw;
+    local_op_t		*lo;
+    int			i;
+
+    /* the least busy */
+    lw = &workers[ 0 ];
+    for ( i = 1; i < nworkers; i++ ) {
+	if ( workers[ i ].lw_pending < lw->lw_pending ) {
+	    lw = &workers[ i ];
+	}
+    }
+
+    if (( lo = malloc( sizeof( local_op_t ))) == NULL ) {
+	perror( "malloc" );
+	return( -1 );
+    }
+    if (( lo->lo_path = filepath_dup( path )) == NULL ) {
+	perror( "malloc" );
+	free( lo );
+	return( -1 );
+    }
+    lo->lo_seq = local_seq++;
+    lo->lo_worker = lw;
+    lo->lo_structural = structural;
+    lo->lo_journal = journal;
+    lo->lo_key = key;
+
+    if ( fprintf( lw->lw_req, "%u %c %d %d %s%s", lo->lo_seq, op, present,
+	    linenum, rest, ( op == 'L' ) ? "" : "\n" ) < 0 ) {
+	fprintf( stderr, "worker exited\n" );
+	free( lo->lo_path );
+	free( lo );
+	return( -1 );
+    }
+
+    lo->lo_next = local_ops;
+    local_ops = lo;
+    local_count++;
+    if ( structural ) {
+	local_structural++;
+    }
+    lw->lw_pending++;
+    lw->lw_unflushed++;
+
+    /* keep an idle worker busy, otherwise write in batches */
+    if (( lw->lw_unflushed >= LOCAL_BATCH ) ||
+	    ( lw->lw_unflushed == lw->lw_pending )) {
+	return( local_flush( lw ));
+    }
+    return( 0 );
+}
+
+/*
+ * Remove path.  structural is set if something else is to be made in
+ * its place.
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY
+ */
+    int
+local_remove( const filepath_t *path, int isdir, int structural )
+{
+    if ( local_ready( path, NULL, isdir ) != 0 ) {
+	return( -1 );
+    }
+    /* our own cached directory may be what's going */
+    update_forget( );
+    return( local_send( isdir ? 'R' : 'U', 0, encode( (const char *) path ),
+	    path, structural, 0, 0 ));
+}
+
+/*
+ * Apply tline, about path and, for a hard link, target.  structural is
+ * set if the line makes a directory.  key is journaled once it's done.
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY
+ */
+    int
+local_line( const char *tline, const filepath_t *path,
+	const filepath_t *target, int present, int structural,
+	unsigned long long key )
+{
+    if ( local_ready( path, target, 0 ) != 0 ) {
+	return( -1 );
+    }
+    return( local_send( 'L', present, tline, path, structural, 1, key ));
+}
+
+/* wait for what the caller is about to do to path itself to be possible */
+    int
+local_before( const filepath_t *path )
+{
+    int			i;
+
+    if ( nworkers == 0 ) {
+	return( 0 );
+    }
+    /* so that they keep on meanwhile */
+    for ( i = 0; i < nworkers; i++ ) {
+	if ( local_flush( &workers[ i ] ) != 0 ) {
+	    return( -1 );
+	}
+    }
+    while ( local_depends( path, NULL, 0 ) != NULL ) {
+	if ( local_result( ) != 0 ) {
+	    return( -1 );
+	}
+    }
+    return( 0 );
+}
+
+/* wait for everything outstanding */
+    int
+local_wait( void )
+{
+    int			rc = 0;
+
+    while ( local_ops != NULL ) {
+	if ( local_result( ) != 0 ) {
+	    rc = -1;
+	    if ( feof( local_res ) || ferror( local_res )) {
+		break;
+	    }
+	}
+    }
+    return( rc );
+}
+
+/* stop the workers */
+    void
+local_stop( void )
+{
+    local_op_t		*lo;
+    int			i, status;
+
+    if ( nworkers == 0 ) {
+	return;
+    }
+
+    /* unanswered, a worker stops after what it's doing */
+    fclose( local_res );
+    local_res = NULL;
+    for ( i = 0; i < nworkers; i++ ) {
+	fclose( workers[ i ].lw_req );
+    }
+    for ( i = 0; i < nworkers; i++ ) {
+	waitpid( workers[ i ].lw_pid, &status, 0 );
+    }
+    while (( lo = local_ops ) != NULL ) {
+	local_ops = lo->lo_next;
+	free( lo->lo_path );
+	free( lo );
+    }
+    local_count = local_structural = 0;
+    free( workers );
+    workers = NULL;
+    nworkers = 0;
+}
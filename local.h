@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_LOCAL_H)
+#  define _RADMIND_LOCAL_H "$Id$"
+
+#  include "filepath.h"
+
+/*
+ * Removals and lines that need nothing from the server, spread over
+ * worker processes.  An operation is held back while it depends on one
+ * still outstanding: a directory is removed once what was in it is gone,
+ * nothing is made in a directory until it's been created, and a hard
+ * link waits for its target.
+ */
+
+extern int local_start( int nworkers, int (*apply)( char *tline,
+	   int present ));
+extern int local_running( void );
+extern int local_remove( const filepath_t *path, int isdir, int structural );
+extern int local_line( const char *tline, const filepath_t *path,
+	   const filepath_t *target, int present, int structural,
+	   unsigned long long key );
+extern int local_before( const filepath_t *path );
+extern int local_wait( void );
+extern void local_stop( void );
+
+#endif /* defined(_RADMIND_LOCAL_H) */
@@ -17,6 +17,7 @@
 #include "argcargv.h"
 #include "code.h"
 #include "pathcmp.h"
+#include "tfile.h"
 #include "usageopt.h"
 
 size_t	linecount = 0;		   /* Pedantically set value */
@@ -108,7 +109,7 @@ print_them( void )
     void
 process( char *arg )
 {
-    FILE	*f;
+    tfile_t	*f;
     ACAV	*acav;
     char	buffer[4096];
     char	*fn;
@@ -118,10 +119,11 @@ process( char *arg )
 
     if ( strcmp( arg, "-" )) {
 	fn = arg;
-	f = fopen( arg, "r" );
+	f = tfile_open( arg );
     } else {
+	/* stdin may be named more than once, so keep fd 0 open */
 	fn = "(stdin)";
-	f = stdin;
+	f = tfile_fdopen( dup( fileno( stdin )), fn );
     }
     if ( !f ) {
 	    perror( arg );
@@ -131,7 +133,7 @@ process( char *arg )
     acav = acav_alloc();
 
     lineno = 0;
-    while ( fgets( buffer, sizeof buffer, f )) {
+    while ( tfile_gets( buffer, sizeof buffer, f )) {
 	lineno++;
 
 	if (( line = strdup( buffer )) == NULL ) {
@@ -163,13 +165,14 @@ process( char *arg )
 	}
 	save_it( line, (filepath_t *) decode( argv[ 1 ] ));
     }
-
-    if ( f == stdin ) {
-	clearerr( f );
-    } else {
-	fclose( f );
+    if ( tfile_error( f )) {
+	fprintf( stderr, "%s: read error, transcript corrupt or truncated\n",
+		fn );
+	exit( 1 );
     }
 
+    tfile_close( f );
+
     free( line );
     acav_free( acav );
 }
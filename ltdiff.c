@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/evp.h>
+
+#include <sysexits.h>
+
+#include "applefile.h"
+#include "digest.h"
+#include "transcript.h"
+#include "pathcmp.h"
+#include "radstat.h"
+#include "list.h"
+#include "usageopt.h"
+
+void            (*logger)( char * ) = NULL;
+
+extern char	*version, *checksumlist;
+
+const EVP_MD    *md;
+
+int		case_sensitive = 1;
+int		tran_format = -1;
+extern int	exclude_warnings;
+
+char  *progname = "ltdiff";
+
+/*
+ * exit codes:
+ *      0       Transcript written.
+ *	1	-S found a path that no longer matches the last applied state.
+ *      >1     	An error occurred.
+ */
+
+/*
+ * Print the flattened command file, i.e. the creatable transcript
+ * describing the client once an apply of it has succeeded.
+ */
+    static void
+ltdiff_flatten( void )
+{
+    transcript_t	*tran;
+    pathinfo_t		pi;
+
+    edit_path = CREATABLE;
+
+    for (;;) {
+	tran = transcript_select();
+	if ( tran->t_eof ) {
+	    break;
+	}
+
+	pi = tran->t_pinfo;
+	t_print( &pi, tran, PR_STATUS );
+	transcript_parse( tran );
+    }
+
+    edit_path = APPLICABLE;
+}
+
+/*
+ * Return 0 if path still looks the way the last applied transcript
+ * says it should, 1 if it doesn't.  Only the metadata is checked.
+ */
+    static int
+ltdiff_verify( pathinfo_t *pi )
+{
+    struct stat			st;
+    char			type;
+    struct applefileinfo	afinfo;
+    char			want;
+
+    switch ( radstat( pi->pi_name, &st, &type, &afinfo )) {
+    case 0:
+	break;
+
+    case 1:
+	fprintf( stderr, "%s: %s is of an unknown type\n",
+		 progname, pi->pi_name );
+	return( 1 );
+
+    default:
+	if (( errno != ENOTDIR ) && ( errno != ENOENT )) {
+	    perror( (const char *) pi->pi_name );
+	    exit( 2 );
+	}
+	fprintf( stderr, "%s: %s: missing\n", progname, pi->pi_name );
+	return( 1 );
+    }
+
+    /* hardlinks are listed as 'h', but radstat() sees a file */
+    want = ( pi->pi_type == 'h' ) ? 'f' : pi->pi_type;
+    if ( type != want ) {
+	fprintf( stderr, "%s: %s: type is %c, not %c\n",
+		 progname, pi->pi_name, type, want );
+	return( 1 );
+    }
+
+    switch ( pi->pi_type ) {
+    case 'h':
+    case 'l':
+	return( 0 );
+
+    case 'a':
+    case 'f':
+	if (( st.st_size != pi->pi_stat.st_size ) ||
+		( st.st_mtime != pi->pi_stat.st_mtime )) {
+	    fprintf( stderr, "%s: %s: size or mtime changed\n",
+		     progname, pi->pi_name );
+	    return( 1 );
+	}
+	break;
+
+    default:
+	break;
+    }
+
+    if ((( T_MODE & st.st_mode ) != ( T_MODE & pi->pi_stat.st_mode )) ||
+	    ( st.st_uid != pi->pi_stat.st_uid ) ||
+	    ( st.st_gid != pi->pi_stat.st_gid )) {
+	fprintf( stderr, "%s: %s: mode or owner changed\n",
+		 progname, pi->pi_name );
+	return( 1 );
+    }
+
+    return( 0 );
+}
+
+/*
+ * Walk the last applied transcript in step with the command file,
+ * as fsdiff walks the filesystem.  Returns the number of paths -S
+ * found to differ from the last applied state.
+ */
+    static int
+ltdiff( transcript_t *old, int verify )
+{
+    transcript_t	*tran;
+    pathinfo_t		*pi;
+    list_t		*changed;
+    filepath_t		neg[ MAXPATHLEN ];
+    filepath_t		del[ MAXPATHLEN ];
+    unsigned int	count;
+    int			rc, mismatch = 0;
+
+    if (( changed = list_new( )) == NULL ) {
+	perror( "list_new" );
+	exit( 2 );
+    }
+    *neg = '\0';
+    *del = '\0';
+
+    for ( ; !old->t_eof; transcript_parse( old )) {
+	pi = &old->t_pinfo;
+
+	if ( pi->pi_minus ) {
+	    continue;
+	}
+	if ( !ischildcase( pi->pi_name, (filepath_t *) path_prefix,
+		case_sensitive )) {
+	    continue;
+	}
+
+	/*
+	 * fsdiff doesn't read negative directories, it only checks
+	 * what the transcripts list in them.  Do the same.
+	 */
+	if ( *neg != '\0' ) {
+	    if ( ischildcase( pi->pi_name, neg, case_sensitive )) {
+		tran = transcript_select();
+		if ( tran->t_eof || pathcasecmp( tran->t_pinfo.pi_name,
+			pi->pi_name, case_sensitive ) > 0 ) {
+		    continue;
+		}
+	    } else {
+		*neg = '\0';
+	    }
+	}
+	if (( *del != '\0' ) &&
+		!ischildcase( pi->pi_name, del, case_sensitive )) {
+	    *del = '\0';
+	}
+
+	/* an empty target forces a hardlink to a changed file to be relinked */
+	if (( pi->pi_type == 'h' ) && ( list_check( changed, pi->pi_link ))) {
+	    *pi->pi_link = '\0';
+	}
+
+	count = t_print_count;
+	rc = transcript_check_pinfo( pi, ( *del != '\0' ));
+
+	switch ( rc ) {
+	case T_COMP_ISNEG:
+	    filepath_ncpy( neg, pi->pi_name, sizeof( neg ) - 1 );
+	    break;
+
+	case T_COMP_ISDIR:
+	    if ( fs_minus && ( *del == '\0' )) {
+		filepath_ncpy( del, pi->pi_name, sizeof( del ) - 1 );
+	    }
+	    break;
+
+	case T_COMP_ISFILE:
+	    break;
+
+	default:
+	    fprintf( stderr, "%s: %s: unexpected transcript_check_pinfo() "
+		     "result %d\n", progname, pi->pi_name, rc );
+	    exit( 2 );
+	}
+
+	if ( t_print_count == count ) {
+	    continue;
+	}
+
+	if ((( pi->pi_type == 'f' ) || ( pi->pi_type == 'a' )) &&
+		( list_insert_tail( changed, pi->pi_name ) != 0 )) {
+	    perror( "list_insert_tail" );
+	    exit( 2 );
+	}
+	if ( verify ) {
+	    mismatch += ltdiff_verify( pi );
+	}
+    }
+
+    list_free( changed );
+
+    return( mismatch );
+}
+
+
+extern char *optarg;
+extern int optind, opterr, optopt;
+
+/*
+ * Command-line options
+ *
+ * Formerly getopt - "B:c:dFHIK:o:QSVW"
+ */
+
+static const usageopt_t main_usage[] =
+  {
+    { (struct option) { "buffer-size", required_argument,  NULL, 'B' },
+      "Max size of transcript file to buffer in memory (reduces file descriptor usage)", "0-maxint"},
+
+    { (struct option) { "checksum",     required_argument, NULL, 'c' },
+      "specify checksum type",  "checksum-type: [sha1,etc]" },
+
+    { (struct option) { "debug", no_argument, NULL, 'd'},
+      		"Raise debugging level to see what's happening", NULL},
+
+    { (struct option) { "flatten", no_argument, NULL, 'F'},
+      		"print the creatable transcript the command file describes, to save as the last applied state", NULL},
+
+    { (struct option) { "help",         no_argument,       NULL, 'H' },
+     		"This message", NULL },
+
+    { (struct option) { "case-insensitive", no_argument,   NULL, 'I' },
+     		"case insensitive when comparing paths", NULL },
+
+    { (struct option) { "command-file", required_argument, NULL, 'K' },
+                "Specify command file, defaults to '" _RADMIND_COMMANDFILE "'", "command.K" },
+
+    { (struct option) { "output",       required_argument, NULL, 'o' },
+     		"Specify output transcript file", "output-file" },
+
+    { (struct option) { "verify",	no_argument,	   NULL, 'S' },
+      		"stat the paths that differ and exit 1 if any no longer match the last applied state", NULL },
+
+    { (struct option) { "version",      no_argument,       NULL, 'V' },
+     		"show version number and exits", NULL },
+
+    { (struct option) { "warning",      no_argument,       NULL, 'W' },
+     		"prints a warning to the standard error when encountering an object matching an exclude pattern.", NULL },
+
+    { (struct option) { "verbose",	no_argument,	   NULL, 'Q' },
+      		"Turn up verbose mode", NULL },
+
+    /* End of list */
+    { (struct option) {(char *) NULL, 0, (int *) NULL, 0}, (char *) NULL, (char *) NULL}
+  }; /* end of main_usage[] */
+
+/* Main */
+
+    int
+main( int argc, char **argv )
+{
+    int			c, err = 0, len, tmp_i;
+    int			flatten = 0, verify = 0, mismatch = 0;
+    filepath_t	        *kfile = (filepath_t *) _RADMIND_COMMANDFILE;
+    filepath_t		*state = NULL;
+    transcript_t	*old;
+    char		buf[ MAXPATHLEN ];
+    int                  optndx = 0;
+    struct option       *main_opts;
+    char                *main_optstr;
+
+    /* Get our name from argv[0] */
+    for (main_optstr = argv[0]; *main_optstr; main_optstr++) {
+        if (*main_optstr == '/')
+	    progname = main_optstr+1;
+    }
+
+    cksum = 0;
+    outtran = stdout;
+
+    main_opts = usageopt_option_new (main_usage, &main_optstr);
+
+    while (( c = getopt_long (argc, argv, main_optstr, main_opts, &optndx)) != -1) {
+	switch( c ) {
+	case 'B':
+	    tmp_i = atoi (optarg);
+
+	    if ((errno == 0) && (tmp_i >= 0)) {
+	        transcript_buffer_size = tmp_i;
+	    }
+	    break;
+
+	case 'c':
+            OpenSSL_add_all_digests();
+            md = digest_byname( optarg );
+            if ( !md ) {
+                fprintf( stderr, "%s: unsupported checksum\n", optarg );
+                exit( 2 );
+            }
+            cksum = 1;
+            break;
+
+	case 'd':
+	    debug++;
+	    break;
+
+	case 'F':
+	    flatten = 1;
+	    break;
+
+	case 'I':
+	    case_sensitive = 0;
+	    break;
+
+	case 'K':
+	    kfile = (filepath_t *) optarg;
+	    break;
+
+	case 'o':
+	    if (( outtran = fopen( optarg, "w" )) == NULL ) {
+		perror( optarg );
+		exit( 2 );
+	    }
+	    break;
+
+	case 'Q': /* --verbose */
+	    verbose ++;
+	    break;
+
+	case 'S':
+	    verify = 1;
+	    break;
+
+	case 'V':
+	    printf( "%s\n", version );
+	    printf( "%s\n", checksumlist );
+	    exit( 0 );
+
+	case 'W':
+	    exclude_warnings = 1;
+	    break;
+
+	case 'H':  /* --help */
+	  usageopt_usage (stdout, 1 /* verbose */, progname,  main_usage,
+			  "{ -F <path> | <last-applied-transcript> <path> }", 80);
+	  exit (0);
+
+	default:
+	    fprintf (stderr, "%s: Invalid or unsupported option, '-%c'\n",
+		     progname, c);
+	    err++;
+	    break;
+	}
+    }
+
+    if ( flatten ) {
+	if ( verify ) {
+	    fprintf (stderr, "%s: -F and -S are mutually exclusive\n",
+		     progname);
+	    err++;
+	}
+	if (( argc - optind ) != 1 ) {
+	    err++;
+	}
+    } else if (( argc - optind ) != 2 ) {
+	err++;
+    } else {
+	state = (filepath_t *) argv[ optind++ ];
+    }
+
+    if ( err ) {
+        usageopt_usage (stderr, 0 /* not verbose */, progname,  main_usage,
+			"{ -F <path> | <last-applied-transcript> <path> }", 80);
+	fprintf (stderr, "%s: Use --help to get more verbose usage\n",
+		 progname);
+        exit( 2 );
+    }
+
+    path_prefix = argv[ optind ];
+    len = strlen( path_prefix );
+
+    /* Clip trailing '/' */
+    if (( len > 1 ) && ( path_prefix[ len - 1 ] == '/' )) {
+	path_prefix[ len - 1 ] = '\0';
+	len--;
+    }
+
+    /* Canonicalize path_prefix the same way fsdiff does. */
+    switch( path_prefix[ 0 ] ) {
+    case '/':
+        break;
+
+    case '.':
+	if (( len == 1 ) || (  path_prefix[ 1 ] == '/' )) {
+	    break;
+	}
+    default:
+        if ( snprintf( buf, sizeof( buf ), "./%s",
+                path_prefix ) >= MAXPATHLEN ) {
+  	    fprintf( stderr, "%s: path '%s' too long ( > %d)\n", progname, path_prefix, MAXPATHLEN - 3 );
+            exit( 2 );
+        }
+	path_prefix = buf;
+        break;
+    }
+
+    if (( path_prefix[ 0 ] == '.' ) &&
+	    (( len == 1 ) || ( path_prefix[ 1 ] == '/' ))) {
+	tran_format = T_RELATIVE;
+    } else {
+	tran_format = T_ABSOLUTE;
+    }
+
+    /* initialize the transcripts */
+    edit_path = APPLICABLE;
+    transcript_init( kfile, K_CLIENT );
+
+    if ( flatten ) {
+	/* saved state keeps the transcripts' checksums, never the disk's */
+	cksum = 0;
+	ltdiff_flatten( );
+    } else {
+	old = transcript_open( state, state );
+	mismatch = ltdiff( old, verify );
+	transcript_close( old );
+    }
+
+    /* print whatever is left in the transcripts */
+    transcript_free( );
+    hardlink_free( );
+
+    if ( fclose( outtran ) != 0 ) {
+	perror( "fclose" );
+	exit( 2 );
+    }
+
+    if ((debug > 0) && (transcript_buffer_size > 0)) {
+        fprintf (stderr, "%u transcripts buffered, %u transcripts not buffered\n",
+		transcripts_buffered, transcripts_unbuffered);
+    }
+
+    if ( mismatch ) {
+	fprintf( stderr, "%s: %d path%s changed since the last apply, "
+		 "run fsdiff instead\n", progname, mismatch,
+		 ( mismatch == 1 ) ? "" : "s" );
+	exit( 1 );
+    }
+
+    exit( 0 );
+}
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "argcargv.h"
+#include "base64.h"
+#include "digest.h"
+#include "code.h"
+#include "pathcmp.h"
+#include "tfile.h"
+#include "usageopt.h"
+
+int		case_sensitive = 1;
+int		debug = 0;
+char		*progname = "ltdigest";
+const EVP_MD	*md;
+extern char	*version, *checksumlist;
+
+/*
+ * exit codes:
+ *	0	Digests printed.
+ *	1	-p named a directory that isn't in the transcript.
+ *	2	An error occurred.
+ */
+
+/*
+ * Each directory's digest covers its own transcript line, the lines
+ * of the files directly in it, and the digests of its subdirectories,
+ * in transcript order.  Two transcripts with the same digest for a
+ * directory list the same subtree.  Lines that aren't in any directory
+ * listed in the transcript go into the digest of the transcript as a
+ * whole.  The digests are only printed; nothing stores or reads them.
+ */
+
+/* each level needs at least "/x" */
+#define LTD_MAXDEPTH	( MAXPATHLEN / 2 )
+
+struct ltd_level {
+    EVP_MD_CTX		*l_ctx;
+    filepath_t		l_path[ MAXPATHLEN ];
+    int			l_dir;		/* index into dirs[] */
+};
+
+struct ltd_dir {
+    char		*d_epath;	/* encoded, as in the transcript */
+    char		d_cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+};
+
+static struct ltd_level	*levels[ LTD_MAXDEPTH ];
+static struct ltd_dir	*dirs = NULL;
+static int		ndirs = 0;
+static int		maxdirs = 0;
+
+/* levels are kept and reused, each with its own digest context */
+    static struct ltd_level *
+ltd_level( int depth )
+{
+    struct ltd_level	*l;
+
+    if ( levels[ depth ] != NULL ) {
+	return( levels[ depth ] );
+    }
+    if (( l = malloc( sizeof( struct ltd_level ))) == NULL ) {
+	perror( "malloc" );
+	return( NULL );
+    }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (( l->l_ctx = malloc( sizeof( EVP_MD_CTX ))) != NULL ) {
+	EVP_MD_CTX_init( l->l_ctx );
+    }
+#else /* OPENSSL_VERSION_NUMBER */
+    l->l_ctx = EVP_MD_CTX_new();
+#endif /* OPENSSL_VERSION_NUMBER */
+    if ( l->l_ctx == NULL ) {
+	fprintf( stderr, "EVP_MD_CTX_new failed\n" );
+	free( l );
+	return( NULL );
+    }
+    return( levels[ depth ] = l );
+}
+
+    static void
+ltd_close( int depth )
+{
+    unsigned char	md_value[ EVP_MAX_MD_SIZE ];
+    unsigned int	md_len;
+
+    EVP_DigestFinal( levels[ depth ]->l_ctx, md_value, &md_len );
+    base64_e( md_value, md_len,
+	    dirs[ levels[ depth ]->l_dir ].d_cksum_b64 );
+    EVP_DigestUpdate( levels[ depth - 1 ]->l_ctx, md_value, md_len );
+}
+
+    static int
+ltd_push( int depth, const filepath_t *path, const char *epath )
+{
+    if ( depth >= LTD_MAXDEPTH ) {
+	fprintf( stderr, "%s: too deep\n", path );
+	return( -1 );
+    }
+    if ( ltd_level( depth ) == NULL ) {
+	return( -1 );
+    }
+    if ( ndirs >= maxdirs ) {
+	maxdirs = maxdirs ? maxdirs * 2 : 1024;
+	if (( dirs = realloc( dirs, maxdirs * sizeof( struct ltd_dir )))
+		== NULL ) {
+	    perror( "realloc" );
+	    return( -1 );
+	}
+    }
+    if (( dirs[ ndirs ].d_epath = strdup( epath )) == NULL ) {
+	perror( "strdup" );
+	return( -1 );
+    }
+    *dirs[ ndirs ].d_cksum_b64 = '\0';
+
+    EVP_DigestInit( levels[ depth ]->l_ctx, md );
+    filepath_ncpy( levels[ depth ]->l_path, path, MAXPATHLEN - 1 );
+    levels[ depth ]->l_dir = ndirs++;
+
+    return( 0 );
+}
+
+/*
+ * Digest every directory in tpath.  The digest of the transcript as a
+ * whole is returned in root_b64.
+ */
+    static int
+ltdigest( const char *tpath, char *root_b64 )
+{
+    tfile_t		*tf;
+    char		line[ 2 * MAXPATHLEN ];
+    char		**av;
+    filepath_t		path[ MAXPATHLEN ];
+    const char		*d_path;
+    unsigned char	md_value[ EVP_MAX_MD_SIZE ];
+    unsigned int	md_len;
+    int			ac, i, p, len, linenum = 0, depth = 0;
+
+    if (( tf = tfile_open( tpath )) == NULL ) {
+	perror( tpath );
+	return( -1 );
+    }
+
+    if ( ltd_level( 0 ) == NULL ) {
+	exit( 2 );
+    }
+    EVP_DigestInit( levels[ 0 ]->l_ctx, md );
+    *levels[ 0 ]->l_path = '\0';
+
+    while ( tfile_gets( line, sizeof( line ), tf ) != NULL ) {
+	linenum++;
+	len = strlen( line );
+	if ( line[ len - 1 ] != '\n' ) {
+	    fprintf( stderr, "%s: line %d: line too long\n", tpath, linenum );
+	    goto error;
+	}
+
+	if ((( ac = argcargv( line, &av )) == 0 ) || ( *av[ 0 ] == '#' )) {
+	    continue;
+	}
+
+	/* download markers say nothing about the subtree */
+	if ( strcmp( av[ 0 ], "+" ) == 0 ) {
+	    av++;
+	    ac--;
+	}
+	p = ( strcmp( av[ 0 ], "-" ) == 0 ) ? 2 : 1;
+	if ( ac < p + 2 ) {
+	    fprintf( stderr, "%s: line %d: minimum 3 arguments, got %d\n",
+		    tpath, linenum, ac );
+	    goto error;
+	}
+
+	if (( d_path = decode( av[ p ] )) == NULL ) {
+	    fprintf( stderr, "%s: line %d: path decoding failed\n",
+		    tpath, linenum );
+	    goto error;
+	}
+	filepath_ncpy( path, (filepath_t *) d_path, sizeof( path ) - 1 );
+
+	while (( depth > 0 ) && !ischildcase( path,
+		levels[ depth ]->l_path, case_sensitive )) {
+	    ltd_close( depth-- );
+	}
+
+	if (( p == 1 ) && ( *av[ 0 ] == 'd' )) {
+	    if ( ltd_push( ++depth, path, av[ p ] ) != 0 ) {
+		goto error;
+	    }
+	}
+
+	/* canonical form: fields separated by single spaces */
+	for ( i = 0; i < ac; i++ ) {
+	    EVP_DigestUpdate( levels[ depth ]->l_ctx, av[ i ],
+		    strlen( av[ i ] ));
+	    EVP_DigestUpdate( levels[ depth ]->l_ctx,
+		    ( i < ac - 1 ) ? " " : "\n", 1 );
+	}
+    }
+
+    if ( tfile_error( tf )) {
+	fprintf( stderr, "%s: read error, transcript corrupt or truncated\n",
+		tpath );
+	goto error;
+    }
+    tfile_close( tf );
+
+    while ( depth > 0 ) {
+	ltd_close( depth-- );
+    }
+    EVP_DigestFinal( levels[ 0 ]->l_ctx, md_value, &md_len );
+    base64_e( md_value, md_len, root_b64 );
+
+    return( 0 );
+
+error:
+    tfile_close( tf );
+    return( -1 );
+}
+
+
+extern char *optarg;
+extern int optind, opterr, optopt;
+
+/*
+ * Command-line options
+ *
+ * Formerly getopt - "c:dHIp:V"
+ */
+
+static const usageopt_t main_usage[] =
+  {
+    { (struct option) { "checksum",     required_argument, NULL, 'c' },
+      "specify checksum type, by default sha1",  "checksum-type: [sha1,etc]" },
+
+    { (struct option) { "debug", no_argument, NULL, 'd'},
+      		"Raise debugging level to see what's happening", NULL},
+
+    { (struct option) { "help",         no_argument,       NULL, 'H' },
+     		"This message", NULL },
+
+    { (struct option) { "case-insensitive", no_argument,   NULL, 'I' },
+     		"case insensitive when comparing paths", NULL },
+
+    { (struct option) { "path",         required_argument, NULL, 'p' },
+     		"print only the digest of the subtree at <path>", "path" },
+
+    { (struct option) { "version",      no_argument,       NULL, 'V' },
+     		"show version number, a list of supported checksumming algorithms in descending order of preference and exits", NULL },
+
+    /* End of list */
+    { (struct option) {(char *) NULL, 0, (int *) NULL, 0}, (char *) NULL, (char *) NULL}
+  }; /* end of main_usage[] */
+
+    int
+main( int argc, char **argv )
+{
+    int			c, i, err = 0, rc = 0;
+    int			optndx = 0;
+    char		*subtree = NULL;
+    const char		*epath;
+    char		root_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    struct option      *main_opts;
+    char               *main_optstr;
+
+    /* Get our name from argv[0] */
+    for (main_optstr = argv[0]; *main_optstr; main_optstr++) {
+        if (*main_optstr == '/')
+	    progname = main_optstr+1;
+    }
+
+    OpenSSL_add_all_digests();
+    md = digest_byname( "sha1" );
+
+    main_opts = usageopt_option_new (main_usage, &main_optstr);
+
+    while (( c = getopt_long (argc, argv, main_optstr, main_opts, &optndx)) != -1) {
+	switch( c ) {
+	case 'c':
+	    if (( md = digest_byname( optarg )) == NULL ) {
+		fprintf( stderr, "%s: unsupported checksum\n", optarg );
+		exit( 2 );
+	    }
+	    break;
+
+	case 'd':
+	    debug++;
+	    break;
+
+	case 'I':
+	    case_sensitive = 0;
+	    break;
+
+	case 'p':
+	    subtree = optarg;
+	    break;
+
+	case 'V':
+	    printf( "%s\n", version );
+	    printf( "%s\n", checksumlist );
+	    exit( 0 );
+
+	case 'H':  /* --help */
+	  usageopt_usage (stdout, 1 /* verbose */, progname,  main_usage,
+			  "transcript ...", 80);
+	  exit (0);
+
+	default:
+	    err++;
+	    break;
+	}
+    }
+
+    if ( md == NULL ) {
+	fprintf( stderr, "%s: sha1 unsupported, use -c\n", progname );
+	exit( 2 );
+    }
+
+    if (( subtree != NULL ) && ( argc - optind != 1 )) {
+	err++;
+    }
+
+    if ( err || ( argc - optind < 1 )) {
+	usageopt_usage (stderr, 0 /* not verbose */, progname,  main_usage,
+			"transcript ...", 80);
+	fprintf (stderr, "%s: Use --help to get more verbose usage\n",
+		 progname);
+	exit( 2 );
+    }
+
+    for ( ; optind < argc; optind++ ) {
+	ndirs = 0;
+	if ( ltdigest( argv[ optind ], root_b64 ) != 0 ) {
+	    exit( 2 );
+	}
+
+	if ( subtree != NULL ) {
+	    if (( epath = encode( subtree )) == NULL ) {
+		fprintf( stderr, "%s: path too long\n", subtree );
+		exit( 2 );
+	    }
+	    rc = 1;
+	    for ( i = 0; i < ndirs; i++ ) {
+		if (( case_sensitive ? strcmp( dirs[ i ].d_epath, epath ) :
+			strcasecmp( dirs[ i ].d_epath, epath )) == 0 ) {
+		    printf( "%s\n", dirs[ i ].d_cksum_b64 );
+		    rc = 0;
+		    break;
+		}
+	    }
+	} else {
+	    printf( "%s:\t%s\n", argv[ optind ], root_b64 );
+	    for ( i = 0; i < ndirs; i++ ) {
+		printf( "%-37s\t%s\n", dirs[ i ].d_epath,
+			dirs[ i ].d_cksum_b64 );
+	    }
+	}
+
+	for ( i = 0; i < ndirs; i++ ) {
+	    free( dirs[ i ].d_epath );
+	}
+    }
+
+    exit( rc );
+}
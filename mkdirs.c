@@ -37,7 +37,8 @@ mkdirs( const filepath_t *path )
 	    *q = '/';
 	}
 
-	if ( mkdir( tmp_path, 0777 ) == 0 ) {
+	/* made meanwhile by someone else is as good */
+	if (( mkdir( tmp_path, 0777 ) == 0 ) || ( errno == EEXIST )) {
 	    break;
 	}
 	if ( errno != ENOENT ) {
@@ -17,6 +17,7 @@
 #include "code.h"
 #include "largefile.h"
 #include "progress.h"
+#include "tfile.h"
 
 int		progress = -1;
 int		showprogress = 0;
@@ -111,7 +112,7 @@ applyloadsetsize( FILE *tran )
 }
 
     off_t
-lcksum_loadsetsize( FILE *tran, const char *prefix )
+lcksum_loadsetsize( tfile_t *tran, const char *prefix )
 {
     char	tline[ LINE_MAX ], line[ LINE_MAX ];
     const char	*d_path = NULL;
@@ -119,7 +120,7 @@ lcksum_loadsetsize( FILE *tran, const char *prefix )
     int		tac, linenum = 0;
     off_t	size = 0;
 
-    while ( fgets( tline, LINE_MAX, tran ) != NULL ) {
+    while ( tfile_gets( tline, LINE_MAX, tran ) != NULL ) {
 	linenum++;
 	strcpy( line, tline );
 	targv = (char **) NULL;  /* Safety */
@@ -149,7 +150,7 @@ lcksum_loadsetsize( FILE *tran, const char *prefix )
 	}
     }
 	
-    rewind( tran );
+    tfile_rewind( tran );
     return( size );
 }
 
@@ -7,13 +7,14 @@
 #  define _RADMIND_PROGRESS_H "$Id$"
 
 #  include "filepath.h"
+#  include "tfile.h"
 
 #define PROGRESSUNIT	1024
 
 extern void   linecheck( char *line, int ac, int linenum );
 extern off_t  loadsetsize( FILE *tran );
 extern off_t  applyloadsetsize( FILE *tran );
-extern off_t  lcksum_loadsetsize( FILE *tran, const char *prefix );
+extern off_t  lcksum_loadsetsize( tfile_t *tran, const char *prefix );
 extern void   progressupdate( ssize_t bytes, const filepath_t *path );
 
 extern int    showprogress;
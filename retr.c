@@ -5,10 +5,16 @@
 
 #include "config.h"
 
+/* fallocate() and splice() */
+#if defined(HAVE_FALLOCATE) || defined(HAVE_SPLICE)
+#define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <sys/time.h>
+#include <sys/select.h>
 #ifdef __APPLE__
 #include <sys/attr.h>
 #include <sys/paths.h>
@@ -32,7 +38,9 @@
 #include <snet.h>
 
 #include "applefile.h"
+#include "cache.h"
 #include "connect.h"
+#include "delta.h"
 #include "cksum.h"
 #include "base64.h"
 #include "code.h"
@@ -49,6 +57,463 @@ extern int		errno;
 extern int		create_prefix;
 extern SSL_CTX  	*ctx;
 
+/*
+ * RETRs sent ahead of the retr() that reads their reply.  The server
+ * answers in the order asked, so retr() for the oldest one has nothing
+ * to send.  If a caller ever asks out of that order, the replies are
+ * read and thrown away, and no more are sent ahead.  A DELT is queued
+ * the same way, but only when nothing else is: its signatures can be
+ * larger than the socket buffers, and writing them while the server
+ * waits to send earlier replies would leave each side waiting on the
+ * other.
+ */
+typedef struct retr_ahead_s retr_ahead_t;
+
+struct retr_ahead_s {
+    retr_ahead_t	*ra_next;
+    char		*ra_request;
+    int			ra_delta;
+};
+
+static retr_ahead_t	*ahead_head = NULL;
+static retr_ahead_t	**ahead_tail = &ahead_head;
+static int		ahead_count = 0;
+static int		ahead_broken = 0;
+
+/* set to leave the temp file of a transfer that fails part way */
+int			retr_partial = 0;
+
+static int		retr_skip( SNET *sn );
+static int		retr_request( SNET *sn, const char *request, int fd,
+			    off_t oldsize );
+
+/* the whole of len bytes, or -1 */
+    static int
+retr_read( SNET *sn, char *buf, size_t len )
+{
+    struct timeval	tv;
+    ssize_t		rr;
+
+    for ( ; len > 0; len -= rr, buf += rr ) {
+	tv = timeout;
+	if (( rr = snet_read( sn, buf, len, &tv )) <= 0 ) {
+	    return( -1 );
+	}
+    }
+    return( 0 );
+}
+
+/* send a signature for each block of the copy open on fd */
+    static int
+delta_sigs( SNET *sn, int fd, off_t oldsize )
+{
+    struct timeval	tv;
+    unsigned char	*buf;
+    unsigned char	sig[ DELTA_SIG_LEN ];
+    unsigned int	weak;
+    int			blocksize;
+    off_t		off;
+    ssize_t		rr;
+
+    blocksize = delta_blocksize( oldsize );
+    if (( buf = malloc( blocksize )) == NULL ) {
+	perror( "malloc" );
+	return( -1 );
+    }
+    for ( off = 0; off < oldsize; off += rr ) {
+	if (( rr = pread( fd, buf, MIN( blocksize, oldsize - off ),
+		off )) <= 0 ) {
+	    /* shrunk since we looked, the server will be sent zeros */
+	    memset( buf, 0, blocksize );
+	    rr = MIN( blocksize, oldsize - off );
+	}
+	weak = delta_weak( buf, rr );
+	sig[ 0 ] = ( weak >> 24 ) & 0xff;
+	sig[ 1 ] = ( weak >> 16 ) & 0xff;
+	sig[ 2 ] = ( weak >> 8 ) & 0xff;
+	sig[ 3 ] = weak & 0xff;
+	delta_strong( buf, rr, sig + DELTA_WEAK_LEN );
+	tv = timeout;
+	if ( snet_write( sn, (char *)sig, sizeof( sig ), &tv )
+		!= sizeof( sig )) {
+	    free( buf );
+	    return( -1 );
+	}
+    }
+    free( buf );
+    return( 0 );
+}
+
+    static int
+queue_request( SNET *sn, const char *request, int fd, off_t oldsize )
+{
+    retr_ahead_t	*ra;
+
+    if ((( ra = malloc( sizeof( retr_ahead_t ))) == NULL ) ||
+	    (( ra->ra_request = strdup( request )) == NULL )) {
+	perror( "retr_ahead: malloc" );
+	return( -1 );
+    }
+    ra->ra_delta = ( fd >= 0 );
+
+    if ( verbose ) printf( ">>> %s\n", request );
+    if (( snet_writef( sn, "%s\n", request ) < 0 ) ||
+	    ( ra->ra_delta && ( delta_sigs( sn, fd, oldsize ) != 0 ))) {
+	fprintf( stderr, "%s failed: 1-%s\n", request, strerror( errno ));
+	free( ra->ra_request );
+	free( ra );
+	return( -1 );
+    }
+
+    ra->ra_next = NULL;
+    *ahead_tail = ra;
+    ahead_tail = &ra->ra_next;
+    ahead_count++;
+
+    return( 0 );
+}
+
+/*
+ * Return Value:
+ *	-1 - error, do not call closesn
+ *	 0 - OKAY, or not sent
+ */
+    int
+retr_ahead( SNET *sn, const filepath_t *pathdesc )
+{
+    char		request[ 2 * MAXPATHLEN + 64 ];
+
+    if ( ahead_broken ) {
+	return( 0 );
+    }
+    if ( snprintf( request, sizeof( request ), "RETR %s",
+	    (const char *) pathdesc ) >= sizeof( request )) {
+	return( 0 );
+    }
+    return( queue_request( sn, request, -1, 0 ));
+}
+
+/*
+ * As retr_ahead(), for a retr_delta() against the copy at path.
+ *
+ * Return Value:
+ *	-1 - error, do not call closesn
+ *	 0 - OKAY, or nothing more is sent ahead
+ *	 1 - not sent, send nothing more ahead until retr_delta() has
+ *	     been called for it
+ */
+    int
+delta_ahead( SNET *sn, const filepath_t *pathdesc, const filepath_t *path )
+{
+    struct stat		st;
+    char		request[ 2 * MAXPATHLEN + 64 ];
+    int			fd, rc;
+
+    if ( ahead_broken ) {
+	return( 0 );
+    }
+    if ( ahead_head != NULL ) {
+	return( 1 );
+    }
+    if (( fd = open( (const char *) path, O_RDONLY, 0 )) < 0 ) {
+	return( 1 );
+    }
+    if (( fstat( fd, &st ) != 0 ) || !S_ISREG( st.st_mode ) ||
+	    ( st.st_size <= 0 ) ||
+	    ( snprintf( request, sizeof( request ), "DELT %" PRIofft " %d %s",
+	    st.st_size, delta_blocksize( st.st_size ),
+	    (const char *) pathdesc ) >= sizeof( request ))) {
+	close( fd );
+	return( 1 );
+    }
+    rc = queue_request( sn, request, fd, st.st_size );
+    close( fd );
+    return( rc );
+}
+
+/* as retr_ahead(), for retr_range() */
+    int
+range_ahead( SNET *sn, const filepath_t *pathdesc, off_t offset,
+	off_t length )
+{
+    char		request[ 2 * MAXPATHLEN + 64 ];
+
+    if ( ahead_broken ) {
+	return( 0 );
+    }
+    if ( snprintf( request, sizeof( request ), "RETR %s %" PRIofft
+	    " %" PRIofft, (const char *) pathdesc, offset, length )
+	    >= sizeof( request )) {
+	return( 0 );
+    }
+    return( queue_request( sn, request, -1, 0 ));
+}
+
+    int
+retr_ahead_pending( void )
+{
+    return( ahead_count );
+}
+
+    static void
+retr_ahead_pop( void )
+{
+    retr_ahead_t	*ra;
+
+    ra = ahead_head;
+    if (( ahead_head = ra->ra_next ) == NULL ) {
+	ahead_tail = &ahead_head;
+    }
+    ahead_count--;
+    free( ra->ra_request );
+    free( ra );
+}
+
+/* read past the instructions of a DELT reply */
+    static int
+delta_skip( SNET *sn )
+{
+    unsigned char	op[ 9 ];
+    char		buf[ 8192 ];
+    off_t		len;
+    size_t		n;
+
+    for ( ;; ) {
+	if ( retr_read( sn, (char *)op, 1 ) != 0 ) {
+	    return( -1 );
+	}
+	switch ( op[ 0 ] ) {
+	case DELTA_END:
+	    return( 0 );
+
+	case DELTA_COPY:
+	    if ( retr_read( sn, (char *)op + 1, 8 ) != 0 ) {
+		return( -1 );
+	    }
+	    break;
+
+	case DELTA_LITERAL:
+	    if ( retr_read( sn, (char *)op + 1, 4 ) != 0 ) {
+		return( -1 );
+	    }
+	    len = ( op[ 1 ] << 24 ) | ( op[ 2 ] << 16 ) | ( op[ 3 ] << 8 ) |
+		    op[ 4 ];
+	    for ( ; len > 0; len -= n ) {
+		n = MIN( sizeof( buf ), len );
+		if ( retr_read( sn, buf, n ) != 0 ) {
+		    return( -1 );
+		}
+	    }
+	    break;
+
+	default:
+	    errno = EPROTO;
+	    return( -1 );
+	}
+    }
+}
+
+/* read and discard the reply to the oldest RETR sent ahead */
+    static int
+retr_skip( SNET *sn )
+{
+    struct timeval	tv;
+    char		*line;
+    char		buf[ 8192 ];
+    off_t		size;
+    ssize_t		rr;
+
+    tv = timeout;
+    if (( line = snet_getline_multi( sn, logger, &tv )) == NULL ) {
+	fprintf( stderr, "%s failed: 2-%s\n",
+	    ahead_head->ra_request, strerror( errno ));
+	return( -1 );
+    }
+    if ( *line != '2' ) {
+	retr_ahead_pop( );
+	return( 0 );
+    }
+
+    tv = timeout;
+    if (( line = snet_getline( sn, &tv )) == NULL ) {
+	fprintf( stderr, "%s failed: 3-%s\n",
+	    ahead_head->ra_request, strerror( errno ));
+	return( -1 );
+    }
+    if ( ahead_head->ra_delta ) {
+	if ( delta_skip( sn ) != 0 ) {
+	    fprintf( stderr, "%s failed: 4-%s\n",
+		ahead_head->ra_request, strerror( errno ));
+	    return( -1 );
+	}
+    } else {
+	for ( size = strtoofft( line, NULL, 10 ); size > 0; size -= rr ) {
+	    tv = timeout;
+	    if (( rr = snet_read( sn, buf, MIN( sizeof( buf ), size ),
+		    &tv )) <= 0 ) {
+		fprintf( stderr, "%s failed: 4-%s\n",
+		    ahead_head->ra_request, strerror( errno ));
+		return( -1 );
+	    }
+	}
+    }
+
+    tv = timeout;
+    if ((( line = snet_getline( sn, &tv )) == NULL ) ||
+	    ( strcmp( line, "." ) != 0 )) {
+	fprintf( stderr, "%s failed: 5-%s\n",
+	    ahead_head->ra_request, strerror( errno ));
+	return( -1 );
+    }
+
+    retr_ahead_pop( );
+    return( 0 );
+}
+
+/* read the replies to any RETRs still outstanding */
+    int
+retr_ahead_drain( SNET *sn )
+{
+    while ( ahead_head != NULL ) {
+	if ( retr_skip( sn ) != 0 ) {
+	    return( -1 );
+	}
+    }
+    return( 0 );
+}
+
+/* whether the oldest request sent ahead, if any, is request */
+    static int
+retr_ahead_sent( const char *request )
+{
+    return(( ahead_head != NULL ) &&
+	    ( strcmp( ahead_head->ra_request, request ) == 0 ));
+}
+
+/*
+ * Make sure the next reply is for request.  A DELT also sends the
+ * signatures of the copy open on fd.
+ */
+    static int
+retr_request( SNET *sn, const char *request, int fd, off_t oldsize )
+{
+    if ( ahead_head != NULL ) {
+	if ( strcmp( ahead_head->ra_request, request ) == 0 ) {
+	    retr_ahead_pop( );
+	    return( 0 );
+	}
+	if ( verbose ) printf( "%s: retrieved out of order\n", request );
+	ahead_broken = 1;
+	if ( retr_ahead_drain( sn ) != 0 ) {
+	    return( -1 );
+	}
+    }
+
+    if ( verbose ) printf( ">>> %s\n", request );
+    if ( snet_writef( sn, "%s\n", request ) < 0 ) {
+	return( -1 );
+    }
+    if (( fd >= 0 ) && ( delta_sigs( sn, fd, oldsize ) != 0 )) {
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * The temp file retr() writes path to, creating missing parents if
+ * asked to.
+ */
+    static int
+retr_open_temp( const filepath_t *path, filepath_t *temppath, int flags,
+	mode_t tempmode )
+{
+    int			fd;
+
+    if ( snprintf( (char *) temppath, MAXPATHLEN, "%s.radmind.%i",
+		   (const char *) path, getpid()) >= MAXPATHLEN ) {
+        fprintf( stderr, "%s.radmind.%i: too long", (const char *)path,
+		 (int)getpid());
+	return( -1 );
+    }
+    if (( fd = open( (char *) temppath, flags | O_CREAT, tempmode )) < 0 ) {
+	if ( create_prefix && errno == ENOENT ) {
+	    errno = 0;
+	    if ( mkprefix( temppath ) != 0 ) {
+	        perror( (char *) temppath );
+		return( -1 );
+	    }
+	    if (( fd = open( (char *) temppath, flags | O_CREAT,
+		    tempmode )) < 0 ) {
+	        perror( (char *) temppath );
+		return( -1 );
+	    }
+	} else {
+	    perror( (char *) temppath );
+	    return( -1 );
+	}
+    }
+    return( fd );
+}
+
+/*
+ * Files are received in large pieces, and with neither TLS nor zlib in
+ * the way and no check sum to compute, moved from the socket to the
+ * temp file without passing through user space at all.
+ */
+#define RETR_BUFSIZE	( 256 * 1024 )
+
+static char		retr_buf[ RETR_BUFSIZE ];
+
+#ifdef HAVE_SPLICE
+static int		retr_pipe[ 2 ] = { -1, -1 };
+
+/*
+ * Like snet_read(), but the data goes to fd.  Only for use when snet
+ * has nothing buffered.
+ */
+    static ssize_t
+retr_splice( SNET *sn, int fd, size_t len, struct timeval *tv )
+{
+    fd_set		fdset;
+    ssize_t		rr, wr, moved;
+
+    if (( retr_pipe[ 0 ] < 0 ) && ( pipe( retr_pipe ) != 0 )) {
+	return( -1 );
+    }
+
+    FD_ZERO( &fdset );
+    FD_SET( snet_fd( sn ), &fdset );
+    if (( rr = select( snet_fd( sn ) + 1, &fdset, NULL, NULL, tv )) <= 0 ) {
+	if ( rr == 0 ) {
+	    errno = ETIMEDOUT;
+	}
+	return( -1 );
+    }
+
+    /* a pipe holds at least 64k */
+    if (( rr = splice( snet_fd( sn ), NULL, retr_pipe[ 1 ], NULL,
+	    MIN( len, 65536 ), SPLICE_F_MOVE )) <= 0 ) {
+	return( rr );
+    }
+
+    for ( moved = 0; moved < rr; moved += wr ) {
+	if (( wr = splice( retr_pipe[ 0 ], NULL, fd, NULL, rr - moved,
+		SPLICE_F_MOVE )) > 0 ) {
+	    continue;
+	}
+	/* filesystems that can't take a splice get a copy */
+	if (( wr = read( retr_pipe[ 0 ], retr_buf,
+		MIN( sizeof( retr_buf ), rr - moved ))) <= 0 ) {
+	    return( -1 );
+	}
+	if ( write( fd, retr_buf, (size_t)wr ) != wr ) {
+	    return( -1 );
+	}
+    }
+    return( rr );
+}
+#endif /* HAVE_SPLICE */
+
 /*
  * Download requests path from sn and writes it to disk.  The path to
  * this new file is returned via temppath which must be 2 * MAXPATHLEN.
@@ -69,13 +534,14 @@ retr( SNET *sn, const filepath_t *pathdesc, const filepath_t *path,
     int			fd;
     unsigned int	md_len;
     int			returnval = -1;
-    off_t		size = 0;
-    char		buf[ 8192 ]; 
+    off_t		size = 0, got = 0;
     ssize_t		rr;
+    int			zerocopy = 0, first = 1;
     extern EVP_MD	*md;
     EVP_MD_CTX		mdctx;
     unsigned char	md_value[ EVP_MAX_MD_SIZE ];
     char		cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    char		request[ 2 * MAXPATHLEN + 64 ];
 
     if ( cksum ) {
 	if ( strcmp( trancksum, "-" ) == 0 ) {
@@ -83,11 +549,33 @@ retr( SNET *sn, const filepath_t *pathdesc, const filepath_t *path,
 	    fprintf( stderr, "%s\n", pathdesc );
 	    return( 1 );
 	}
+
+    }
+    if ( snprintf( request, sizeof( request ), "RETR %s",
+	    (const char *) pathdesc ) >= sizeof( request )) {
+	fprintf( stderr, "retrieve %s failed: 1-%s\n", pathdesc,
+	    strerror( ENAMETOOLONG ));
+	return( -1 );
+    }
+
+    if ( cksum ) {
+	/*
+	 * Nothing to send if a copy is already here.  A reply already on
+	 * its way is read instead, or the requests sent after it would
+	 * be out of order.
+	 */
+	if ( !retr_ahead_sent( request ) && ( cache_retr( path, temppath,
+		tempmode, transize, trancksum ) == 0 )) {
+	    if ( verbose ) printf( "%s: from cache\n", pathdesc );
+	    if ( showprogress ) {
+		progressupdate( (ssize_t)transize, path );
+	    }
+	    return( 0 );
+	}
 	EVP_DigestInit( &mdctx, md );
     }
 
-    if ( verbose ) printf( ">>> RETR %s\n", pathdesc );
-    if ( snet_writef( sn, "RETR %s\n", (const char *) pathdesc ) < 0 ) {
+    if ( retr_request( sn, request, -1, 0 ) != 0 ) {
 	fprintf( stderr, "retrieve %s failed: 1-%s\n", pathdesc,
 	    strerror( errno ));
 	return( -1 );
@@ -121,51 +609,57 @@ retr( SNET *sn, const filepath_t *pathdesc, const filepath_t *path,
 	return( -1 );
     }
 
-    /*Create temp file name*/
-    if ( snprintf( (char *) temppath, MAXPATHLEN, "%s.radmind.%i",
-		   (const char *) path, getpid()) >= MAXPATHLEN ) {
-        fprintf( stderr, "%s.radmind.%i: too long", (const char *)path,
-		 (int)getpid());
+    if (( fd = retr_open_temp( path, temppath, O_WRONLY, tempmode )) < 0 ) {
 	return( -1 );
     }
-    /* Open file */
-    if (( fd = open( (char *) temppath, O_WRONLY | O_CREAT, tempmode )) < 0 ) {
-	if ( create_prefix && errno == ENOENT ) {
-	    errno = 0;
-	    if ( mkprefix( temppath ) != 0 ) {
-	        perror( (char *) temppath );
-		return( -1 );
-	    }
-	    if (( fd = open( (char *) temppath, O_WRONLY | O_CREAT, tempmode )) < 0 ) {
-	        perror( (char *) temppath );
-		return( -1 );
-	    }
-	} else {
-	    perror( (char *) temppath );
-	    return( -1 );
-	}
+#ifdef HAVE_FALLOCATE
+    /* best effort, the file is written in full either way */
+    if ( size > 0 ) {
+	(void)fallocate( fd, 0, 0, size );
     }
+#endif /* HAVE_FALLOCATE */
+#ifdef HAVE_SPLICE
+    if ( !cksum && !( snet_flags( sn ) & ( SNET_TLS | SNET_ZLIB ))) {
+	zerocopy = 1;
+    }
+#endif /* HAVE_SPLICE */
 
     if ( verbose ) printf( "<<< " );
 
     /* Get file from server */
     while ( size > 0 ) {
 	tv = timeout;
-	if (( rr = snet_read( sn, buf, MIN( sizeof( buf ), size ),
-		&tv )) <= 0 ) {
-	    fprintf( stderr, "retrieve %s failed: 4-%s\n", pathdesc,
-		strerror( errno ));
-	    returnval = -1;
-	    goto error2;
-	}
-	if ( write( fd, buf, (size_t)rr ) != rr ) {
-	    perror( (char *) temppath );
-	    returnval = -1;
-	    goto error2;
-	}
-	if ( cksum ) {
-	    EVP_DigestUpdate( &mdctx, buf, (unsigned int)rr );
+#ifdef HAVE_SPLICE
+	/* snet_read() first, it handles what snet_getline() left */
+	if ( zerocopy && !first && !snet_hasdata( sn )) {
+	    if (( rr = retr_splice( sn, fd, MIN( RETR_BUFSIZE, size ),
+		    &tv )) <= 0 ) {
+		fprintf( stderr, "retrieve %s failed: 4-%s\n", pathdesc,
+		    strerror( errno ));
+		returnval = -1;
+		goto partial;
+	    }
+	} else
+#endif /* HAVE_SPLICE */
+	{
+	    if (( rr = snet_read( sn, retr_buf,
+		    MIN( sizeof( retr_buf ), size ), &tv )) <= 0 ) {
+		fprintf( stderr, "retrieve %s failed: 4-%s\n", pathdesc,
+		    strerror( errno ));
+		returnval = -1;
+		goto partial;
+	    }
+	    if ( write( fd, retr_buf, (size_t)rr ) != rr ) {
+		perror( (char *) temppath );
+		returnval = -1;
+		goto error2;
+	    }
+	    if ( cksum ) {
+		EVP_DigestUpdate( &mdctx, retr_buf, (unsigned int)rr );
+	    }
 	}
+	first = 0;
+	got += rr;
 	if ( dodots ) { putc( '.', stdout ); fflush( stdout ); }
 	size -= rr;
 	if ( showprogress ) {
@@ -209,6 +703,12 @@ retr( SNET *sn, const filepath_t *pathdesc, const filepath_t *path,
 
     return( 0 );
 
+partial:
+    /* what arrived is kept for lapply to pick up from next time */
+    if ( retr_partial && ( got > 0 ) && ( ftruncate( fd, got ) == 0 )) {
+	close( fd );
+	return( returnval );
+    }
 error2:
     close( fd );
 error1:
@@ -216,6 +716,390 @@ error1:
     return( returnval );
 }
 
+
+/*
+ * Retrieve length bytes of pathdesc from offset on, with a server that
+ * offers RANGE, and write them at the same offset in fd.  Checking the
+ * file is left to the caller, once it has all of it.  If written isn't
+ * NULL, it's set to the number of bytes written to fd.
+ *
+ * Return Value:
+ *	-1 - error, do not call closesn
+ *	 0 - OKAY
+ *	 1 - error, call closesn
+ */
+    int
+retr_range( SNET *sn, const filepath_t *pathdesc, int fd, off_t offset,
+	off_t length, off_t *written )
+{
+    struct timeval	tv;
+    char		*line;
+    char		request[ 2 * MAXPATHLEN + 64 ];
+    off_t		size;
+    ssize_t		rr;
+
+    if ( written != NULL ) {
+	*written = 0;
+    }
+    if (( snprintf( request, sizeof( request ), "RETR %s %" PRIofft
+	    " %" PRIofft, (const char *) pathdesc, offset, length )
+	    >= sizeof( request )) ||
+	    ( retr_request( sn, request, -1, 0 ) != 0 )) {
+	fprintf( stderr, "retrieve %s failed: 1-%s\n", pathdesc,
+	    strerror( errno ));
+	return( -1 );
+    }
+
+    tv = timeout;
+    if (( line = snet_getline_multi( sn, logger, &tv )) == NULL ) {
+	fprintf( stderr, "retrieve %s failed: 2-%s\n", pathdesc,
+	    strerror( errno ));
+	return( -1 );
+    }
+    if ( *line != '2' ) {
+	fprintf( stderr, "%s\n", line );
+	return( 1 );
+    }
+
+    tv = timeout;
+    if (( line = snet_getline( sn, &tv )) == NULL ) {
+	fprintf( stderr, "retrieve %s failed: 3-%s\n", pathdesc,
+	    strerror( errno ));
+	return( -1 );
+    }
+    size = strtoofft( line, NULL, 10 );
+    if ( verbose ) printf( "<<< %" PRIofft "\n", size );
+    /* the file is no longer the size the transcript says */
+    if ( size != length ) {
+	fprintf( stderr, "line %d: size in transcript does not match size "
+	    "from server\n", linenum );
+	fprintf( stderr, "%s\n", pathdesc );
+	return( -1 );
+    }
+
+    if ( verbose ) printf( "<<< " );
+    while ( size > 0 ) {
+	tv = timeout;
+	if (( rr = snet_read( sn, retr_buf, MIN( sizeof( retr_buf ), size ),
+		&tv )) <= 0 ) {
+	    fprintf( stderr, "retrieve %s failed: 4-%s\n", pathdesc,
+		strerror( errno ));
+	    return( -1 );
+	}
+	if ( pwrite( fd, retr_buf, (size_t)rr, offset ) != rr ) {
+	    perror( (const char *) pathdesc );
+	    return( -1 );
+	}
+	offset += rr;
+	size -= rr;
+	if ( written != NULL ) {
+	    *written += rr;
+	}
+	if ( dodots ) { putc( '.', stdout ); fflush( stdout ); }
+    }
+    if ( verbose ) printf( "\n" );
+
+    tv = timeout;
+    if (( line = snet_getline( sn, &tv )) == NULL ) {
+	fprintf( stderr, "retrieve %s failed: 5-%s\n", pathdesc,
+	    strerror( errno ));
+	return( -1 );
+    }
+    if ( strcmp( line, "." ) != 0 ) {
+	fprintf( stderr, "%s", line );
+	fprintf( stderr, "%s\n", pathdesc );
+	return( -1 );
+    }
+    if ( verbose ) printf( "<<< .\n" );
+
+    return( 0 );
+}
+
+/*
+ * Carry on with partial, what an earlier run received of pathdesc, by
+ * asking for only the rest.  It's renamed to temppath first, so that
+ * if this is cut short too what has arrived is kept in the same way.
+ *
+ * Return Value:
+ *	-1 - error, do not call closesn
+ *	 0 - OKAY
+ *	 1 - error, call closesn
+ *	 2 - not done, use retr()
+ */
+    int
+retr_resume( SNET *sn, const filepath_t *pathdesc, const filepath_t *path,
+	const filepath_t *partial, filepath_t *temppath, mode_t tempmode,
+	off_t transize, const char *trancksum )
+{
+    struct stat		st;
+    char		cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    off_t		got;
+    int			fd, rc;
+
+    if (( lstat( (const char *) partial, &st ) != 0 ) ||
+	    !S_ISREG( st.st_mode ) || ( st.st_size <= 0 ) ||
+	    ( st.st_size >= transize )) {
+	return( 2 );
+    }
+    got = st.st_size;
+    if ( cksum && ( strcmp( trancksum, "-" ) == 0 )) {
+	return( 2 );
+    }
+
+    if ( snprintf( (char *) temppath, MAXPATHLEN, "%s.radmind.%i",
+	    (const char *) path, getpid()) >= MAXPATHLEN ) {
+	return( 2 );
+    }
+    if (( strcmp( (const char *) partial, (const char *) temppath ) != 0 ) &&
+	    ( rename( (const char *) partial, (char *) temppath ) != 0 )) {
+	return( 2 );
+    }
+    if (( fd = open( (char *) temppath, O_RDWR, tempmode )) < 0 ) {
+	perror( (char *) temppath );
+	unlink( (char *) temppath );
+	return( 2 );
+    }
+
+    if (( rc = retr_range( sn, pathdesc, fd, got, transize - got,
+	    NULL )) != 0 ) {
+	close( fd );
+	if (( rc != -1 ) || !retr_partial ) {
+	    unlink( (char *) temppath );
+	}
+	return( rc );
+    }
+
+    if ( cksum ) {
+	if (( lseek( fd, 0, SEEK_SET ) != 0 ) ||
+		( do_fcksum( fd, cksum_b64 ) != transize ) ||
+		( strcmp( trancksum, cksum_b64 ) != 0 )) {
+	    if ( verbose ) printf( "%s: resumed file did not check sum\n",
+		    pathdesc );
+	    close( fd );
+	    unlink( (char *) temppath );
+	    return( 2 );
+	}
+    }
+    if ( close( fd ) != 0 ) {
+	perror( (char *) temppath );
+	unlink( (char *) temppath );
+	return( -1 );
+    }
+
+    if ( verbose ) printf( "%s: resumed at %" PRIofft " of %" PRIofft
+	    " bytes\n", pathdesc, got, transize );
+    if ( showprogress ) {
+	progressupdate( (ssize_t)transize, path );
+    }
+    return( 0 );
+}
+
+/*
+ * As retr(), but the server is sent signatures of the copy at base,
+ * usually path itself, and answers with only what differs.  A result
+ * that doesn't check sum as the transcript says is thrown away.
+ *
+ * Return Value:
+ *	-1 - error, do not call closesn
+ *	 0 - OKAY
+ *	 1 - error, call closesn
+ *	 2 - not done, use retr()
+ */
+    int
+retr_delta( SNET *sn, const filepath_t *pathdesc, const filepath_t *path,
+	const filepath_t *base, filepath_t *temppath, mode_t tempmode,
+	off_t transize, const char *trancksum )
+{
+    struct stat		st;
+    struct timeval	tv;
+    char		*line;
+    char		buf[ 65536 ];
+    char		request[ 2 * MAXPATHLEN + 64 ];
+    char		cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    unsigned char	op[ 9 ];
+    unsigned int	block, count, nblocks;
+    int			ofd, fd = -1, blocksize, returnval = -1;
+    off_t		size, done = 0, sent = 0, len, off;
+    ssize_t		rr;
+    size_t		n;
+
+    if ( !cksum || ( strcmp( trancksum, "-" ) == 0 )) {
+	return( 2 );
+    }
+    if (( ofd = open( (const char *) base, O_RDONLY, 0 )) < 0 ) {
+	return( 2 );
+    }
+    if (( fstat( ofd, &st ) != 0 ) || !S_ISREG( st.st_mode ) ||
+	    ( st.st_size <= 0 )) {
+	close( ofd );
+	return( 2 );
+    }
+    blocksize = delta_blocksize( st.st_size );
+    nblocks = ( st.st_size + blocksize - 1 ) / blocksize;
+    if ( snprintf( request, sizeof( request ), "DELT %" PRIofft " %d %s",
+	    st.st_size, blocksize, (const char *) pathdesc )
+	    >= sizeof( request )) {
+	close( ofd );
+	return( 2 );
+    }
+
+    if ( retr_request( sn, request, ofd, st.st_size ) != 0 ) {
+	fprintf( stderr, "retrieve %s failed: 1-%s\n", pathdesc,
+	    strerror( errno ));
+	goto error;
+    }
+
+    tv = timeout;
+    if (( line = snet_getline_multi( sn, logger, &tv )) == NULL ) {
+	fprintf( stderr, "retrieve %s failed: 2-%s\n", pathdesc,
+	    strerror( errno ));
+	goto error;
+    }
+    if ( *line != '2' ) {
+	fprintf( stderr, "%s\n", line );
+	returnval = 1;
+	goto error;
+    }
+
+    tv = timeout;
+    if (( line = snet_getline( sn, &tv )) == NULL ) {
+	fprintf( stderr, "retrieve %s failed: 3-%s\n", pathdesc,
+	    strerror( errno ));
+	goto error;
+    }
+    size = strtoofft( line, NULL, 10 );
+    if ( verbose ) printf( "<<< %" PRIofft "\n", size );
+    if ( transize >= 0 && size != transize ) {
+	fprintf( stderr, "line %d: size in transcript does not match size "
+	    "from server\n", linenum );
+	fprintf( stderr, "%s\n", pathdesc );
+	goto error;
+    }
+
+    if (( fd = retr_open_temp( path, temppath, O_RDWR | O_TRUNC,
+	    tempmode )) < 0 ) {
+	goto error;
+    }
+
+    for ( ;; ) {
+	if ( retr_read( sn, (char *)op, 1 ) != 0 ) {
+	    goto readerr;
+	}
+	if ( op[ 0 ] == DELTA_END ) {
+	    break;
+	}
+
+	if ( op[ 0 ] == DELTA_COPY ) {
+	    if ( retr_read( sn, (char *)op + 1, 8 ) != 0 ) {
+		goto readerr;
+	    }
+	    block = ( op[ 1 ] << 24 ) | ( op[ 2 ] << 16 ) |
+		    ( op[ 3 ] << 8 ) | op[ 4 ];
+	    count = ( op[ 5 ] << 24 ) | ( op[ 6 ] << 16 ) |
+		    ( op[ 7 ] << 8 ) | op[ 8 ];
+	    if (( block >= nblocks ) || ( count > nblocks - block )) {
+		errno = EPROTO;
+		goto readerr;
+	    }
+	    off = (off_t)block * blocksize;
+	    len = MIN( (off_t)count * blocksize, st.st_size - off );
+	    if ( done + len > size ) {
+		errno = EPROTO;
+		goto readerr;
+	    }
+	    for ( ; len > 0; len -= rr, off += rr ) {
+		if (( rr = pread( ofd, buf, MIN( sizeof( buf ), len ),
+			off )) <= 0 ) {
+		    /* the copy changed, the check sum will fail */
+		    memset( buf, 0, sizeof( buf ));
+		    rr = MIN( sizeof( buf ), len );
+		}
+		if ( write( fd, buf, (size_t)rr ) != rr ) {
+		    perror( (char *) temppath );
+		    goto error;
+		}
+		done += rr;
+	    }
+
+	} else if ( op[ 0 ] == DELTA_LITERAL ) {
+	    if ( retr_read( sn, (char *)op + 1, 4 ) != 0 ) {
+		goto readerr;
+	    }
+	    len = ( op[ 1 ] << 24 ) | ( op[ 2 ] << 16 ) |
+		    ( op[ 3 ] << 8 ) | op[ 4 ];
+	    if ( done + len > size ) {
+		errno = EPROTO;
+		goto readerr;
+	    }
+	    for ( ; len > 0; len -= n ) {
+		n = MIN( sizeof( buf ), len );
+		if ( retr_read( sn, buf, n ) != 0 ) {
+		    goto readerr;
+		}
+		if ( write( fd, buf, n ) != n ) {
+		    perror( (char *) temppath );
+		    goto error;
+		}
+		done += n;
+		sent += n;
+		if ( dodots ) { putc( '.', stdout ); fflush( stdout ); }
+	    }
+
+	} else {
+	    errno = EPROTO;
+	    goto readerr;
+	}
+    }
+    close( ofd );
+    ofd = -1;
+
+    tv = timeout;
+    if (( line = snet_getline( sn, &tv )) == NULL ) {
+	fprintf( stderr, "retrieve %s failed: 5-%s\n", pathdesc,
+	    strerror( errno ));
+	goto error;
+    }
+    if ( strcmp( line, "." ) != 0 ) {
+	fprintf( stderr, "%s", line );
+	fprintf( stderr, "%s\n", pathdesc );
+	goto error;
+    }
+    if ( verbose ) printf( "<<< .\n" );
+
+    if (( done != size ) || ( lseek( fd, 0, SEEK_SET ) != 0 ) ||
+	    ( do_fcksum( fd, cksum_b64 ) != size ) ||
+	    ( strcmp( trancksum, cksum_b64 ) != 0 )) {
+	if ( verbose ) printf( "%s: delta did not check sum\n", pathdesc );
+	returnval = 2;
+	goto error;
+    }
+    if ( close( fd ) != 0 ) {
+	fd = -1;
+	perror( (char *) temppath );
+	goto error;
+    }
+
+    if ( verbose ) printf( "%s: %" PRIofft " of %" PRIofft " bytes sent\n",
+	    pathdesc, sent, size );
+    if ( showprogress ) {
+	progressupdate( (ssize_t)size, path );
+    }
+    return( 0 );
+
+readerr:
+    fprintf( stderr, "retrieve %s failed: 4-%s\n", pathdesc,
+	strerror( errno ));
+error:
+    if ( ofd >= 0 ) {
+	close( ofd );
+    }
+    if ( fd >= 0 ) {
+	close( fd );
+	unlink( (char *) temppath );
+    }
+    return( returnval );
+}
+
 #ifdef __APPLE__
 
 /*
@@ -249,6 +1133,7 @@ retr_applefile( SNET *sn, const filepath_t *pathdesc, const filepath_t *path,
     EVP_MD_CTX   	       	mdctx;
     unsigned char       	md_value[ EVP_MAX_MD_SIZE ];
     char		       	cksum_b64[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+    char			request[ 2 * MAXPATHLEN + 64 ];
 
     if ( cksum ) {
         if ( strcmp( trancksum, "-" ) == 0 ) {
@@ -259,8 +1144,9 @@ retr_applefile( SNET *sn, const filepath_t *pathdesc, const filepath_t *path,
         EVP_DigestInit( &mdctx, md );
     }
 
-    if ( verbose ) printf( ">>> RETR %s\n", pathdesc );
-    if ( snet_writef( sn, "RETR %s\n", pathdesc ) < 0 ) {
+    if (( snprintf( request, sizeof( request ), "RETR %s",
+	    (const char *) pathdesc ) >= sizeof( request )) ||
+	    ( retr_request( sn, request, -1, 0 ) != 0 )) {
 	fprintf( stderr, "retrieve applefile %s failed: 1-%s\n", pathdesc,
 	    strerror( errno ));
 	return( -1 );
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "applefile.h"
+#include "base64.h"
+#include "cksum.h"
+#include "digest.h"
+#include "statcache.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS	MAP_ANON
+#endif /* MAP_ANONYMOUS */
+
+/*
+ * The table is mapped shared before the server forks, one entry per
+ * slot, chosen by device and inode.  A slot's sequence number is odd
+ * while a child is writing it.  Writers claim a slot by compare and
+ * swap and leave it alone if another has it; a reader that sees the
+ * slot change while copying it counts a miss.
+ */
+#define STAT_CACHE_SLOTS	8192
+
+typedef struct stat_cache_slot stat_cache_slot_t;
+
+struct stat_cache_slot {
+    volatile unsigned int	sc_seq;
+    dev_t			sc_dev;
+    ino_t			sc_ino;
+    off_t			sc_size;
+    time_t			sc_mtime;
+    time_t			sc_ctime;
+    char			sc_digest[ 32 ];
+    char			sc_cksum[ SZ_BASE64_E( EVP_MAX_MD_SIZE ) ];
+};
+
+static stat_cache_slot_t	*stat_cache = NULL;
+
+/*
+ * Return Value:
+ *	-1 - error, STAT reads every file
+ *	 0 - OKAY
+ */
+    int
+stat_cache_init( void )
+{
+    void		*p;
+
+    if (( p = mmap( NULL, STAT_CACHE_SLOTS * sizeof( stat_cache_slot_t ),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 ))
+	    == MAP_FAILED ) {
+	return( -1 );
+    }
+    /* anonymous mappings are zeroed, so every slot starts empty */
+    stat_cache = (stat_cache_slot_t *)p;
+    return( 0 );
+}
+
+    static stat_cache_slot_t *
+stat_cache_slot( const struct stat *st )
+{
+    unsigned long	h;
+
+    h = (unsigned long)st->st_ino * 2654435761UL ^ (unsigned long)st->st_dev;
+    return( &stat_cache[ h % STAT_CACHE_SLOTS ] );
+}
+
+    static int
+stat_cache_match( const stat_cache_slot_t *sc, const struct stat *st,
+	const char *digest )
+{
+    return(( sc->sc_dev == st->st_dev ) && ( sc->sc_ino == st->st_ino ) &&
+	    ( sc->sc_size == st->st_size ) &&
+	    ( sc->sc_mtime == st->st_mtime ) &&
+	    ( sc->sc_ctime == st->st_ctime ) &&
+	    ( strcmp( sc->sc_digest, digest ) == 0 ));
+}
+
+/*
+ * Checksum path, which stat() said is st, from the cache if it hasn't
+ * changed since it was last read.
+ *
+ * Return Value:
+ *	-1 - error
+ *	size of the file checksummed
+ */
+    off_t
+stat_cache_cksum( const filepath_t *path, const struct stat *st,
+	char *cksum_b64 )
+{
+    extern EVP_MD	*md;
+    stat_cache_slot_t	*sc, copy;
+    struct stat		fst;
+    const char		*digest;
+    unsigned int	seq;
+    off_t		size;
+    int			fd;
+
+    if ( stat_cache == NULL ) {
+	return( do_cksum( path, cksum_b64 ));
+    }
+    digest = digest_name( md );
+    sc = stat_cache_slot( st );
+
+    seq = sc->sc_seq;
+    __sync_synchronize();
+    if (( seq & 1 ) == 0 ) {
+	memcpy( &copy, (const void *)sc, sizeof( stat_cache_slot_t ));
+	__sync_synchronize();
+	if (( sc->sc_seq == seq ) && stat_cache_match( &copy, st, digest )) {
+	    strcpy( cksum_b64, copy.sc_cksum );
+	    return( st->st_size );
+	}
+    }
+
+    if (( fd = open( (const char *) path, O_RDONLY, 0 )) < 0 ) {
+	return( -1 );
+    }
+    if (( size = do_fcksum( fd, cksum_b64 )) < 0 ) {
+	close( fd );
+	return( -1 );
+    }
+    if (( fstat( fd, &fst ) != 0 ) || ( close( fd ) != 0 )) {
+	return( -1 );
+    }
+
+    /*
+     * Only what was read is kept, and only once it's a second old:
+     * a file changed again within the same second would look the same.
+     */
+    if (( fst.st_dev != st->st_dev ) || ( fst.st_ino != st->st_ino ) ||
+	    ( fst.st_size != size ) || ( fst.st_mtime != st->st_mtime ) ||
+	    ( fst.st_ctime != st->st_ctime ) ||
+	    ( fst.st_mtime >= time( NULL )) || ( fst.st_ctime >= time( NULL )) ||
+	    ( strlen( digest ) >= sizeof( sc->sc_digest ))) {
+	return( size );
+    }
+
+    seq = sc->sc_seq;
+    if (( seq & 1 ) ||
+	    !__sync_bool_compare_and_swap( &sc->sc_seq, seq, seq + 1 )) {
+	/* another child is writing it */
+	return( size );
+    }
+    __sync_synchronize();
+    sc->sc_dev = fst.st_dev;
+    sc->sc_ino = fst.st_ino;
+    sc->sc_size = fst.st_size;
+    sc->sc_mtime = fst.st_mtime;
+    sc->sc_ctime = fst.st_ctime;
+    strcpy( sc->sc_digest, digest );
+    strcpy( sc->sc_cksum, cksum_b64 );
+    __sync_synchronize();
+    sc->sc_seq = seq + 2;
+
+    return( size );
+}
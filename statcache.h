@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_STATCACHE_H)
+#  define _RADMIND_STATCACHE_H "$Id$"
+
+#  include "filepath.h"
+
+/*
+ * Checksums returned by STAT, shared between all of the server's
+ * children and keyed by device, inode, size, mtime and ctime, so that an
+ * unchanged command file or transcript is only read once.
+ */
+
+extern int	stat_cache_init( void );
+extern off_t	stat_cache_cksum( const filepath_t *path, const struct stat *st,
+		    char *cksum_b64 );
+
+#endif /* defined(_RADMIND_STATCACHE_H) */
@@ -25,6 +25,7 @@
 
 #include "applefile.h"
 #include "base64.h"
+#include "digest.h"
 #include "transcript.h"
 #include "code.h"
 #include "mkdirs.h"
@@ -571,7 +572,7 @@ main( int ac, char *av[] )
 	    
 	case 'c':	/* cksum */
 	    OpenSSL_add_all_digests();
-	    md = EVP_get_digestbyname( optarg );
+	    md = digest_byname( optarg );
 	    if ( !md ) {
 		fprintf( stderr, "%s: unsupported checksum\n", optarg );
 		exit( 2 );
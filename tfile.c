@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
+#include "tfile.h"
+
+/* first byte of the gzip magic number, never the start of a transcript */
+#define TFILE_GZIP_MAGIC	0x1f
+
+/* zlib's default 8k input buffer is small for multi-megabyte transcripts */
+#define TFILE_GZBUFSIZE		( 128 * 1024 )
+
+struct tfile {
+    int			tf_compressed;
+    FILE		*tf_fp;
+#ifdef HAVE_ZLIB
+    gzFile		tf_gz;
+#endif /* HAVE_ZLIB */
+};
+
+    tfile_t *
+tfile_fdopen( int fd, const char *name )
+{
+    tfile_t		*tf;
+#ifndef HAVE_ZLIB
+    int			c;
+#endif /* HAVE_ZLIB */
+
+    if (( tf = (tfile_t *) calloc( 1, sizeof( tfile_t ))) == NULL ) {
+	return( NULL );
+    }
+
+#ifdef HAVE_ZLIB
+    /* gzip reads uncompressed files transparently */
+    if (( tf->tf_gz = gzdopen( fd, "r" )) == NULL ) {
+	if ( errno == 0 ) {
+	    errno = ENOMEM;
+	}
+	free( tf );
+	return( NULL );
+    }
+#if defined(ZLIB_VERNUM) && ( ZLIB_VERNUM >= 0x1240 )
+    gzbuffer( tf->tf_gz, TFILE_GZBUFSIZE );
+#endif /* ZLIB_VERNUM >= 0x1240 */
+    tf->tf_compressed = !gzdirect( tf->tf_gz );
+#else /* HAVE_ZLIB */
+    if (( tf->tf_fp = fdopen( fd, "r" )) == NULL ) {
+	free( tf );
+	return( NULL );
+    }
+    if (( c = getc( tf->tf_fp )) != EOF ) {
+	ungetc( c, tf->tf_fp );
+    }
+    if ( c == TFILE_GZIP_MAGIC ) {
+	fprintf( stderr, "%s: compressed transcripts not supported\n", name );
+	fclose( tf->tf_fp );
+	free( tf );
+	errno = EINVAL;
+	return( NULL );
+    }
+#endif /* HAVE_ZLIB */
+
+    return( tf );
+}
+
+    tfile_t *
+tfile_open( const char *path )
+{
+    tfile_t		*tf;
+    int			fd, save_errno;
+
+    if (( fd = open( path, O_RDONLY, 0 )) < 0 ) {
+	return( NULL );
+    }
+    if (( tf = tfile_fdopen( fd, path )) == NULL ) {
+	save_errno = errno;
+	(void)close( fd );
+	errno = save_errno;
+	return( NULL );
+    }
+    return( tf );
+}
+
+    char *
+tfile_gets( char *buf, int len, tfile_t *tf )
+{
+#ifdef HAVE_ZLIB
+    return( gzgets( tf->tf_gz, buf, len ));
+#else /* HAVE_ZLIB */
+    return( fgets( buf, len, tf->tf_fp ));
+#endif /* HAVE_ZLIB */
+}
+
+    ssize_t
+tfile_read( tfile_t *tf, void *buf, size_t len )
+{
+#ifdef HAVE_ZLIB
+    return( gzread( tf->tf_gz, buf, (unsigned int)len ));
+#else /* HAVE_ZLIB */
+    size_t		rr;
+
+    rr = fread( buf, 1, len, tf->tf_fp );
+    if ( rr == 0 && ferror( tf->tf_fp )) {
+	return( -1 );
+    }
+    return( (ssize_t)rr );
+#endif /* HAVE_ZLIB */
+}
+
+    int
+tfile_rewind( tfile_t *tf )
+{
+#ifdef HAVE_ZLIB
+    return( gzrewind( tf->tf_gz ));
+#else /* HAVE_ZLIB */
+    rewind( tf->tf_fp );
+    return( 0 );
+#endif /* HAVE_ZLIB */
+}
+
+    int
+tfile_eof( tfile_t *tf )
+{
+#ifdef HAVE_ZLIB
+    return( gzeof( tf->tf_gz ));
+#else /* HAVE_ZLIB */
+    return( feof( tf->tf_fp ));
+#endif /* HAVE_ZLIB */
+}
+
+/*
+ * Whether reading stopped on an error, such as a compressed transcript
+ * cut short, rather than at the end.  Either way tfile_gets() returns
+ * NULL, so it's checked once it has.
+ */
+    int
+tfile_error( tfile_t *tf )
+{
+#ifdef HAVE_ZLIB
+    int			errnum;
+
+    (void)gzerror( tf->tf_gz, &errnum );
+    return( errnum != Z_OK );
+#else /* HAVE_ZLIB */
+    return( ferror( tf->tf_fp ));
+#endif /* HAVE_ZLIB */
+}
+
+    int
+tfile_compressed( const tfile_t *tf )
+{
+    return( tf->tf_compressed );
+}
+
+    int
+tfile_close( tfile_t *tf )
+{
+    int			rc;
+
+#ifdef HAVE_ZLIB
+    rc = ( gzclose( tf->tf_gz ) == Z_OK ) ? 0 : -1;
+#else /* HAVE_ZLIB */
+    rc = fclose( tf->tf_fp );
+#endif /* HAVE_ZLIB */
+    free( tf );
+    return( rc );
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_TFILE_H)
+#  define _RADMIND_TFILE_H "$Id$"
+
+#  include <sys/types.h>
+
+/*
+ * Read-only transcript stream.  Plain and gzip-compressed transcripts
+ * are detected by content, not by name, and are read line by line with
+ * decompression done on the fly.  Without zlib, compressed transcripts
+ * fail to open with EINVAL.
+ */
+
+#  define TFILE_GZIP_SUFFIX	".gz"
+
+typedef struct tfile tfile_t;
+
+extern tfile_t	      *	tfile_open( const char *path );
+extern tfile_t	      *	tfile_fdopen( int fd, const char *name );
+extern char	      *	tfile_gets( char *buf, int len, tfile_t *tf );
+extern ssize_t		tfile_read( tfile_t *tf, void *buf, size_t len );
+extern int		tfile_rewind( tfile_t *tf );
+extern int		tfile_eof( tfile_t *tf );
+extern int		tfile_error( tfile_t *tf );
+extern int		tfile_compressed( const tfile_t *tf );
+extern int		tfile_close( tfile_t *tf );
+
+#endif /* defined(_RADMIND_TFILE_H) */
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "tline.h"
+
+#define TL_ARGC		10
+
+/* Must match encode() and decode(). */
+    int
+tline_split( char *line, char ***p_argv )
+{
+    static char		**argv = NULL;
+    static int		argc_max = 0;
+    char		*r = line, *w, c;
+    int			ac = 0;
+
+    for (;;) {
+	while (( *r == ' ' ) || ( *r == '\t' ) || ( *r == '\n' )) {
+	    r++;
+	}
+	if ( *r == '\0' ) {
+	    break;
+	}
+
+	if ( ac + 1 >= argc_max ) {
+	    if (( argv = (char **)realloc( argv,
+		    sizeof( char * ) * ( argc_max + TL_ARGC ))) == NULL ) {
+		return( -1 );
+	    }
+	    argc_max += TL_ARGC;
+	}
+	argv[ ac++ ] = w = r;
+
+	for ( ; ( *r != '\0' ) && ( *r != ' ' ) && ( *r != '\t' ) &&
+		( *r != '\n' ); r++, w++ ) {
+	    if (( *r != '\\' ) || ( r[ 1 ] == '\0' )) {
+		*w = *r;
+		continue;
+	    }
+	    switch ( *++r ) {
+	    case 'b':
+		*w = ' ';
+		break;
+	    case 't':
+		*w = '\t';
+		break;
+	    case 'n':
+		*w = '\n';
+		break;
+	    case 'r':
+		*w = '\r';
+		break;
+	    default:
+		*w = *r;
+		break;
+	    }
+	}
+
+	/* w trails r, so read the separator before terminating */
+	c = *r;
+	*w = '\0';
+	if ( c == '\0' ) {
+	    break;
+	}
+	r++;
+    }
+
+    if ( argv == NULL ) {
+	if (( argv = (char **)malloc( sizeof( char * ) * TL_ARGC )) == NULL ) {
+	    return( -1 );
+	}
+	argc_max = TL_ARGC;
+    }
+    argv[ ac ] = NULL;
+    *p_argv = argv;
+    return( ac );
+}
+
+/*
+ * Return Value:
+ *	-1 - field is empty, has anything but octal digits, or is too
+ *	     large, errno is ERANGE for the last
+ *	 0 - OKAY, *n set
+ */
+    int
+tline_oct( const char *field, long *n )
+{
+    long		v = 0;
+
+    if ( *field == '\0' ) {
+	return( -1 );
+    }
+    for ( ; ( *field >= '0' ) && ( *field <= '7' ); field++ ) {
+	if ( v > ( LONG_MAX >> 3 )) {
+	    errno = ERANGE;
+	    return( -1 );
+	}
+	v = ( v << 3 ) | ( *field - '0' );
+    }
+    if ( *field != '\0' ) {
+	return( -1 );
+    }
+    *n = v;
+    return( 0 );
+}
+
+/*
+ * Return Value:
+ *	-1 - field is empty, has anything but decimal digits after an
+ *	     optional '-', or is too large, errno is ERANGE for the last
+ *	 0 - OKAY, *n set
+ */
+    int
+tline_dec( const char *field, long long *n )
+{
+    long long		v = 0;
+    int			neg = 0, d;
+
+    if ( *field == '-' ) {
+	neg = 1;
+	field++;
+    }
+    if ( *field == '\0' ) {
+	return( -1 );
+    }
+    for ( ; ( *field >= '0' ) && ( *field <= '9' ); field++ ) {
+	d = *field - '0';
+	if ( v > ( LLONG_MAX - d ) / 10 ) {
+	    errno = ERANGE;
+	    return( -1 );
+	}
+	v = v * 10 + d;
+    }
+    if ( *field != '\0' ) {
+	return( -1 );
+    }
+    *n = neg ? -v : v;
+    return( 0 );
+}
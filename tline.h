@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_TLINE_H)
+#  define _RADMIND_TLINE_H "$Id$"
+
+/*
+ * Transcript line fields.  tline_split() is argcargv() and decode()
+ * in a single pass: fields are split on white space and encode()'s
+ * escapes are undone in place, so the returned fields are decoded
+ * paths, not transcript text.  argv is static, as with argcargv().
+ *
+ * The number parsers take a field as written by t_print(), and fail,
+ * as strtol() callers check for, on anything after the digits or on
+ * overflow.
+ */
+
+extern int		tline_split( char *line, char ***argv );
+extern int		tline_oct( const char *field, long *n );
+extern int		tline_dec( const char *field, long long *n );
+
+#endif /* defined(_RADMIND_TLINE_H) */
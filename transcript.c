@@ -25,17 +25,20 @@
 #include "base64.h"
 #include "transcript.h"
 #include "argcargv.h"
+#include "tline.h"
 #include "code.h"
 #include "cksum.h"
 #include "pathcmp.h"
 #include "largefile.h"
 #include "list.h"
 #include "wildcard.h"
+#include "tfile.h"
 
 static const filepath_t * convert_path_type( const filepath_t *path );
 static int transcript_kfile( const filepath_t *kfile, int location );
 static void t_remove( rad_Transcript_t type, const filepath_t *shortname );
 static void t_display( void );
+static int t_check_loop( pathinfo_t *pi, int enter );
 
 transcript_t	 		*tran_head = (transcript_t *) NULL;
 static transcript_t		*prev_tran = (transcript_t *) NULL;
@@ -55,6 +58,7 @@ int				cksum;
 int				fs_minus;
 int				exclude_warnings = 0;
 FILE				*outtran;
+unsigned int			t_print_count = 0; /* lines from t_print() */
 int			        debug = 0;
 int				verbose = 0;	 /* For warning messages. */
 size_t                          transcript_buffer_size = DEFAULT_TRANSCRIPT_BUFFER_SIZE;  /* If 0, no buffering */
@@ -99,6 +103,35 @@ t_fprintf_err(FILE *out, const transcript_t *tran, const char *fmt, ...)
   return result;
 } /* end of t_fprintf_err() */
 
+/* a number field of tran's current line, the line is rejected if it's bad */
+    static long
+t_oct( const transcript_t *tran, const char *field )
+{
+    long		n;
+
+    errno = 0;
+    if ( tline_oct( field, &n ) != 0 ) {
+	t_fprintf_err( stderr, tran, "%s: bad octal number%s\n", field,
+		( errno == ERANGE ) ? ", out of range" : "" );
+	exit( EX_DATAERR );
+    }
+    return( n );
+}
+
+    static long long
+t_dec( const transcript_t *tran, const char *field )
+{
+    long long		n;
+
+    errno = 0;
+    if ( tline_dec( field, &n ) != 0 ) {
+	t_fprintf_err( stderr, tran, "%s: bad number%s\n", field,
+		( errno == ERANGE ) ? ", out of range" : "" );
+	exit( EX_DATAERR );
+    }
+    return( n );
+}
+
 
 
 const static filepath_t * 
@@ -123,12 +156,8 @@ convert_path_type( const filepath_t *path )
     } else {
         if (( tran_format == T_ABSOLUTE ) && ( path[ 0 ] == '.' )) {
             if ( path[ 1 ] == '/' ) {
-                /* Move past leading '.' */
-		path++;
-                if ( snprintf( (char *) buf, sizeof( buf ), "%s",
-			       (const char *) path ) >= MAXPATHLEN ) {
-		    return( NULL );
-                }
+                /* Move past leading '.', no copy needed */
+		return( path + 1 );
             } else {
                 /* Instert leading '/' */
 	      if ( snprintf( (char *) buf, sizeof( buf ), "/%s",
@@ -152,6 +181,79 @@ convert_path_type( const filepath_t *path )
 
 
 
+/*
+ * Check that a transcript line, already split and past its '-' and '+'
+ * markers, has a known type and the right number of fields for it.
+ * Every line is checked, whether or not it's under path_prefix.
+ */
+    static void
+t_check_line( transcript_t *tran, char **av, int ac )
+{
+    switch( *av[ 0 ] ) {
+    case 'd':				    /* dir */
+	if (( ac != 5 ) && ( ac != 6 )) {
+	    t_fprintf_err( stderr, tran, "expected 5 or 6 arguments, got %d\n",
+			   ac );
+	    exit( EX_DATAERR ); /* from <sysexits.h> */
+	}
+	break;
+
+    case 'p':
+    case 'D':
+    case 's':
+	if ( ac != 5 ) {
+	    t_fprintf_err( stderr, tran, "expected 5 arguments, got %d\n",
+			   ac );
+	    exit( EX_DATAERR );
+	}
+	break;
+
+    case 'b':				    /* block or char */
+    case 'c':
+	if ( ac != 7 ) {
+	    t_fprintf_err( stderr, tran, "expected 7 arguments, got %d\n",
+			   ac );
+	    exit( EX_DATAERR );
+	}
+	break;
+
+    case 'l':				    /* link */
+	if (( ac != 3 ) && ( ac != 6 )) {
+	    t_fprintf_err( stderr, tran, "symlink expected 3 or 6 arguments, got %d\n",
+			   ac );
+	    exit( EX_DATAERR );
+	}
+	break;
+
+    case 'h':				    /* hard */
+	if ( ac != 3 ) {
+	    t_fprintf_err( stderr, tran, "hardlink expected 3 arguments, got %d\n",
+			   ac );
+	    exit( EX_DATAERR );
+	}
+	break;
+
+    case 'a':				    /* hfs applefile */
+    case 'f':				    /* file */
+	if ( ac != 8 ) {
+	    t_fprintf_err( stderr, tran, "expected 8 arguments, got %d\n",
+			   ac );
+	    exit( EX_DATAERR );
+	}
+	if ( tran->t_type != T_NEGATIVE ) {
+	    if (( cksum ) && ( strcmp( "-", av [ 7 ] ) == 0  )) {
+	        t_fprintf_err( stderr, tran, "no cksums in transcript\n" );
+		exit( EX_DATAERR );
+	    }
+	}
+	break;
+
+    default:
+        t_fprintf_err( stderr, tran, "unknown file type '%c'\n", *av[ 0 ] );
+	exit( EX_DATAERR );
+    }
+}
+
     void 
 transcript_parse( transcript_t *tran ) 
 {
@@ -197,7 +299,12 @@ transcript_parse( transcript_t *tran )
 
 	  strncat (line, "\n", sizeof(line)-1);  /* Put EOL back. */
         }
-	else if (( fgets( line, sizeof(line)-1, tran->t_in )) == NULL ) {
+	else if (( tfile_gets( line, sizeof(line)-1, tran->t_in )) == NULL ) {
+	    if ( tfile_error( tran->t_in )) {
+		t_fprintf_err( stderr, tran,
+			"read error, transcript corrupt or truncated\n" );
+		exit( EX_DATAERR );
+	    }
 	    tran->t_eof = 1;
 	    if (debug > 2)
 	        alert_transcript(NULL, stderr, tran, 
@@ -216,8 +323,12 @@ transcript_parse( transcript_t *tran )
 	    exit(EX_SOFTWARE);  /* from <sysexits.h> */
 	} 
 
-    } while ((( ac = argcargv( line, &av )) == 0 ) || ( *av[ 0 ] == '#' ));
+    } while ((( ac = tline_split( line, &av )) == 0 ) || ( *av[ 0 ] == '#' ));
 
+    if ( ac < 0 ) {
+	perror( "tline_split" );
+	exit( EX_OSERR );
+    }
     if ( ac < 3 ) {
         t_fprintf_err(stderr, tran, "minimum 3 arguments, got %d\n",  ac );
 	exit( EX_DATAERR ); /* from <sysexits.h> */
@@ -242,8 +353,11 @@ transcript_parse( transcript_t *tran )
     }
 
     tran->t_pinfo.pi_type = av[ 0 ][ 0 ];
-    if (( epath = (filepath_t *) decode( av[ 1 ] )) == NULL ) {
-        t_fprintf_err( stderr, tran, "path decoding failed\n");
+
+    /* tline_split() already decoded the fields */
+    epath = (filepath_t *) av[ 1 ];
+    if ( filepath_len( epath ) >= MAXPATHLEN ) {
+        t_fprintf_err( stderr, tran, "path too long\n");
 	exit( EX_DATAERR ); /* from <sysexits.h> */
     }
 
@@ -268,18 +382,24 @@ transcript_parse( transcript_t *tran )
     
     memset (&(tran->t_pinfo.pi_stat), 0, sizeof(tran->t_pinfo.pi_stat));
 
+    t_check_line( tran, av, ac );
+
+    /*
+     * transcript_select() passes over lines outside of path_prefix
+     * without looking past the path, so don't convert the rest.
+     */
+    if (( path_prefix != NULL ) && !ischildcase( tran->t_pinfo.pi_name,
+	    (filepath_t *) path_prefix, case_sensitive )) {
+	tran->total_objects ++;
+	return;
+    }
+
     /* reading and parsing the line */
     switch( *av[ 0 ] ) {
     case 'd':				    /* dir */
-	if (( ac != 5 ) && ( ac != 6 )) {
-	    t_fprintf_err( stderr, tran, "expected 5 or 6 arguments, got %d\n",
-			   ac );
-	    exit( EX_DATAERR ); /* from <sysexits.h> */
-	}
-
-	tran->t_pinfo.pi_stat.st_mode = strtol( av[ 2 ], NULL, 8 );
-	tran->t_pinfo.pi_stat.st_uid = atoi( av[ 3 ] );
-	tran->t_pinfo.pi_stat.st_gid = atoi( av[ 4 ] );
+	tran->t_pinfo.pi_stat.st_mode = t_oct( tran, av[ 2 ] );
+	tran->t_pinfo.pi_stat.st_uid = t_dec( tran, av[ 3 ] );
+	tran->t_pinfo.pi_stat.st_gid = t_dec( tran, av[ 4 ] );
 	if ( ac == 6 ) {
 	    base64_d( av[ 5 ], strlen( av[ 5 ] ),
 		    (filepath_t *)tran->t_pinfo.pi_afinfo.ai.ai_data );
@@ -291,29 +411,19 @@ transcript_parse( transcript_t *tran )
     case 'p':
     case 'D':
     case 's':
-	if ( ac != 5 ) {
-	    t_fprintf_err( stderr, tran, "expected 5 arguments, got %d\n",
-			   ac );
-	    exit( EX_DATAERR );
-	}
-	tran->t_pinfo.pi_stat.st_mode = strtol( av[ 2 ], NULL, 8 );
-	tran->t_pinfo.pi_stat.st_uid = atoi( av[ 3 ] );
-	tran->t_pinfo.pi_stat.st_gid = atoi( av[ 4 ] );
+	tran->t_pinfo.pi_stat.st_mode = t_oct( tran, av[ 2 ] );
+	tran->t_pinfo.pi_stat.st_uid = t_dec( tran, av[ 3 ] );
+	tran->t_pinfo.pi_stat.st_gid = t_dec( tran, av[ 4 ] );
 	break;
 
     case 'b':				    /* block or char */
     case 'c':
-	if ( ac != 7 ) {
-	    t_fprintf_err( stderr, tran, "expected 7 arguments, got %d\n",
-			   ac );
-	    exit( EX_DATAERR );
-	}
-	tran->t_pinfo.pi_stat.st_mode = strtol( av[ 2 ], NULL, 8 );
-	tran->t_pinfo.pi_stat.st_uid = atoi( av[ 3 ] );
-	tran->t_pinfo.pi_stat.st_gid = atoi( av[ 4 ] );
+	tran->t_pinfo.pi_stat.st_mode = t_oct( tran, av[ 2 ] );
+	tran->t_pinfo.pi_stat.st_uid = t_dec( tran, av[ 3 ] );
+	tran->t_pinfo.pi_stat.st_gid = t_dec( tran, av[ 4 ] );
 	tran->t_pinfo.pi_stat.st_rdev =
-		makedev( ( unsigned )( atoi( av[ 5 ] )), 
-		( unsigned )( atoi( av[ 6 ] )));
+		makedev( ( unsigned )( t_dec( tran, av[ 5 ] )), 
+		( unsigned )( t_dec( tran, av[ 6 ] )));
 	break;
 
     case 'l':				    /* link */
@@ -321,36 +431,18 @@ transcript_parse( transcript_t *tran )
 	    tran->t_pinfo.pi_stat.st_mode = 0777;
 	    tran->t_pinfo.pi_stat.st_uid = 0;
 	    tran->t_pinfo.pi_stat.st_gid = 0;
-	} else if ( ac == 6 ) { /* link with owner, group, mode */
-	    tran->t_pinfo.pi_stat.st_mode = strtol( av[ 2 ], NULL, 8 );
-	    tran->t_pinfo.pi_stat.st_uid = atoi( av[ 3 ] );
-	    tran->t_pinfo.pi_stat.st_gid = atoi( av[ 4 ] );
-	} else {
-	    t_fprintf_err( stderr, tran, "symlink expected 3 or 6 arguments, got %d\n",
-			   ac );
-	    exit( EX_DATAERR );
+	} else {		/* link with owner, group, mode */
+	    tran->t_pinfo.pi_stat.st_mode = t_oct( tran, av[ 2 ] );
+	    tran->t_pinfo.pi_stat.st_uid = t_dec( tran, av[ 3 ] );
+	    tran->t_pinfo.pi_stat.st_gid = t_dec( tran, av[ 4 ] );
 	}
 
-	if (( epath = (filepath_t *) decode( av[ ac - 1 ] )) == NULL ) {
-	    t_fprintf_err( stderr, tran, "symlink path decode failed\n");
-	    exit( EX_DATAERR );
-	}
 	strncpy( (char *) tran->t_pinfo.pi_link, 
-		 (const char *) epath, sizeof(tran->t_pinfo.pi_link)-1 );
+		 av[ ac - 1 ], sizeof(tran->t_pinfo.pi_link)-1 );
 	break;
 
     case 'h':				    /* hard */
-	if ( ac != 3 ) {
-	    t_fprintf_err( stderr, tran, "hardlink expected 3 arguments, got %d\n",
-			   ac );
-	    exit( EX_DATAERR );
-	}
-	if (( epath = (filepath_t *) decode( av[ 2 ] )) == NULL ) {
-	    t_fprintf_err(stderr, tran, "hardlink target path decode failed\n");
-			  
-	    exit( EX_DATAERR );
-	}
-	if (( epath = convert_path_type( epath )) == NULL ) {
+	if (( epath = convert_path_type( (filepath_t *) av[ 2 ] )) == NULL ) {
 	    t_fprintf_err( stderr, tran, "hardlink path conversion failed\n");
 	    exit( EX_DATAERR );
 	}
@@ -360,30 +452,14 @@ transcript_parse( transcript_t *tran )
 
     case 'a':				    /* hfs applefile */
     case 'f':				    /* file */
-	if ( ac != 8 ) {
-	    t_fprintf_err( stderr, tran, "expected 8 arguments, got %d\n",
-			   ac );
-	    exit( EX_DATAERR );
-	}
-	tran->t_pinfo.pi_stat.st_mode = strtol( av[ 2 ], NULL, 8 );
-	tran->t_pinfo.pi_stat.st_uid = atoi( av[ 3 ] );
-	tran->t_pinfo.pi_stat.st_gid = atoi( av[ 4 ] );
-	tran->t_pinfo.pi_stat.st_mtime = atoi( av[ 5 ] );
-	tran->t_pinfo.pi_stat.st_size = strtoofft( av[ 6 ], NULL, 10 );
-	if ( tran->t_type != T_NEGATIVE ) {
-	    if (( cksum ) && ( strcmp( "-", av [ 7 ] ) == 0  )) {
-	        t_fprintf_err( stderr, tran, "no cksums in transcript\n" );
-		exit( EX_DATAERR );
-	    }
-	}
+	tran->t_pinfo.pi_stat.st_mode = t_oct( tran, av[ 2 ] );
+	tran->t_pinfo.pi_stat.st_uid = t_dec( tran, av[ 3 ] );
+	tran->t_pinfo.pi_stat.st_gid = t_dec( tran, av[ 4 ] );
+	tran->t_pinfo.pi_stat.st_mtime = t_dec( tran, av[ 5 ] );
+	tran->t_pinfo.pi_stat.st_size = t_dec( tran, av[ 6 ] );
 	strncpy( tran->t_pinfo.pi_cksum_b64, av[ 7 ],
 		 sizeof(tran->t_pinfo.pi_cksum_b64)-1 );
-
 	break;
-
-    default:
-        t_fprintf_err( stderr, tran, "unknown file type '%c'\n", *av[ 0 ] );
-	exit( EX_DATAERR );
     }
 
     tran->total_objects ++;
@@ -441,6 +517,8 @@ t_print( pathinfo_t *fs, transcript_t *tran, int flag )
 	cur = &tran->t_pinfo;
     } 
 
+    t_print_count++;
+
     if ( print_minus ) {
 	/* set fs_minus so we can handle excluded files in dirs to be deleted */
 	fs_minus = 1;
@@ -644,7 +722,7 @@ t_compare( pathinfo_t *fs, transcript_t *tran )
 		break;
 	    }
 
-	    if ( cksum ) {
+	    if ( cksum && ( *fs->pi_cksum_b64 == '-' )) {
 	        switch (fs->pi_type) {
 		default:
 		    /* Shouldn't happen. We'll pretent it can't. */
@@ -665,7 +743,9 @@ t_compare( pathinfo_t *fs, transcript_t *tran )
 		    }
 		    break;
 		} /* switch (fs->pi_type) */
+	    }
 
+	    if ( cksum ) {
 		if ( strcmp( fs->pi_cksum_b64, tran->t_pinfo.pi_cksum_b64 ) != 0 ) {
 		    t_print( fs, tran, PR_DOWNLOAD );
 		    break;
@@ -764,8 +844,10 @@ t_compare( pathinfo_t *fs, transcript_t *tran )
        *XXX Does this catch the case where a subsequent update to the target
        *XXX of the hardlink changes?  I think not...
        *XXX*/
+      /* only paths seen by hardlink() have an nlink worth checking */
       if (( filepath_cmp( fs->pi_link, tran->t_pinfo.pi_link ) != 0 ) ||
-		( hardlink_changed( fs, 0 ) != 0 )) {
+		(( fs->pi_stat.st_nlink > 1 ) &&
+		( hardlink_changed( fs, 0 ) != 0 ))) {
 	    t_print( fs, tran, PR_STATUS );
 	}
 	break;
@@ -857,6 +939,14 @@ transcript_select( void )
 		next_tran = next_tran->t_next ) {
 	    if ( pathcasecmp( begin_tran->t_pinfo.pi_name,
 		    next_tran->t_pinfo.pi_name, case_sensitive ) == 0 ) {
+		/* an EOF transcript's name is stale */
+		if ( !next_tran->t_eof ) {
+		    if ( begin_tran->t_pinfo.pi_minus ) {
+			next_tran->removed_objects ++;
+		    } else {
+			next_tran->shadowed_objects ++;
+		    }
+		}
 		transcript_parse( next_tran );
 	    }
 	}
@@ -868,6 +958,7 @@ transcript_select( void )
 	     * then just pretend it's not there.
 	     */
 	    if ( begin_tran->t_pinfo.pi_minus ) {
+		begin_tran->minus_objects ++;
 		transcript_parse( begin_tran );
 		continue;
 	    }
@@ -901,6 +992,59 @@ transcript_select( void )
 } /* end of transcript_select() */
 
 
+/*
+ * Advance the transcripts past pi, printing differences.  pi is NULL
+ * once the filesystem (or other source of paths) is exhausted.
+ */
+    static int
+t_check_loop( pathinfo_t *pi, int enter )
+{
+    transcript_t	*tran = NULL;
+
+    for (;;) {
+	tran = transcript_select();
+
+	/* Side effrect of 't_compare()' is possible standard output */
+	switch ( t_compare( pi, tran )) {
+	case T_MOVE_FS:
+	    if (debug > 0)
+	        alert_transcript(NULL, stderr, tran, 
+				 "%s() returns T_MOVE_FS, transcript_check() returns %d",
+				 __func__, enter);
+	    return( enter );
+
+	case T_MOVE_BOTH :
+	    /* But don't go into negative directories */
+	    if (( tran->t_type == T_NEGATIVE ) &&
+		    ( tran->t_pinfo.pi_type == 'd' )) {
+		enter = T_COMP_ISNEG;
+	    }
+	    transcript_parse( tran );
+
+	    if (debug > 0)
+	        alert_transcript(NULL, stderr, tran,
+				 "%s() returns T_MOVE_BOTH, transcript_check() returns %d",
+				 __func__, enter);
+	    return( enter );
+
+	case T_MOVE_TRAN :
+	    transcript_parse( tran );
+	    break;
+
+	default :
+	    alert_transcript("FATAL: ", stderr, tran, 
+			     "%s() returned an unexpected value for '%s'\n",
+			     __func__, pi ? (const char *) pi->pi_name : "(null)" );
+	    exit( EX_SOFTWARE);
+	} /* switch (t_compare()) ... */
+    }
+
+    fprintf(stderr, "%s() falls off the end for '%s'\n",
+	    __func__, pi ? (const char *) pi->pi_name : "(null)" );
+
+    return (T_COMP_ERROR);
+} /* end of t_check_loop() */
+
 /* 
  * Return values:
  * 0 --
@@ -915,7 +1059,6 @@ transcript_check( const filepath_t *path, struct stat *st, char *type,
     ssize_t 		len;  /* readlink() result */
     char		epath[ MAXPATHLEN ];
     char		*linkpath;
-    transcript_t	*tran = NULL;
     transcript_t	*temp_tran;
 
     fs_minus = 0;
@@ -973,49 +1116,46 @@ transcript_check( const filepath_t *path, struct stat *st, char *type,
 	strncpy( pi.pi_cksum_b64, "-", sizeof(pi.pi_cksum_b64)-1 ); /* excessive - but correct */
     }
 
-    for (;;) {
-	tran = transcript_select();
+    return( t_check_loop(( path ? &pi : NULL ), enter ));
+} /* end of transcript_check() */
 
-	/* Side effrect of 't_compare()' is possible standard output */
-	switch ( t_compare(( path ? &pi : NULL ), tran )) {
-	case T_MOVE_FS:
-	    if (debug > 0)
-	        alert_transcript(NULL, stderr, tran, 
-				 "%s() returns T_MOVE_FS, transcript_check() returns %d",
-				 __func__, enter);
-	    return( enter );
+/*
+ * Like transcript_check(), but pi describes the path instead of the
+ * filesystem, e.g. a line from a previously applied transcript.  pi's
+ * checksum is trusted unless it is "-".  pi is NULL to consume any
+ * remaining transcripts.
+ */
+    int
+transcript_check_pinfo( pathinfo_t *pi, int parent_minus )
+{
+    transcript_t	*temp_tran;
 
-	case T_MOVE_BOTH :
-	    /* But don't go into negative directories */
-	    if (( tran->t_type == T_NEGATIVE ) &&
-		    ( tran->t_pinfo.pi_type == 'd' )) {
-		enter = T_COMP_ISNEG;
-	    }
-	    transcript_parse( tran );
+    fs_minus = 0;
 
-	    if (debug > 0)
-	        alert_transcript(NULL, stderr, tran,
-				 "%s() returns T_MOVE_BOTH, transcript_check() returns %d",
-				 __func__, enter);
-	    return( enter );
+    if ( pi == NULL ) {
+	return( t_check_loop( NULL, T_COMP_ISFILE ));
+    }
 
-	case T_MOVE_TRAN :
-	    transcript_parse( tran );
-	    break;
+    if ( t_exclude( pi->pi_name ) && !parent_minus ) {
+	if ( list_size( special_list ) <= 0
+		|| list_check( special_list, pi->pi_name ) == 0 ) {
+	    if ( exclude_warnings ) {
+		fprintf( stderr, "Warning: excluding %s\n", pi->pi_name );
+	    }
 
-	default :
-	    alert_transcript("FATAL: ", stderr, tran, 
-			     "%s() returned an unexpected value for '%s'\n",
-			     __func__, path);
-	    exit( EX_SOFTWARE);
-	} /* switch (t_compare()) ... */
-    }
+	    /* move the transcripts ahead */
+	    temp_tran = transcript_select();
+	    if  (temp_tran->active_objects > 0)
+	      temp_tran->active_objects --;
 
-    fprintf(stderr, "%s() falls off the end for '%s'\n",
-	    __func__, path);
+	    return( T_COMP_ISFILE );
+	}
+    }
 
-    return (T_COMP_ERROR);
-} /* end of transcript_check() */
+    /* transcript lines carry the type, not S_IFMT bits */
+    return( t_check_loop( pi, ( pi->pi_type == 'd' ) ?
+	    T_COMP_ISDIR : T_COMP_ISFILE ));
+} /* end of transcript_check_pinfo() */
 
     void
 t_new( rad_Transcript_t type, const filepath_t *fullname, const filepath_t *shortname, const filepath_t *kfile ) 
@@ -1063,7 +1203,7 @@ t_new( rad_Transcript_t type, const filepath_t *fullname, const filepath_t *shor
 	strncpy( (char *) new->t_kfile, (const char *) kfile,
 		 sizeof(new->t_kfile)-1);
 
-	if (( new->t_in = fopen((char *) fullname, "r" )) == NULL ) {
+	if (( new->t_in = tfile_open((char *) fullname )) == NULL ) {
 	    perror( (const char *)fullname );
 	    exit( EX_IOERR );
 	}
@@ -1075,15 +1215,19 @@ t_new( rad_Transcript_t type, const filepath_t *fullname, const filepath_t *shor
 	/* Check to see if we do buffering. */
 	transcripts_unbuffered ++;
 
-	if( transcript_buffer_size > 0) {
+	/*
+	 * The on-disk size of a compressed transcript says nothing
+	 * about its expanded size, so those are always streamed.
+	 */
+	if( transcript_buffer_size > 0 && !tfile_compressed (new->t_in)) {
 	    struct stat tran_stat;  /* Stat the transcript file */
  
-	    if (fstat (fileno(new->t_in), &tran_stat) != 0) {
+	    if (stat ((char *) fullname, &tran_stat) != 0) {
 	      int save_errno = errno;
 
 	      fprintf (stderr,
-		       "ERROR: Unable to fstat(%d,...) for '%s', error %d: %s\n",
-		       fileno (new->t_in), (char *) fullname, save_errno,
+		       "ERROR: Unable to stat('%s',...), error %d: %s\n",
+		       (char *) fullname, save_errno,
 		       strerror (save_errno));
 	      fprintf (stderr, "ERROR: Buffering turned off\n");
 	      transcript_buffer_size = 0;
@@ -1108,7 +1252,7 @@ t_new( rad_Transcript_t type, const filepath_t *fullname, const filepath_t *shor
 				 "*debug: %s() - calloc(1, %zu) returns 0x%p\n",
 				 __func__, buflen, new->buffered);
 
-		got = read (fileno(new->t_in), new->buffered, buflen);
+		got = tfile_read (new->t_in, new->buffered, buflen);
 
 		if (got != (buflen-1)) {
 		    fprintf (stderr,
@@ -1123,8 +1267,8 @@ t_new( rad_Transcript_t type, const filepath_t *fullname, const filepath_t *shor
 		transcripts_buffered ++;
 		transcripts_unbuffered --;
 
-		fclose (new->t_in);
-		new->t_in = (FILE *) NULL;
+		tfile_close (new->t_in);
+		new->t_in = (tfile_t *) NULL;
 	      }
 	    } 
 	} /* end of if( transcript_buffer_size > 0) */
@@ -1148,6 +1292,48 @@ t_new( rad_Transcript_t type, const filepath_t *fullname, const filepath_t *shor
     return;
 }
 
+/*
+ * Open a transcript that is read on its own, e.g. a saved copy of
+ * the last applied state.  It is not added to tran_head, so it plays
+ * no part in transcript_select().
+ */
+    transcript_t *
+transcript_open( const filepath_t *fullname, const filepath_t *shortname )
+{
+    transcript_t	*tran;
+
+    if (( tran = (transcript_t *)calloc( 1, sizeof( transcript_t )))
+	    == NULL ) {
+	perror( "malloc for new transcript_t" );
+	exit( EX_OSERR );
+    }
+
+    /* like a negative transcript, allow file lines without checksums */
+    tran->t_type = T_NEGATIVE;
+    strncpy( (char *) tran->t_shortname, (const char *) shortname,
+	     sizeof(tran->t_shortname)-1 );
+    strncpy( (char *) tran->t_fullname, (const char *) fullname,
+	     sizeof(tran->t_fullname)-1 );
+
+    if (( tran->t_in = tfile_open((char *) fullname )) == NULL ) {
+	perror( (const char *)fullname );
+	exit( EX_IOERR );
+    }
+
+    transcript_parse( tran );
+
+    return( tran );
+} /* end of transcript_open() */
+
+    void
+transcript_close( transcript_t *tran )
+{
+    if ( tran->t_in != NULL ) {
+	tfile_close( tran->t_in );
+    }
+    free( tran );
+} /* end of transcript_close() */
+
     static void
 t_remove( rad_Transcript_t type, const filepath_t *shortname )
 {
@@ -1182,8 +1368,8 @@ t_remove( rad_Transcript_t type, const filepath_t *shortname )
 
 	   /* Cleanup unused file descriptors. */
  	   if (cur->t_in) {
-	   	fclose (cur->t_in);
-		cur->t_in = (FILE *) NULL;
+	   	tfile_close (cur->t_in);
+		cur->t_in = (tfile_t *) NULL;
 	   }
 
 	   if (cur->buffered) {
@@ -1524,9 +1710,10 @@ transcript_kfile( const filepath_t *kfile, int location )
 		    list_remove( special_list, path );
 		}
 	    } else {
+		/* only ever checked, so skip the ordered insert */
 		if ( !list_check( special_list, path )) {
-		    if ( list_insert( special_list, path ) != 0 ) {
-			perror( "list_insert into special_list from path" );
+		    if ( list_insert_tail( special_list, path ) != 0 ) {
+			perror( "list_insert_tail into special_list from path" );
 			depth--;
 			fclose( fp );
 			return( -1 );
@@ -1604,8 +1791,8 @@ transcript_free( )
 	}
 
 	if ( tran_head->t_in != NULL ) {
-	    fclose( tran_head->t_in );
-	    tran_head->t_in = (FILE *) NULL;
+	    tfile_close( tran_head->t_in );
+	    tran_head->t_in = (tfile_t *) NULL;
 	}
 
 	if ( tran_head->buffered != NULL) {
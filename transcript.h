@@ -8,6 +8,7 @@
 
 #  include "filepath.h"
 #  include "applefile.h"
+#  include "tfile.h"
 
 #  include <sys/stat.h>
 #  include <stdarg.h>
@@ -39,6 +40,7 @@ extern int		skip;
 extern int		cksum;
 extern int		fs_minus;
 extern FILE		*outtran;
+extern unsigned int	t_print_count;
 extern char		*path_prefix;
 extern int		 debug;
 extern int		 verbose;
@@ -77,7 +79,10 @@ struct transcript {
     unsigned int	id;
     unsigned int        total_objects;  /* Total number of objects in transcript */
     unsigned int        active_objects; /* Active number (not overlaid) */
-    FILE		*t_in;
+    unsigned int        shadowed_objects; /* Overlaid by a higher transcript */
+    unsigned int        removed_objects;  /* Overlaid by a higher '-' line */
+    unsigned int        minus_objects;    /* '-' lines that took effect */
+    tfile_t		*t_in;	/* plain or compressed */
     char                *buffered; /* Full transcript buffer */
     char		*buffer_position;
     filepath_t		t_fullname[ MAXPATHLEN ];
@@ -99,6 +104,7 @@ extern int	     transcript_check( const filepath_t *path,
 				       struct stat *st, char *type,
 				       struct applefileinfo *afinfo,
 				       int parent_minus);
+extern int	     transcript_check_pinfo( pathinfo_t *pi, int parent_minus );
 /* switches governing the behavior of "transcript_check()" */
 extern int radmind_transcript_check_switches;
 #define RADTC_SWS_UID	0x0001
@@ -113,6 +119,9 @@ extern void	     transcript_init( const filepath_t *kfile, int location );
 extern transcript_t *transcript_select( void );
 extern void	     transcript_parse( transcript_t *tran );
 extern void	     transcript_free( void );
+extern transcript_t *transcript_open( const filepath_t *fullname,
+				      const filepath_t *shortname );
+extern void	     transcript_close( transcript_t *tran );
 extern void	     t_new( rad_Transcript_t type, const filepath_t *fullname,
 			    const filepath_t *shortname,
 			    const filepath_t *kfile );
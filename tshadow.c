@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/evp.h>
+
+#include "applefile.h"
+#include "transcript.h"
+#include "pathcmp.h"
+#include "usageopt.h"
+
+const EVP_MD    *md;
+
+int		case_sensitive = 1;
+int		tran_format = T_RELATIVE;
+
+char  *progname = "tshadow";
+
+/*
+ * exit codes:
+ *      0       Report printed.
+ *      >1     	An error occurred.
+ */
+
+/*
+ * Resolve the command file exactly as fsdiff does, then report what
+ * each transcript ended up contributing.
+ */
+    static void
+tshadow( void )
+{
+    transcript_t	*tran, **trans;
+    int			ntrans = 0, width, best, run, useful, i, j;
+    unsigned int	skipped;
+
+    for (;;) {
+	tran = transcript_select();
+	if ( tran->t_eof ) {
+	    break;
+	}
+	transcript_parse( tran );
+    }
+
+    for ( tran = tran_head; tran != NULL; tran = tran->t_next ) {
+	ntrans++;
+    }
+    if (( trans = calloc( ntrans, sizeof( transcript_t * ))) == NULL ) {
+	perror( "calloc" );
+	exit( 2 );
+    }
+
+    /* tran_head is highest precedence first, list lowest first */
+    i = ntrans;
+    for ( tran = tran_head; tran != NULL; tran = tran->t_next ) {
+	trans[ --i ] = tran;
+    }
+
+    printf( "# lowest precedence first\n" );
+    printf( "#%7s %7s %8s %7s %7s %7s  %s\n", "lines", "active",
+	    "shadowed", "removed", "minus", "skipped", "transcript" );
+
+    width = 0;
+    for ( i = 0; i < ntrans; i++ ) {
+	tran = trans[ i ];
+	if ( tran->t_type == T_NULL ) {
+	    continue;
+	}
+	width++;
+
+	/* excluded, or outside of the path given */
+	skipped = tran->total_objects - tran->active_objects -
+		tran->shadowed_objects - tran->removed_objects -
+		tran->minus_objects;
+	printf( " %7u %7u %8u %7u %7u %7u  %s\n", tran->total_objects,
+		tran->active_objects, tran->shadowed_objects,
+		tran->removed_objects, tran->minus_objects, skipped,
+		tran->t_shortname );
+    }
+
+    printf( "#\n" );
+    printf( "# %d transcript%s merged by fsdiff\n", width,
+	    ( width == 1 ) ? "" : "s" );
+
+    best = width;
+    for ( i = 0; i < ntrans; i++ ) {
+	tran = trans[ i ];
+	if (( tran->t_type == T_NULL ) || ( tran->t_type == T_SPECIAL )) {
+	    continue;
+	}
+	if (( tran->active_objects == 0 ) && ( tran->minus_objects == 0 )) {
+	    printf( "# %s contributes nothing, remove it from %s\n",
+		    tran->t_shortname, tran->t_kfile );
+	    best--;
+	} else if (( tran->total_objects > 0 ) &&
+		(( tran->shadowed_objects + tran->removed_objects ) * 2 >=
+		tran->total_objects )) {
+	    printf( "# %s is mostly overlaid ( %u of %u lines )\n",
+		    tran->t_shortname,
+		    tran->shadowed_objects + tran->removed_objects,
+		    tran->total_objects );
+	}
+    }
+
+    /*
+     * Adjacent positive transcripts from the same command file can be
+     * combined with lmerge, which wants the highest precedence first.
+     */
+    for ( i = 0; i < ntrans; i = j ) {
+	for ( j = i + 1; j < ntrans; j++ ) {
+	    if (( trans[ i ]->t_type != T_POSITIVE ) ||
+		    ( trans[ j ]->t_type != T_POSITIVE ) ||
+		    ( strcmp( (char *) trans[ i ]->t_kfile,
+		    (char *) trans[ j ]->t_kfile ) != 0 )) {
+		break;
+	    }
+	}
+	run = j - i;
+	if ( run < 2 ) {
+	    continue;
+	}
+	printf( "# lmerge could combine %d transcripts from %s:\n#\tlmerge",
+		run, trans[ i ]->t_kfile );
+	for ( useful = 0; --j >= i; ) {
+	    printf( " %s", trans[ j ]->t_shortname );
+	    if (( trans[ j ]->active_objects > 0 ) ||
+		    ( trans[ j ]->minus_objects > 0 )) {
+		useful++;
+	    }
+	}
+	printf( " <merged>\n" );
+	j = i + run;
+
+	/* transcripts that contribute nothing were counted already */
+	if ( useful > 1 ) {
+	    best -= useful - 1;
+	}
+    }
+
+    printf( "# at best, fsdiff would merge %d\n", best );
+
+    free( trans );
+}
+
+
+extern char *optarg;
+extern int optind, opterr, optopt;
+
+/*
+ * Command-line options
+ *
+ * Formerly getopt - "B:dHIK:QsV"
+ */
+
+static const usageopt_t main_usage[] =
+  {
+    { (struct option) { "buffer-size", required_argument,  NULL, 'B' },
+      "Max size of transcript file to buffer in memory (reduces file descriptor usage)", "0-maxint"},
+
+    { (struct option) { "case-insensitive", no_argument,   NULL, 'I' },
+     		"case insensitive when comparing paths", NULL },
+
+    { (struct option) { "command-file", required_argument, NULL, 'K' },
+                "Specify command file, defaults to '" _RADMIND_COMMANDFILE "'", "command.K" },
+
+    { (struct option) { "debug", no_argument, NULL, 'd'},
+      		"Raise debugging level to see what's happening", NULL},
+
+    { (struct option) { "server", no_argument, NULL, 's'},
+      "Indicate that 'tshadow' is running on a 'radmind' server", NULL},
+
+    { (struct option) { "help",         no_argument,       NULL, 'H' },
+     		"This message", NULL },
+
+    { (struct option) { "version",      no_argument,       NULL, 'V' },
+     		"show version number and exits", NULL },
+
+    { (struct option) { "verbose",	no_argument,	   NULL, 'Q' },
+      		"Turn up verbose mode", NULL },
+
+    /* End of list */
+    { (struct option) {(char *) NULL, 0, (int *) NULL, 0}, (char *) NULL, (char *) NULL}
+  }; /* end of main_usage[] */
+
+/* Main */
+
+    int
+main( int argc, char **argv )
+{
+    int			c, err = 0, defaultkfile = 1, server = 0, len;
+    int                 tmp_i;
+    extern char		*version;
+    filepath_t	        *kfile = (filepath_t *) _RADMIND_COMMANDFILE;
+    int                  optndx = 0;
+    struct option       *main_opts;
+    char                *main_optstr;
+
+    /* Get our name from argv[0] */
+    for (main_optstr = argv[0]; *main_optstr; main_optstr++) {
+        if (*main_optstr == '/')
+	    progname = main_optstr+1;
+    }
+
+    main_opts = usageopt_option_new (main_usage, &main_optstr);
+
+    while (( c = getopt_long (argc, argv, main_optstr, main_opts, &optndx)) != -1) {
+	switch( c ) {
+	case 'B':
+	    tmp_i = atoi (optarg);
+
+	    if ((errno == 0) && (tmp_i >= 0)) {
+	        transcript_buffer_size = tmp_i;
+	    }
+	    break;
+
+	case 'd':
+	    debug++;
+	    break;
+
+	case 'Q': /* --verbose */
+	    verbose ++;
+	    break;
+
+	case 'K':
+	    defaultkfile = 0;
+	    kfile = (filepath_t *) optarg;
+	    break;
+
+	case 'I':
+	    case_sensitive = 0;
+	    break;
+
+	case 's':
+	    server = 1;
+	    break;
+
+	case 'V':
+	    printf( "%s\n", version );
+	    exit( 0 );
+
+	case 'H':  /* --help */
+	  usageopt_usage (stdout, 1 /* verbose */, progname,  main_usage,
+			  "[ <path> ]", 80);
+	  exit (0);
+
+	default:
+	    fprintf (stderr, "%s: Invalid or unsupported option, '-%c'\n",
+		     progname, c);
+	    err++;
+	    break;
+	}
+    }
+
+    if (( argc - optind ) > 1 ) {
+	err++;
+    }
+
+    if ( server && defaultkfile ) {
+        fprintf (stderr, "%s: -s requires -K\n", progname);
+	err++;
+    }
+
+    if ( err ) {
+        usageopt_usage (stderr, 0 /* not verbose */, progname,  main_usage,
+			"[ <path> ]", 80);
+	fprintf (stderr, "%s: Use --help to get more verbose usage\n",
+		 progname);
+        exit( 2 );
+    }
+
+    /* Only count lines under path, as fsdiff would see them. */
+    if ( optind < argc ) {
+	path_prefix = argv[ optind ];
+	len = strlen( path_prefix );
+	if (( len > 1 ) && ( path_prefix[ len - 1 ] == '/' )) {
+	    path_prefix[ len - 1 ] = '\0';
+	    len--;
+	}
+	if (( path_prefix[ 0 ] == '.' ) &&
+		(( len == 1 ) || ( path_prefix[ 1 ] == '/' ))) {
+	    tran_format = T_RELATIVE;
+	} else {
+	    tran_format = T_ABSOLUTE;
+	}
+    }
+
+    /* initialize the transcripts */
+    edit_path = APPLICABLE;
+    outtran = stdout;
+    if ( server ) {
+	transcript_init( kfile, K_SERVER );
+    } else {
+	transcript_init( kfile, K_CLIENT );
+    }
+
+    tshadow( );
+
+    exit( 0 );
+}
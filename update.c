@@ -15,6 +15,7 @@
 #include <sys/attr.h>
 #endif /* __APPLE__ */
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,14 +45,136 @@ extern int create_prefix;
 extern int	lchmod( const char *, mode_t ) __attribute__(( weak ));
 #endif /* HAVE_LCHMOD */
 
+#if defined( HAVE_FUTIMENS ) && defined( HAVE_UTIMENSAT ) && \
+	defined( HAVE_FCHMODAT ) && defined( HAVE_FCHOWNAT )
+#define UPDATE_AT
+#endif
+
+#ifdef UPDATE_AT
+/*
+ * Transcripts are sorted, so neighbouring lines usually share a
+ * directory.  It's opened once, and updates name files relative to it.
+ */
+static int		update_dirfd = -1;
+static char		update_dir[ MAXPATHLEN ];
+
+/* lapply calls this whenever it removes something */
+    void
+update_forget( void )
+{
+    if ( update_dirfd >= 0 ) {
+	close( update_dirfd );
+	update_dirfd = -1;
+    }
+}
+
+/* the directory fd and name to pass to the *at() calls for path */
+    static int
+update_parent( const filepath_t *path, const char **base )
+{
+    const char		*p;
+    size_t		len;
+
+    *base = (const char *) path;
+    if (( p = strrchr( (const char *) path, '/' )) == NULL ) {
+	return( AT_FDCWD );
+    }
+    if (( len = p - (const char *) path ) == 0 || len >= MAXPATHLEN ) {
+	return( AT_FDCWD );
+    }
+
+    if (( update_dirfd < 0 ) || ( strlen( update_dir ) != len ) ||
+	    ( strncmp( update_dir, (const char *) path, len ) != 0 )) {
+	update_forget( );
+	memcpy( update_dir, path, len );
+	update_dir[ len ] = '\0';
+	if (( update_dirfd = open( update_dir,
+		O_RDONLY | O_DIRECTORY, 0 )) < 0 ) {
+	    return( AT_FDCWD );
+	}
+    }
+    *base = p + 1;
+    return( update_dirfd );
+}
+#else /* UPDATE_AT */
+    void
+update_forget( void )
+{
+}
+#endif /* UPDATE_AT */
+
+/*
+ * Metadata is set through fd when the caller has the file open, and
+ * otherwise by path.
+ */
+    static int
+update_utime( int fd, const filepath_t *path, time_t atime, time_t mtime )
+{
+#ifdef UPDATE_AT
+    struct timespec	ts[ 2 ];
+    const char		*base;
+
+    ts[ 0 ].tv_sec = atime;
+    ts[ 0 ].tv_nsec = 0;
+    ts[ 1 ].tv_sec = mtime;
+    ts[ 1 ].tv_nsec = 0;
+    if ( fd >= 0 ) {
+	return( futimens( fd, ts ));
+    }
+    fd = update_parent( path, &base );
+    return( utimensat( fd, base, ts, 0 ));
+#else /* UPDATE_AT */
+    struct utimbuf	times;
+
+    times.actime = atime;
+    times.modtime = mtime;
+    return( utime( (const char *) path, &times ));
+#endif /* UPDATE_AT */
+}
+
+    static int
+update_chown( int fd, const filepath_t *path, uid_t uid, gid_t gid )
+{
+#ifdef UPDATE_AT
+    const char		*base;
+
+    if ( fd >= 0 ) {
+	return( fchown( fd, uid, gid ));
+    }
+    fd = update_parent( path, &base );
+    return( fchownat( fd, base, uid, gid, 0 ));
+#else /* UPDATE_AT */
+    return( chown( (const char *) path, uid, gid ));
+#endif /* UPDATE_AT */
+}
+
+    static int
+update_chmod( int fd, const filepath_t *path, mode_t mode )
+{
+#ifdef UPDATE_AT
+    const char		*base;
+
+    if ( fd >= 0 ) {
+	return( fchmod( fd, mode ));
+    }
+    fd = update_parent( path, &base );
+    return( fchmodat( fd, base, mode, 0 ));
+#else /* UPDATE_AT */
+    return( chmod( (const char *) path, mode ));
+#endif /* UPDATE_AT */
+}
+
+/*
+ * fd, if not -1, is path open for reading, and st its fstat().
+ */
     int
 update( const filepath_t *path, const filepath_t *displaypath, int present,
 	int newfile, struct stat *st, int tac, char **targv,
-	struct applefileinfo *afinfo )
+	struct applefileinfo *afinfo, int fd )
 {
     int			timeupdated = 0;
     mode_t              mode;
-    struct utimbuf      times;
+    time_t		mtime;
     uid_t               uid;
     gid_t               gid;
     dev_t               dev;
@@ -73,10 +196,9 @@ update( const filepath_t *path, const filepath_t *displaypath, int present,
 
 	mode = strtol( targv[ 2 ], (char **)NULL, 8 );
 
-	times.modtime = atoi( targv[ 5 ] );
-	if ( times.modtime != st->st_mtime ) {
-	    times.actime = st->st_atime;
-	    if ( utime( (const char *) path, &times ) != 0 ) {
+	mtime = atoi( targv[ 5 ] );
+	if ( mtime != st->st_mtime ) {
+	    if ( update_utime( fd, path, st->st_atime, mtime ) != 0 ) {
 	        perror( (const char *) path );
 		return( 1 );
 	    }
@@ -389,7 +511,7 @@ update( const filepath_t *path, const filepath_t *displaypath, int present,
     uid = atoi( targv[ 3 ] );
     gid = atoi( targv[ 4 ] );
     if ( uid != st->st_uid || gid != st->st_gid ) {
-        if ( chown( (const char *) path, uid, gid ) != 0 ) {
+        if ( update_chown( fd, path, uid, gid ) != 0 ) {
 	  perror( (const char *) path );
 	    return( 1 );
 	}
@@ -408,7 +530,7 @@ update( const filepath_t *path, const filepath_t *displaypath, int present,
     if (( mode != ( T_MODE & st->st_mode )) ||
             (( uid != st->st_uid || gid != st->st_gid ) &&
             (( mode & ( S_ISUID | S_ISGID )) != 0 ))) {
-        if ( chmod( (const char *) path, mode ) != 0 ) {
+        if ( update_chmod( fd, path, mode ) != 0 ) {
 	  perror((const char *) path );
 	    return( 1 );
 	}
@@ -10,6 +10,8 @@
 #  include "applefile.h"
 
 extern int update( const filepath_t *path, const filepath_t *displaypath, int present, int newfile,
-		   struct stat *st, int tac, char **targv, struct applefileinfo *afinfo );
+		   struct stat *st, int tac, char **targv, struct applefileinfo *afinfo,
+		   int fd );
+extern void update_forget( void );
 
 #endif /* defined(_RADMIND_UPDATE_H) */
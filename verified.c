@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif /* HAVE_SYS_XATTR_H */
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include "digest.h"
+#include "largefile.h"
+#include "verified.h"
+
+#if defined(HAVE_SYS_XATTR_H) && defined(HAVE_FSETXATTR)
+#define VERIFIED_XATTR
+#endif
+
+#define VERIFIED_NAME	"user.radmind.verified"
+
+/*
+ * Setting the mark changes the file's ctime, so the mark holds the time
+ * it was set instead, and a ctime later than that by more than this
+ * many microseconds means the file has been changed since.
+ */
+#define VERIFIED_SLACK	100000LL
+
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+#define ST_MTIME_NSEC(st)	((st)->st_mtim.tv_nsec)
+#define ST_CTIME_NSEC(st)	((st)->st_ctim.tv_nsec)
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+#define ST_MTIME_NSEC(st)	((st)->st_mtimespec.tv_nsec)
+#define ST_CTIME_NSEC(st)	((st)->st_ctimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st)	0L
+#define ST_CTIME_NSEC(st)	0L
+#endif
+
+static EVP_MD_CTX	*verified_mdctx = NULL;
+
+/* one digest context, reused for every file stored */
+    EVP_MD_CTX *
+verified_ctx( void )
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    static EVP_MD_CTX		ctx;
+
+    if ( verified_mdctx == NULL ) {
+	EVP_MD_CTX_init( &ctx );
+	verified_mdctx = &ctx;
+    }
+#else /* OPENSSL_VERSION_NUMBER */
+    if ( verified_mdctx == NULL ) {
+	verified_mdctx = EVP_MD_CTX_new();
+    }
+#endif /* OPENSSL_VERSION_NUMBER */
+    return( verified_mdctx );
+}
+
+#ifdef VERIFIED_XATTR
+/* "<checksum type> <size> <mtime> <checksum> " */
+    static int
+verified_value( const struct stat *st, const char *cksum_b64, char *value,
+	size_t len )
+{
+    extern EVP_MD	*md;
+
+    if ( snprintf( value, len, "%s %" PRIofft " %ld.%09ld %s ",
+	    digest_name( md ), st->st_size, (long)st->st_mtime,
+	    (long)ST_MTIME_NSEC( st ), cksum_b64 ) >= len ) {
+	return( -1 );
+    }
+    return( 0 );
+}
+
+    static long long
+verified_ctime( const struct stat *st )
+{
+    return((long long)st->st_ctime * 1000000 + ST_CTIME_NSEC( st ) / 1000 );
+}
+
+    static int
+verified_set( int fd, const char *value )
+{
+#ifdef __APPLE__
+    return( fsetxattr( fd, VERIFIED_NAME, value, strlen( value ), 0, 0 ));
+#else /* __APPLE__ */
+    return( fsetxattr( fd, VERIFIED_NAME, value, strlen( value ), 0 ));
+#endif /* __APPLE__ */
+}
+
+    static void
+verified_remove( int fd )
+{
+#ifdef __APPLE__
+    (void)fremovexattr( fd, VERIFIED_NAME, 0 );
+#else /* __APPLE__ */
+    (void)fremovexattr( fd, VERIFIED_NAME );
+#endif /* __APPLE__ */
+}
+#endif /* VERIFIED_XATTR */
+
+/*
+ * Mark fd, just stored, as having checksum cksum_b64.
+ *
+ * Return Value:
+ *	-1 - error
+ *	 0 - OKAY, or not supported
+ */
+    int
+verified_mark( int fd, const char *cksum_b64 )
+{
+#ifdef VERIFIED_XATTR
+    char		value[ 256 ];
+    struct stat		st;
+    struct timeval	tv;
+    size_t		len;
+
+    if (( gettimeofday( &tv, NULL ) != 0 ) || ( fstat( fd, &st ) != 0 ) ||
+	    ( verified_value( &st, cksum_b64, value, sizeof( value )) != 0 )) {
+	return( -1 );
+    }
+    /* "... <when marked>" */
+    len = strlen( value );
+    if ( snprintf( value + len, sizeof( value ) - len, "%ld.%06ld",
+	    (long)tv.tv_sec, (long)tv.tv_usec ) >= sizeof( value ) - len ) {
+	return( -1 );
+    }
+    if ( verified_set( fd, value ) != 0 ) {
+	return( -1 );
+    }
+
+    /* too slow to set to tell it from a later change, so not kept */
+    if (( fstat( fd, &st ) != 0 ) || ( verified_ctime( &st ) >
+	    (long long)tv.tv_sec * 1000000 + tv.tv_usec + VERIFIED_SLACK )) {
+	verified_remove( fd );
+    }
+    return( 0 );
+#else /* VERIFIED_XATTR */
+    return( 0 );
+#endif /* VERIFIED_XATTR */
+}
+
+/*
+ * Return Value:
+ *	0 - fd isn't known to have cksum_b64
+ *	1 - fd was verified to have cksum_b64 when stored, and hasn't
+ *	    changed since
+ */
+    int
+verified_check( int fd, const char *cksum_b64 )
+{
+#ifdef VERIFIED_XATTR
+    char		value[ 256 ], expect[ 256 ];
+    struct stat		st;
+    ssize_t		len;
+    size_t		elen;
+    long		sec, usec;
+
+#ifdef __APPLE__
+    len = fgetxattr( fd, VERIFIED_NAME, value, sizeof( value ) - 1, 0, 0 );
+#else /* __APPLE__ */
+    len = fgetxattr( fd, VERIFIED_NAME, value, sizeof( value ) - 1 );
+#endif /* __APPLE__ */
+    if ( len <= 0 ) {
+	return( 0 );
+    }
+    value[ len ] = '\0';
+
+    if (( fstat( fd, &st ) != 0 ) ||
+	    ( verified_value( &st, cksum_b64, expect, sizeof( expect )) != 0 )) {
+	return( 0 );
+    }
+    elen = strlen( expect );
+    if (( strncmp( value, expect, elen ) != 0 ) ||
+	    ( sscanf( value + elen, "%ld.%ld", &sec, &usec ) != 2 )) {
+	return( 0 );
+    }
+    /* anything done to it since it was marked changed its ctime */
+    return( verified_ctime( &st ) <=
+	    (long long)sec * 1000000 + usec + VERIFIED_SLACK );
+#else /* VERIFIED_XATTR */
+    return( 0 );
+#endif /* VERIFIED_XATTR */
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2015 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#if !defined(_RADMIND_VERIFIED_H)
+#  define _RADMIND_VERIFIED_H "$Id$"
+
+/*
+ * A file whose checksum the server checked as it was stored is marked
+ * with an extended attribute holding the checksum, the file's size and
+ * mtime and when it was marked, so that lcksum can skip it while it's
+ * unchanged, its ctime no later than the mark.  Where extended attributes
+ * aren't supported nothing is marked.
+ */
+
+extern EVP_MD_CTX	*verified_ctx( void );
+extern int		verified_mark( int fd, const char *cksum_b64 );
+extern int		verified_check( int fd, const char *cksum_b64 );
+
+#endif /* defined(_RADMIND_VERIFIED_H) */
@@ -6,4 +6,11 @@
 #include "config.h"
 
 char *version = VERSION;
-char *checksumlist = "sha1\nsha\nmd5\nmd2\ndss1\nmdc2\nripemd160";
+char *checksumlist = "sha1\nsha\nmd5\nmd2\ndss1\nmdc2\nripemd160"
+#ifdef HAVE_BLAKE3
+	"\nblake3"
+#endif /* HAVE_BLAKE3 */
+#ifdef HAVE_XXHASH
+	"\nxxh3-128"
+#endif /* HAVE_XXHASH */
+	;